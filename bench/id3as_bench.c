@@ -0,0 +1,402 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <ctype.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "id3as_libav.h"
+#include <libavfilter/avfilter.h>
+
+// Standalone driver for id3as_codecs filter graphs.  Builds a graph from
+// either a text description or a term_to_binary'd file and pushes frames
+// through it as fast as possible, then reports throughput, per-filter
+// latency and resource usage.  Graph output is discarded.
+//
+// A text graph is an Erlang term in the same shape as the one sent with
+// the initialise command, e.g.
+//
+//   {"raw video input", [{"width", "1920"}, {"height", "1080"}, {"pixel_format", "0"}], [],
+//    [{"video rescaler", [{"output_width", "640"}, {"output_height", "360"}, {"output_pixel_format", "0"}], [], []}]}
+//
+// Lines starting with % are comments.
+
+#define SYNTHETIC_FRAMES 8
+#define DEFAULT_PTS_INCREMENT 3600 // 25fps in 90kHz
+
+typedef struct _bench_options
+{
+  char *graph_file;
+  int graph_is_binary;
+  char *input_file;
+  long frame_count;
+  long frame_size;
+  int64_t pts_increment;
+  int sync_mode;
+
+} bench_options;
+
+typedef struct _packet_source
+{
+  unsigned char *data;
+  long size;
+  long offset;
+
+  unsigned char *synthetic[SYNTHETIC_FRAMES];
+  long synthetic_size;
+  int next_synthetic;
+
+} packet_source;
+
+static void usage(char *name)
+{
+  fprintf(stderr,
+	  "usage: %s (-g graph.txt | -b graph.bin) [-n frames] [-s frame_size | -i packets] [-p pts_increment] [-a]\n"
+	  "  -g  text graph description\n"
+	  "  -b  term_to_binary graph description\n"
+	  "  -n  number of frames to send (default 1000; with -i, 0 means whole file)\n"
+	  "  -s  size in bytes of each synthetic frame\n"
+	  "  -i  file of packets, each prefixed by a 4 byte big-endian length\n"
+	  "  -p  pts increment per frame in 90kHz units (default %d)\n"
+	  "  -a  run in async mode\n",
+	  name, DEFAULT_PTS_INCREMENT);
+  exit(2);
+}
+
+static unsigned char *read_file(char *filename, long *size)
+{
+  FILE *f = fopen(filename, "rb");
+  struct stat st;
+
+  if (!f || fstat(fileno(f), &st) != 0) {
+    fprintf(stderr, "Failed to open %s\n", filename);
+    exit(1);
+  }
+
+  unsigned char *data = malloc(st.st_size + 1);
+
+  if (fread(data, 1, st.st_size, f) != st.st_size) {
+    fprintf(stderr, "Failed to read %s\n", filename);
+    exit(1);
+  }
+
+  fclose(f);
+
+  data[st.st_size] = 0;
+  *size = st.st_size;
+
+  return data;
+}
+
+// Strips comments and collapses whitespace so the description can go
+// straight through ei_x_format
+static char *normalise_description(char *text)
+{
+  char *out = malloc(strlen(text) + 1);
+  char *p = out;
+  int in_string = 0;
+  int at_line_start = 1;
+
+  for (char *c = text; *c; c++)
+    {
+      if (at_line_start && *c == '%') {
+	while (*c && *c != '\n') c++;
+	if (!*c) break;
+      }
+
+      at_line_start = (*c == '\n');
+
+      if (*c == '"') {
+	in_string = !in_string;
+      }
+
+      if (!in_string && isspace((unsigned char) *c)) {
+	continue;
+      }
+
+      *p++ = *c;
+    }
+
+  *p = 0;
+
+  return out;
+}
+
+static ID3ASFilterContext *checked_build_graph(char *buf, bench_options *options)
+{
+  char *filename = options->graph_file;
+  graph_error error;
+  ID3ASFilterContext *graph = build_graph(buf, 0, options->sync_mode, &error);
+
+  if (!graph) {
+    fprintf(stderr, "Invalid graph %s: %s at [", filename, error.filter_name);
+
+    for (int i = 0; i < error.depth; i++)
+      {
+	fprintf(stderr, i ? ", %d" : "%d", error.path[i]);
+      }
+
+    fprintf(stderr, "]: %s\n", error.message);
+    exit(1);
+  }
+
+  return graph;
+}
+
+static ID3ASFilterContext *load_graph(bench_options *options)
+{
+  long size;
+  char *description = (char *) read_file(options->graph_file, &size);
+
+  if (options->graph_is_binary) {
+    return checked_build_graph(description, options);
+  }
+
+  ei_x_buff term;
+  char *normalised = normalise_description(description);
+
+  ei_x_new_with_version(&term);
+
+  if (ei_x_format_wo_ver(&term, normalised) != 0) {
+    fprintf(stderr, "Failed to parse graph description %s\n", options->graph_file);
+    exit(1);
+  }
+
+  free(normalised);
+  free(description);
+
+  return checked_build_graph(term.buff, options);
+}
+
+static void init_packet_source(packet_source *source, bench_options *options)
+{
+  memset(source, 0, sizeof(packet_source));
+
+  if (options->input_file) {
+    source->data = read_file(options->input_file, &source->size);
+    return;
+  }
+
+  // A few different frames so the graph can't get away with seeing the same
+  // data every time
+  source->synthetic_size = options->frame_size;
+
+  for (int i = 0; i < SYNTHETIC_FRAMES; i++)
+    {
+      source->synthetic[i] = malloc(options->frame_size);
+
+      for (long j = 0; j < options->frame_size; j++)
+	{
+	  source->synthetic[i][j] = (unsigned char) ((j * 7 + i * 31) ^ (j >> 8));
+	}
+    }
+}
+
+static int next_packet(packet_source *source, unsigned char **data, unsigned int *size)
+{
+  if (source->data) {
+    if (source->offset + 4 > source->size) {
+      return 0;
+    }
+
+    unsigned char *p = source->data + source->offset;
+    unsigned int len = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+    if (source->offset + 4 + len > source->size) {
+      return 0;
+    }
+
+    *data = p + 4;
+    *size = len;
+    source->offset += 4 + len;
+
+    return 1;
+  }
+
+  *data = source->synthetic[source->next_synthetic];
+  *size = source->synthetic_size;
+  source->next_synthetic = (source->next_synthetic + 1) % SYNTHETIC_FRAMES;
+
+  return 1;
+}
+
+static int encode_metadata(char *buf, int64_t pts)
+{
+  int i = 0;
+
+  ei_encode_version(buf, &i);
+  ei_encode_tuple_header(buf, &i, 2);
+  ei_encode_longlong(buf, &i, pts);
+  ei_encode_longlong(buf, &i, pts);
+
+  return i;
+}
+
+static double seconds_since(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint64_t total_ns(latency_histogram *histogram)
+{
+  latency_summary summary;
+
+  get_latency_summary(histogram, &summary);
+
+  return summary.total;
+}
+
+static void report_filter(FILE *out, ID3ASFilterContext *this, int depth, int *index)
+{
+  latency_summary summary;
+  uint64_t self;
+
+  get_latency_summary(this->execute_latency, &summary);
+
+  // Time in downstream filters that run on this thread is included in our
+  // total - take it off to get the filter's own cost
+  self = summary.total;
+
+  for (int i = 0; i < this->num_downstream_filters; i++)
+    {
+      ID3ASFilterContext *child = this->downstream_filters[i];
+      uint64_t child_total = child->queue_latency ? 0 : total_ns(child->execute_latency);
+
+      self = self > child_total ? self - child_total : 0;
+    }
+
+  fprintf(out, "%3d %*s%-*s %9" PRIu64 " %10.1f %10.1f %9.1f %9.1f %9.1f %9.1f\n",
+	  (*index)++, depth * 2, "", 28 - depth * 2, this->filter->name,
+	  summary.count,
+	  summary.total / 1e6,
+	  self / 1e6,
+	  summary.count ? summary.total / 1e3 / summary.count : 0.0,
+	  summary.p50 / 1e3, summary.p99 / 1e3, summary.max / 1e3);
+
+  if (this->queue_latency) {
+    get_latency_summary(this->queue_latency, &summary);
+    fprintf(out, "    %*s%-*s %9" PRIu64 " %10s %10s %9.1f %9.1f %9.1f %9.1f\n",
+	    depth * 2, "", 28 - depth * 2, "(queued)",
+	    summary.count, "", "",
+	    summary.count ? summary.total / 1e3 / summary.count : 0.0,
+	    summary.p50 / 1e3, summary.p99 / 1e3, summary.max / 1e3);
+  }
+
+  for (int i = 0; i < this->num_downstream_filters; i++)
+    {
+      report_filter(out, this->downstream_filters[i], depth + 1, index);
+    }
+}
+
+static void report(FILE *out, ID3ASFilterContext *graph, long frames, double elapsed)
+{
+  struct rusage usage;
+  int index = 0;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(out, "frames        %ld\n", frames);
+  fprintf(out, "elapsed       %.3f s\n", elapsed);
+  fprintf(out, "fps           %.1f\n", frames / elapsed);
+  fprintf(out, "cpu user      %.3f s\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+  fprintf(out, "cpu system    %.3f s\n", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+  fprintf(out, "peak rss      %ld KiB\n\n", usage.ru_maxrss);
+
+  fprintf(out, "%3s %-28s %9s %10s %10s %9s %9s %9s %9s\n",
+	  "#", "filter", "frames", "total ms", "self ms", "mean us", "p50 us", "p99 us", "max us");
+
+  report_filter(out, graph, 0, &index);
+}
+
+int main(int argc, char **argv)
+{
+  bench_options options = {
+    .frame_count = 1000,
+    .frame_size = 1920 * 1080 * 3 / 2,
+    .pts_increment = DEFAULT_PTS_INCREMENT,
+    .sync_mode = 1
+  };
+  int opt;
+
+  while ((opt = getopt(argc, argv, "g:b:n:s:i:p:a")) != -1)
+    {
+      switch (opt) {
+      case 'g': options.graph_file = optarg; options.graph_is_binary = 0; break;
+      case 'b': options.graph_file = optarg; options.graph_is_binary = 1; break;
+      case 'n': options.frame_count = atol(optarg); break;
+      case 's': options.frame_size = atol(optarg); break;
+      case 'i': options.input_file = optarg; break;
+      case 'p': options.pts_increment = atoll(optarg); break;
+      case 'a': options.sync_mode = 0; break;
+      default: usage(argv[0]);
+      }
+    }
+
+  if (!options.graph_file) {
+    usage(argv[0]);
+  }
+
+  if (options.input_file && options.frame_count == 1000) {
+    options.frame_count = 0;
+  }
+
+  // Outputs write to stdout as if it were the port - keep our own copy for
+  // the report and throw the rest away
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  avcodec_register_all();
+  avfilter_register_all();
+
+  id3as_filters_register_all();
+
+  ID3ASFilterContext *graph = load_graph(&options);
+
+  packet_source source;
+  init_packet_source(&source, &options);
+
+  char metadata[64];
+  unsigned char *data;
+  unsigned int data_size;
+  long frames = 0;
+  int64_t pts = 0;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while ((options.frame_count == 0 || frames < options.frame_count) && next_packet(&source, &data, &data_size))
+    {
+      int metadata_size = encode_metadata(metadata, pts);
+      uint64_t frame_start = latency_now();
+
+      graph->filter->execute_input(graph,
+				   (unsigned char *) metadata, metadata_size,
+				   NULL, 0,
+				   data, data_size);
+
+      record_latency(graph->execute_latency, latency_now() - frame_start);
+
+      pts += options.pts_increment;
+      frames++;
+    }
+
+  graph->filter->flush(graph);
+
+  report(out, graph, frames, seconds_since(&start));
+
+  // The graph's own context is in its arena
+  arena *arena = graph->arena;
+
+  close_graph(graph);
+  free_arena(&arena);
+
+  fclose(out);
+
+  return 0;
+}
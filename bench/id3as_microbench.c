@@ -0,0 +1,516 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <getopt.h>
+#include <time.h>
+
+#include "id3as_libav.h"
+
+// Micro-benchmarks for the kernels in c_src/kernels.c, plus the
+// av_samples_copy staging pattern used by the encoded audio output.
+//
+// Results are written as CSV, one row per case:
+//
+//   kernel,format,size,ns_per_call,mbytes_per_sec
+//
+// With -c, each case is compared with the matching row of a previously
+// saved run and the program exits non-zero if any case is slower than the
+// baseline by more than the threshold (-t, percent).
+
+#define RUNS 5
+#define TARGET_RUN_NS 50000000ULL // 50ms per run
+#define MAX_CASES 256
+
+typedef struct _bench_case bench_case;
+
+typedef void (*bench_fun)(bench_case *c);
+
+struct _bench_case
+{
+  const char *kernel;
+  const char *format;
+  int size;           // pixels or samples per call
+  long bytes;         // bytes touched per call
+
+  bench_fun fun;
+  AVFrame *frame;
+  AVFrame *other;
+  unsigned char *buffer;
+  uint8_t *staging[AV_NUM_DATA_POINTERS];
+  int staging_offset;
+  polyphase_resampler *resampler;
+  int sink;
+
+  double ns_per_call;
+};
+
+typedef struct _baseline_entry
+{
+  char kernel[64];
+  char format[32];
+  int size;
+  double ns_per_call;
+} baseline_entry;
+
+static bench_case cases[MAX_CASES];
+static int num_cases = 0;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_noise(uint8_t *p, int size, unsigned int seed)
+{
+  for (int i = 0; i < size; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      p[i] = seed >> 16;
+    }
+}
+
+static AVFrame *video_frame(enum PixelFormat pixfmt, int width, int height)
+{
+  AVFrame *frame = av_frame_alloc();
+
+  frame->format = pixfmt;
+  frame->width = width;
+  frame->height = height;
+
+  av_frame_get_buffer(frame, 32);
+
+  for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+    {
+      fill_noise(frame->buf[i]->data, frame->buf[i]->size, i + 1);
+    }
+
+  return frame;
+}
+
+static AVFrame *audio_frame(enum AVSampleFormat sample_format, int channel_layout, int nb_samples)
+{
+  AVFrame *frame = av_frame_alloc();
+
+  frame->format = sample_format;
+  frame->channel_layout = channel_layout;
+  frame->nb_samples = nb_samples;
+  frame->sample_rate = 48000;
+
+  av_frame_get_buffer(frame, 32);
+
+  for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+    {
+      fill_noise(frame->buf[i]->data, frame->buf[i]->size, i + 1);
+    }
+
+  // Keep float samples in range
+  if (sample_format == AV_SAMPLE_FMT_FLT || sample_format == AV_SAMPLE_FMT_FLTP)
+    {
+      int planes = sample_format == AV_SAMPLE_FMT_FLTP ? av_get_channel_layout_nb_channels(channel_layout) : 1;
+      int per_plane = sample_format == AV_SAMPLE_FMT_FLTP ? nb_samples : nb_samples * av_get_channel_layout_nb_channels(channel_layout);
+
+      for (int i = 0; i < planes; i++)
+	{
+	  float *p = (float *) frame->extended_data[i];
+
+	  for (int j = 0; j < per_plane; j++)
+	    {
+	      p[j] = ((j * 37 + i * 11) % 2001 - 1000) / 1000.0f;
+	    }
+	}
+    }
+
+  return frame;
+}
+
+//******************************************************************************
+// Kernels under test
+//******************************************************************************
+static void run_luma_stats(bench_case *c)
+{
+  AVFrame *f = c->frame;
+  uint32_t histogram[256];
+
+  luma_stats_pass(f->data[0], f->linesize[0], f->width, f->height, c->buffer, f->width / LUMA_BLOCK_SIZE, histogram);
+
+  c->sink += histogram[16] + c->buffer[0];
+}
+
+static void run_sum_abs_diff(bench_case *c)
+{
+  c->sink += sum_abs_diff(c->frame->data[0], c->other->data[0], c->frame->width * c->frame->height);
+}
+
+static void run_max_abs_diff(bench_case *c)
+{
+  c->sink += max_abs_diff(c->frame->data[0], c->other->data[0], c->frame->width * c->frame->height);
+}
+
+static void run_calc_avg(bench_case *c)
+{
+  AVFrame *f = c->frame;
+  int channels = av_get_channel_layout_nb_channels(f->channel_layout);
+  double level = 0;
+
+  switch (f->format) {
+  case AV_SAMPLE_FMT_S16:
+    level = calc_avg_s16(f->data[0], f->nb_samples * channels);
+    break;
+  case AV_SAMPLE_FMT_S32:
+    level = calc_avg_s32(f->data[0], f->nb_samples * channels);
+    break;
+  case AV_SAMPLE_FMT_FLT:
+    level = calc_avg_flt(f->data[0], f->nb_samples * channels);
+    break;
+  case AV_SAMPLE_FMT_DBL:
+    level = calc_avg_dbl(f->data[0], f->nb_samples * channels);
+    break;
+  case AV_SAMPLE_FMT_FLTP:
+    for (int i = 0; i < channels; i++)
+      {
+	level += calc_avg_flt(f->extended_data[i], f->nb_samples);
+      }
+    break;
+  }
+
+  c->sink += level > 0.5;
+}
+
+static void run_split_fltp_stereo(bench_case *c)
+{
+  select_planar_channel(c->frame, c->other, 0);
+  select_planar_channel(c->frame, c->other, 1);
+
+  c->sink += c->other->nb_samples;
+}
+
+static void run_deinterleave(bench_case *c)
+{
+  AVFrame *f = c->frame;
+  int channels = av_get_channel_layout_nb_channels(f->channel_layout);
+
+  switch (av_get_bytes_per_sample(f->format)) {
+  case 2:
+    deinterleave_16(f->data[0], c->other->extended_data, channels, f->nb_samples);
+    break;
+  case 4:
+    deinterleave_32(f->data[0], c->other->extended_data, channels, f->nb_samples);
+    break;
+  case 8:
+    deinterleave_64(f->data[0], c->other->extended_data, channels, f->nb_samples);
+    break;
+  }
+
+  c->sink += c->other->extended_data[channels - 1][0];
+}
+
+static void run_mix(bench_case *c)
+{
+  static float matrix[MAX_AUDIO_CHANNELS * MAX_AUDIO_CHANNELS];
+  int in_channels = av_get_channel_layout_nb_channels(c->frame->channel_layout);
+  int out_channels = av_get_channel_layout_nb_channels(c->other->channel_layout);
+
+  for (int i = 0; i < in_channels * out_channels; i++) matrix[i] = (i % 3) * 0.25f;
+
+  mix_channels_flt((const float **) c->frame->extended_data, (float **) c->other->extended_data,
+		   matrix, in_channels, out_channels, c->frame->nb_samples);
+
+  c->sink += c->other->extended_data[0][0];
+}
+
+static void run_convert(bench_case *c)
+{
+  AVFrame *f = c->frame;
+  int channels = av_get_channel_layout_nb_channels(f->channel_layout);
+
+  get_sample_converter(f->format, c->other->format)(f->data[0], c->other->data[0], f->nb_samples * channels);
+
+  c->sink += c->other->data[0][0];
+}
+
+static void run_polyphase(bench_case *c)
+{
+  int max_out = polyphase_max_output(c->resampler, c->frame->nb_samples);
+
+  c->sink += polyphase_resample(c->resampler, (const float **) c->frame->extended_data, c->frame->nb_samples,
+				(float **) c->other->extended_data, max_out);
+}
+
+// The luma plane of an adaptive deinterlace, with other as the previous frame
+static void run_motion_adaptive(bench_case *c)
+{
+  AVFrame *f = c->frame;
+  int linesize = f->linesize[0];
+
+  for (int y = 1; y < f->height - 1; y += 2)
+    {
+      uint8_t *line = f->data[0] + y * linesize;
+
+      motion_adaptive_line(c->buffer, line - linesize, line + linesize, line, c->other->data[0] + y * linesize, f->width, 10);
+    }
+
+  c->sink += c->buffer[0];
+}
+
+// Mirrors copy_frame_to_operating_buffer / process in audio_encoded_output.c
+// for a 1024 sample encoder frame size
+static void run_audio_staging(bench_case *c)
+{
+  AVFrame *f = c->frame;
+  int channels = av_get_channel_layout_nb_channels(f->channel_layout);
+  int frame_size = 1024;
+  int used = 0;
+
+  av_samples_copy(c->staging, f->extended_data, c->staging_offset, 0, f->nb_samples, channels, f->format);
+  c->staging_offset += f->nb_samples;
+
+  while (c->staging_offset - used >= frame_size)
+    {
+      av_samples_copy(c->other->extended_data, c->staging, 0, used, frame_size, channels, f->format);
+      used += frame_size;
+    }
+
+  av_samples_copy(c->staging, c->staging, 0, used, c->staging_offset - used, channels, f->format);
+  c->staging_offset -= used;
+}
+
+//******************************************************************************
+// Cases
+//******************************************************************************
+static void add_case(const char *kernel, const char *format, int size, long bytes, bench_fun fun, AVFrame *frame, AVFrame *other)
+{
+  bench_case *c = &cases[num_cases++];
+
+  memset(c, 0, sizeof(bench_case));
+  c->kernel = kernel;
+  c->format = format;
+  c->size = size;
+  c->bytes = bytes;
+  c->fun = fun;
+  c->frame = frame;
+  c->other = other;
+}
+
+static void add_cases()
+{
+  static const int sizes[][2] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+  static const int sample_counts[] = { 480, 1152, 4096 };
+
+  for (int i = 0; i < 3; i++)
+    {
+      int w = sizes[i][0], h = sizes[i][1];
+
+      add_case("luma_stats", "yuv420p", w * h, w * h, run_luma_stats, video_frame(PIX_FMT_YUV420P, w, h), NULL);
+      cases[num_cases - 1].buffer = malloc((w / LUMA_BLOCK_SIZE) * (h / LUMA_BLOCK_SIZE));
+      add_case("sum_abs_diff", "gray8", w * h, w * h * 2, run_sum_abs_diff, video_frame(PIX_FMT_GRAY8, w, h), video_frame(PIX_FMT_GRAY8, w, h));
+      add_case("max_abs_diff", "gray8", w * h, w * h * 2, run_max_abs_diff, video_frame(PIX_FMT_GRAY8, w, h), video_frame(PIX_FMT_GRAY8, w, h));
+      add_case("motion_adaptive", "yuv420p", w * h, w * h * 2, run_motion_adaptive, video_frame(PIX_FMT_YUV420P, w, h), video_frame(PIX_FMT_YUV420P, w, h));
+      cases[num_cases - 1].buffer = malloc(w);
+    }
+
+  for (int i = 0; i < 3; i++)
+    {
+      int n = sample_counts[i];
+
+      add_case("calc_avg", "s16", n, n * 2 * 2, run_calc_avg, audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, n), NULL);
+      add_case("calc_avg", "s32", n, n * 2 * 4, run_calc_avg, audio_frame(AV_SAMPLE_FMT_S32, AV_CH_LAYOUT_STEREO, n), NULL);
+      add_case("calc_avg", "flt", n, n * 2 * 4, run_calc_avg, audio_frame(AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_STEREO, n), NULL);
+      add_case("calc_avg", "fltp", n, n * 2 * 4, run_calc_avg, audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n), NULL);
+      add_case("calc_avg", "dbl", n, n * 2 * 8, run_calc_avg, audio_frame(AV_SAMPLE_FMT_DBL, AV_CH_LAYOUT_STEREO, n), NULL);
+
+      add_case("split_fltp_stereo", "fltp", n, 0, run_split_fltp_stereo,
+	       audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_MONO, n));
+
+      add_case("deinterleave", "s16", n, n * 2 * 2 * 2, run_deinterleave,
+	       audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_S16P, AV_CH_LAYOUT_STEREO, n));
+      add_case("deinterleave", "s16 5.1", n, n * 6 * 2 * 2, run_deinterleave,
+	       audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_5POINT1, n), audio_frame(AV_SAMPLE_FMT_S16P, AV_CH_LAYOUT_5POINT1, n));
+      add_case("deinterleave", "flt 7.1", n, n * 8 * 4 * 2, run_deinterleave,
+	       audio_frame(AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_7POINT1, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_7POINT1, n));
+
+      add_case("mix", "fltp 5.1>2", n, n * 8 * 4, run_mix,
+	       audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_5POINT1, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n));
+      add_case("mix", "fltp 7.1>2", n, n * 10 * 4, run_mix,
+	       audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_7POINT1, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n));
+      add_case("mix", "fltp 2>5.1", n, n * 8 * 4, run_mix,
+	       audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_5POINT1, n));
+
+      add_case("convert", "s16>flt", n, n * 2 * 6, run_convert,
+	       audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_STEREO, n));
+      add_case("convert", "flt>s16", n, n * 2 * 6, run_convert,
+	       audio_frame(AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, n));
+
+      for (int taps = 16; taps <= 64; taps *= 2)
+	{
+	  static const char *names[] = { "48k>44.1k 16", "48k>44.1k 32", "48k>44.1k 64" };
+
+	  add_case("polyphase", names[av_log2(taps) - 4], n, n * 2 * 4 * 2, run_polyphase,
+		   audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n));
+	  cases[num_cases - 1].resampler = allocate_polyphase_resampler(48000, 44100, 2, taps);
+	}
+
+      add_case("audio_staging", "s16", n, n * 2 * 2 * 3, run_audio_staging,
+	       audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, 1024));
+      add_case("audio_staging", "flt", n, n * 2 * 4 * 3, run_audio_staging,
+	       audio_frame(AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_STEREO, 1024));
+      add_case("audio_staging", "fltp", n, n * 2 * 4 * 3, run_audio_staging,
+	       audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, n), audio_frame(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, 1024));
+    }
+
+  for (int i = 0; i < num_cases; i++)
+    {
+      bench_case *c = &cases[i];
+
+      if (c->fun == run_audio_staging)
+	{
+	  int size;
+	  av_samples_alloc(c->staging, &size, av_get_channel_layout_nb_channels(c->frame->channel_layout),
+			   c->frame->nb_samples + 1024, c->frame->format, 1);
+	}
+    }
+}
+
+//******************************************************************************
+// Running and reporting
+//******************************************************************************
+static void run_case(bench_case *c)
+{
+  long iterations = 1;
+  double best = -1;
+
+  // Warm up and find an iteration count that takes roughly TARGET_RUN_NS
+  while (1)
+    {
+      uint64_t start = now_ns();
+      for (long i = 0; i < iterations; i++) c->fun(c);
+      uint64_t elapsed = now_ns() - start;
+
+      if (elapsed >= TARGET_RUN_NS / 10) {
+	iterations = iterations * TARGET_RUN_NS / elapsed + 1;
+	break;
+      }
+
+      iterations *= 10;
+    }
+
+  for (int run = 0; run < RUNS; run++)
+    {
+      uint64_t start = now_ns();
+      for (long i = 0; i < iterations; i++) c->fun(c);
+      double ns = (double) (now_ns() - start) / iterations;
+
+      if (best < 0 || ns < best) {
+	best = ns;
+      }
+    }
+
+  c->ns_per_call = best;
+}
+
+static int read_baseline(char *filename, baseline_entry *entries, int max_entries)
+{
+  FILE *f = fopen(filename, "r");
+  char line[256];
+  int n = 0;
+
+  if (!f) {
+    fprintf(stderr, "Failed to open baseline %s\n", filename);
+    exit(2);
+  }
+
+  while (n < max_entries && fgets(line, sizeof(line), f))
+    {
+      baseline_entry *e = &entries[n];
+
+      if (sscanf(line, "%63[^,],%31[^,],%d,%lf", e->kernel, e->format, &e->size, &e->ns_per_call) == 4) {
+	n++;
+      }
+    }
+
+  fclose(f);
+
+  return n;
+}
+
+static baseline_entry *find_baseline(baseline_entry *entries, int n, bench_case *c)
+{
+  for (int i = 0; i < n; i++)
+    {
+      if (strcmp(entries[i].kernel, c->kernel) == 0 &&
+	  strcmp(entries[i].format, c->format) == 0 &&
+	  entries[i].size == c->size) {
+	return &entries[i];
+      }
+    }
+
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  char *baseline_file = NULL;
+  char *filter = NULL;
+  double threshold = 10.0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:t:k:")) != -1)
+    {
+      switch (opt) {
+      case 'c': baseline_file = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      case 'k': filter = optarg; break;
+      default:
+	fprintf(stderr, "usage: %s [-k kernel] [-c baseline.csv [-t percent]]\n", argv[0]);
+	exit(2);
+      }
+    }
+
+  add_cases();
+
+  baseline_entry baseline[MAX_CASES];
+  int baseline_count = baseline_file ? read_baseline(baseline_file, baseline, MAX_CASES) : 0;
+  int regressions = 0;
+
+  printf(baseline_file ? "kernel,format,size,ns_per_call,mbytes_per_sec,baseline_ns_per_call,change_percent\n"
+	 : "kernel,format,size,ns_per_call,mbytes_per_sec\n");
+
+  for (int i = 0; i < num_cases; i++)
+    {
+      bench_case *c = &cases[i];
+
+      if (filter && strcmp(filter, c->kernel) != 0) {
+	continue;
+      }
+
+      run_case(c);
+
+      printf("%s,%s,%d,%.1f,%.1f", c->kernel, c->format, c->size, c->ns_per_call,
+	     c->bytes / c->ns_per_call * 1e9 / 1e6);
+
+      if (baseline_file) {
+	baseline_entry *e = find_baseline(baseline, baseline_count, c);
+
+	if (e) {
+	  double change = (c->ns_per_call - e->ns_per_call) * 100.0 / e->ns_per_call;
+
+	  printf(",%.1f,%+.1f", e->ns_per_call, change);
+
+	  if (change > threshold) {
+	    regressions++;
+	    fprintf(stderr, "REGRESSION %s/%s/%d: %.1fns -> %.1fns (%+.1f%%)\n",
+		    c->kernel, c->format, c->size, e->ns_per_call, c->ns_per_call, change);
+	  }
+	}
+	else {
+	  printf(",,");
+	}
+      }
+
+      printf("\n");
+      fflush(stdout);
+    }
+
+  return regressions ? 1 : 0;
+}
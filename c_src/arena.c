@@ -0,0 +1,102 @@
+#include "id3as_libav.h"
+
+// A bump allocator for memory that lives exactly as long as a graph: the
+// filter contexts, their private data and their downstream lists.  Every
+// allocation starts on a cache line, and consecutive allocations sit next to
+// each other, so a graph laid out in the order send_to_graph walks it is
+// mostly contiguous.  Nothing is freed individually; free_arena releases
+// the handful of blocks in one go.
+//
+// An arena has a single writer - the thread running graph commands - so
+// there is no locking.
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_BLOCK_SIZE 16384
+
+typedef struct _arena_block arena_block;
+
+struct _arena_block
+{
+  arena_block *next;
+  size_t size;
+  size_t used;
+  char data[0];
+};
+
+struct _arena
+{
+  arena_block *blocks;      // the block being allocated from first
+};
+
+static arena_block *add_block(arena *this, size_t size)
+{
+  // Room to align the first allocation whatever malloc returns
+  size_t block_size = FFMAX(size + ARENA_ALIGNMENT, ARENA_BLOCK_SIZE);
+  arena_block *block = malloc(sizeof(arena_block) + block_size);
+
+  if (!block) {
+    ERRORFMT("Failed to allocate %zu byte arena block\n", block_size);
+    exit(1);
+  }
+
+  block->next = this->blocks;
+  block->size = block_size;
+  block->used = 0;
+  this->blocks = block;
+
+  return block;
+}
+
+arena *allocate_arena()
+{
+  arena *this = malloc(sizeof(arena));
+
+  this->blocks = NULL;
+
+  return this;
+}
+
+// Zeroed, like av_mallocz
+void *arena_mallocz(arena *this, size_t size)
+{
+  arena_block *block = this->blocks;
+  uintptr_t p = 0;
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  if (block)
+    {
+      p = FFALIGN((uintptr_t) (block->data + block->used), ARENA_ALIGNMENT);
+    }
+
+  if (!block || p + size > (uintptr_t) (block->data + block->size))
+    {
+      block = add_block(this, size);
+      p = FFALIGN((uintptr_t) block->data, ARENA_ALIGNMENT);
+    }
+
+  block->used = p + size - (uintptr_t) block->data;
+
+  return memset((void *) p, 0, size);
+}
+
+void free_arena(arena **this)
+{
+  if (!*this) {
+    return;
+  }
+
+  arena_block *block = (*this)->blocks;
+
+  while (block)
+    {
+      arena_block *next = block->next;
+      free(block);
+      block = next;
+    }
+
+  free(*this);
+  *this = NULL;
+}
@@ -97,6 +97,7 @@ typedef struct _frame_entry_t
   queue_entry_t queue_entry;
   AVFrame *frame;
   AVRational timebase;
+  uint64_t enqueue_time;
   int exit_thread;
 
 } frame_entry_t;
@@ -113,16 +114,36 @@ typedef struct _thread_struct_t
   queue_root_t inbound_frame_queue;
   pthread_cond_t complete;
   pthread_mutex_t complete_mutex;
+  int removed;
 
 } thread_struct;
 
 typedef struct _codec_t
 {
   AVClass *av_class;
-  thread_struct *threads;
+  thread_struct **threads;
+  int stopped;
+
+  // Threads of removed branches, joined when we are closed
+  thread_struct **removed_threads;
+  int num_removed_threads;
 
 } codec_t;
 
+// av_frame_clone can't clone a frame with no picture (see send_to_filter),
+// but its side data is all there is to keep
+static AVFrame *clone_frame(AVFrame *frame)
+{
+  if (frame->data[0]) {
+    return av_frame_clone(frame);
+  }
+
+  AVFrame *clone = av_frame_alloc();
+  av_frame_copy_props(clone, frame);
+
+  return clone;
+}
+
 static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
 {
   codec_t *this = context->priv_data;
@@ -131,34 +152,58 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
     
     frame_entry_t *frame_entry = (frame_entry_t *) malloc(sizeof(frame_entry_t));
     frame_entry->timebase = timebase;
-    frame_entry->frame = av_frame_clone(frame);
+    frame_entry->frame = clone_frame(frame);
+    frame_entry->enqueue_time = latency_now();
     frame_entry->exit_thread = 0;
     
-    ADD_TO_QUEUE(context, this->threads[i].inbound_frame_queue, frame_entry);
+    ADD_TO_QUEUE(context, this->threads[i]->inbound_frame_queue, frame_entry);
   }
   
-  if (sync_mode) {
+  if (context->sync_mode) {
     for (int i = 0; i < context->num_downstream_filters; i++) {
-      pthread_cond_wait(&this->threads[i].complete, &this->threads[i].complete_mutex);
+      pthread_cond_wait(&this->threads[i]->complete, &this->threads[i]->complete_mutex);
     }
   }
 }
 
-static void flush(ID3ASFilterContext *context) 
+static void stop_thread(ID3ASFilterContext *context, thread_struct *thread)
+{
+  frame_entry_t *frame_entry = (frame_entry_t *) malloc(sizeof(frame_entry_t));
+  frame_entry->exit_thread = 1;
+
+  ADD_TO_QUEUE(context, thread->inbound_frame_queue, frame_entry);
+}
+
+// Each thread flushes its branch on the way out
+static void stop_threads(ID3ASFilterContext *context)
 {
   codec_t *this = context->priv_data;
 
+  if (this->stopped) {
+    return;
+  }
+
   for (int i = 0; i < context->num_downstream_filters; i++) {
-    
-    frame_entry_t *frame_entry = (frame_entry_t *) malloc(sizeof(frame_entry_t));
-    frame_entry->exit_thread = 1;
-    
-    ADD_TO_QUEUE(context, this->threads[i].inbound_frame_queue, frame_entry);
+    stop_thread(context, this->threads[i]);
   }
   
   for (int i = 0; i < context->num_downstream_filters; i++) {
-    pthread_join(this->threads[i].thread, NULL);
+    pthread_join(this->threads[i]->thread, NULL);
   }
+
+  this->stopped = 1;
+}
+
+static void flush(ID3ASFilterContext *context) 
+{
+  stop_threads(context);
+}
+
+static void free_thread(thread_struct *thread)
+{
+  pthread_cond_destroy(&thread->complete);
+  pthread_mutex_destroy(&thread->complete_mutex);
+  free(thread);
 }
 
 static void *thread_proc(void *data) 
@@ -180,15 +225,24 @@ static void *thread_proc(void *data)
 
 	  this->downstream_filter->filter->flush(this->downstream_filter);
 
+	  free(inbound);
+
+	  // A removed branch is no longer in the graph to be closed with it
+	  if (this->removed) {
+	    close_graph(this->downstream_filter);
+	  }
+
 	  return NULL;
 	}
 
-	this->downstream_filter->filter->execute(this->downstream_filter, inbound->frame, inbound->timebase);
+	record_latency(this->downstream_filter->queue_latency, latency_now() - inbound->enqueue_time);
+
+	send_to_filter(this->downstream_filter, inbound->frame, inbound->timebase);
 
 	av_frame_free(&inbound->frame);
 	free(inbound);
 
-        if (sync_mode) {
+        if (this->context->sync_mode) {
           pthread_mutex_lock(&this->complete_mutex);
           pthread_cond_signal(&this->complete);
           pthread_mutex_unlock(&this->complete_mutex);
@@ -202,28 +256,103 @@ static void *thread_proc(void *data)
   return 0;
 }
 
+// Must be called on the thread that calls process, which holds the complete
+// mutex except while it waits
+static thread_struct *start_thread(ID3ASFilterContext *context, ID3ASFilterContext *downstream_filter)
+{
+  thread_struct *thread = (thread_struct *) calloc(1, sizeof(thread_struct));
+
+  thread->thread_id = thread_id++;
+  thread->context = context;
+  thread->downstream_filter = downstream_filter;
+  thread->codec_t = context->priv_data;
+  downstream_filter->queue_latency = allocate_latency_histogram();
+  pthread_cond_init(&thread->complete, NULL);
+  pthread_mutex_init(&thread->complete_mutex, NULL);
+  pthread_mutex_lock(&thread->complete_mutex);
+
+  INIT_QUEUE(thread->inbound_frame_queue);
+
+  pthread_create(&thread->thread, NULL, &thread_proc, thread);
+
+  return thread;
+}
+
+// Frames already queued for a removed branch are still processed; its
+// thread then flushes and closes the branch and exits on its own, so nothing
+// here waits for it until we are closed
+static void reconfigure(ID3ASFilterContext *context, reconfiguration *change) 
+{
+  codec_t *this = context->priv_data;
+
+  switch (change->type) {
+  case RECONFIGURE_ADD_BRANCH:
+    this->threads = realloc(this->threads, sizeof(thread_struct *) * (context->num_downstream_filters + 1));
+    this->threads[context->num_downstream_filters] = start_thread(context, change->branch);
+    add_downstream_filter(context, change);
+    break;
+
+  case RECONFIGURE_REMOVE_BRANCH:
+    {
+      thread_struct *thread = this->threads[change->branch_index];
+
+      memmove(&this->threads[change->branch_index],
+	      &this->threads[change->branch_index + 1],
+	      sizeof(thread_struct *) * (context->num_downstream_filters - change->branch_index - 1));
+
+      remove_downstream_filter(context, change);
+
+      pthread_mutex_unlock(&thread->complete_mutex);
+      thread->removed = 1;
+
+      this->removed_threads = realloc(this->removed_threads, sizeof(thread_struct *) * (this->num_removed_threads + 1));
+      this->removed_threads[this->num_removed_threads++] = thread;
+
+      stop_thread(context, thread);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
 static void init(ID3ASFilterContext *context, AVDictionary *codec_options) 
 {
   codec_t *this = context->priv_data;
 
-  this->threads = (thread_struct *) malloc(sizeof(thread_struct) * context->num_downstream_filters);
+  this->threads = (thread_struct **) malloc(sizeof(thread_struct *) * context->num_downstream_filters);
   
   for (int i = 0; i < context->num_downstream_filters; i++)
     {
-      this->threads[i].thread_id = thread_id++;
-      this->threads[i].context = context;
-      this->threads[i].downstream_filter = context->downstream_filters[i];
-      this->threads[i].codec_t = this;
-      pthread_cond_init(&this->threads[i].complete, NULL);
-      pthread_mutex_init(&this->threads[i].complete_mutex, NULL);
-      pthread_mutex_lock(&this->threads[i].complete_mutex);
-      
-      INIT_QUEUE(this->threads[i].inbound_frame_queue);
-      
-      pthread_create(&this->threads[i].thread, NULL, &thread_proc, &this->threads[i]);
+      this->threads[i] = start_thread(context, context->downstream_filters[i]);
     }
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  stop_threads(context);
+
+  for (int i = 0; i < context->num_downstream_filters; i++)
+    {
+      pthread_mutex_unlock(&this->threads[i]->complete_mutex);
+      free_thread(this->threads[i]);
+    }
+
+  for (int i = 0; i < this->num_removed_threads; i++)
+    {
+      pthread_join(this->removed_threads[i]->thread, NULL);
+      free_thread(this->removed_threads[i]);
+    }
+
+  free(this->threads);
+  free(this->removed_threads);
+  this->threads = NULL;
+  this->removed_threads = NULL;
+}
+
 static const AVOption options[] = {
   { NULL },
 };
@@ -240,6 +369,12 @@ ID3ASFilter id3as_async_parallel_filter = {
   .init = init,
   .execute = process,
   .flush = flush,
+  .reconfigure = reconfigure,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_UNKNOWN,
+  .min_downstream_filters = 1,
+  .dynamic_branches = 1,
+  .takes_packet_frames = 1
 };
@@ -0,0 +1,250 @@
+#include "id3as_libav.h"
+
+// Remixes float audio through a coefficient matrix, e.g. 5.1 down to
+// stereo ahead of an encoder.  The matrix is given as one row per output
+// channel, rows separated by '|' and coefficients by ',' - without one, a
+// standard downmix is built from the two channel layouts.  Output is always
+// planar float.
+
+#define LEFT_CHANNELS (AV_CH_FRONT_LEFT_OF_CENTER | AV_CH_SIDE_LEFT | AV_CH_BACK_LEFT)
+#define RIGHT_CHANNELS (AV_CH_FRONT_RIGHT_OF_CENTER | AV_CH_SIDE_RIGHT | AV_CH_BACK_RIGHT)
+#define CENTRE_CHANNELS (AV_CH_FRONT_CENTER | AV_CH_BACK_CENTER)
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  enum AVSampleFormat sample_format;
+  int channel_layout;
+  int output_channel_layout;
+  char *matrix_spec;
+
+  int in_channels;
+  int out_channels;
+  float *matrix;
+
+  AVBufferPool *pool;
+  int pool_size;
+
+  AVFrame *planar_frame;
+  AVFrame *output_frame;
+
+} codec_t;
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+  AVFrame *in = frame;
+  AVFrame *out = this->output_frame;
+
+  if (this->sample_format == AV_SAMPLE_FMT_FLT)
+    {
+      in = this->planar_frame;
+      in->format = AV_SAMPLE_FMT_FLTP;
+      in->channel_layout = this->channel_layout;
+      in->nb_samples = frame->nb_samples;
+
+      get_pooled_audio_buffer(in, &this->pool, &this->pool_size);
+
+      deinterleave_32(frame->data[0], in->extended_data, this->in_channels, frame->nb_samples);
+    }
+
+  av_frame_copy_props(out, frame);
+  out->format = AV_SAMPLE_FMT_FLTP;
+  out->channel_layout = this->output_channel_layout;
+  out->nb_samples = frame->nb_samples;
+  out->sample_rate = frame->sample_rate;
+
+  get_pooled_audio_buffer(out, &this->pool, &this->pool_size);
+
+  mix_channels_flt((const float **) in->extended_data, (float **) out->extended_data,
+		   this->matrix, this->in_channels, this->out_channels, frame->nb_samples);
+
+  out->opaque = frame->opaque;
+
+  send_to_graph(context, out, timebase);
+
+  av_frame_unref(out);
+
+  if (in != frame) {
+    av_frame_unref(in);
+  }
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  flush_graph(context);
+}
+
+static int parse_matrix(codec_t *this)
+{
+  char *p = this->matrix_spec;
+
+  for (int o = 0; o < this->out_channels; o++)
+    {
+      for (int c = 0; c < this->in_channels; c++)
+	{
+	  char *end;
+	  char separator = c < this->in_channels - 1 ? ',' : o < this->out_channels - 1 ? '|' : 0;
+
+	  this->matrix[o * this->in_channels + c] = strtod(p, &end);
+
+	  if (end == p || *end != separator) {
+	    return -1;
+	  }
+
+	  p = end + (separator != 0);
+	}
+    }
+
+  return 0;
+}
+
+static void route(codec_t *this, uint64_t output, int c, float coefficient)
+{
+  int o = av_get_channel_layout_channel_index(this->output_channel_layout, output);
+
+  if (o >= 0) {
+    this->matrix[o * this->in_channels + c] += coefficient;
+  }
+}
+
+// Channels the output has are copied, the rest folded into the nearest
+// front channels at -3dB and LFE dropped.  The result is scaled so that no
+// output can clip.
+static void default_matrix(codec_t *this)
+{
+  uint64_t out_layout = this->output_channel_layout;
+  int has_stereo = (out_layout & AV_CH_LAYOUT_STEREO) == AV_CH_LAYOUT_STEREO;
+  float max_gain = 0;
+
+  for (int c = 0; c < this->in_channels; c++)
+    {
+      uint64_t channel = av_channel_layout_extract_channel(this->channel_layout, c);
+
+      if (out_layout & channel) {
+	route(this, channel, c, 1);
+      }
+      else if (channel == AV_CH_LOW_FREQUENCY) {
+	continue;
+      }
+      else if (channel & LEFT_CHANNELS) {
+	route(this, out_layout & AV_CH_FRONT_LEFT ? AV_CH_FRONT_LEFT : AV_CH_FRONT_CENTER, c, M_SQRT1_2);
+      }
+      else if (channel & RIGHT_CHANNELS) {
+	route(this, out_layout & AV_CH_FRONT_RIGHT ? AV_CH_FRONT_RIGHT : AV_CH_FRONT_CENTER, c, M_SQRT1_2);
+      }
+      else if ((channel & CENTRE_CHANNELS) && has_stereo) {
+	route(this, AV_CH_FRONT_LEFT, c, M_SQRT1_2);
+	route(this, AV_CH_FRONT_RIGHT, c, M_SQRT1_2);
+      }
+      else {
+	route(this, AV_CH_FRONT_CENTER, c, M_SQRT1_2);
+      }
+    }
+
+  for (int o = 0; o < this->out_channels; o++)
+    {
+      float gain = 0;
+
+      for (int c = 0; c < this->in_channels; c++) gain += this->matrix[o * this->in_channels + c];
+
+      max_gain = FFMAX(max_gain, gain);
+    }
+
+  if (max_gain > 1)
+    {
+      for (int i = 0; i < this->out_channels * this->in_channels; i++) this->matrix[i] /= max_gain;
+    }
+}
+
+// Everything init relies on, checked while the graph is built
+static int validate(void *priv_data, int num_downstream_filters, graph_error *error)
+{
+  codec_t *this = priv_data;
+  int ret = 0;
+
+  if (this->sample_format != AV_SAMPLE_FMT_FLTP && this->sample_format != AV_SAMPLE_FMT_FLT) {
+    return validation_error(error, "unsupported format %d - only flt and fltp", this->sample_format);
+  }
+
+  this->in_channels = av_get_channel_layout_nb_channels(this->channel_layout);
+  this->out_channels = av_get_channel_layout_nb_channels(this->output_channel_layout);
+
+  if (this->in_channels < 1 || this->in_channels > MAX_AUDIO_CHANNELS || this->out_channels < 1 || this->out_channels > MAX_AUDIO_CHANNELS) {
+    return validation_error(error, "invalid channel layouts %d -> %d", this->channel_layout, this->output_channel_layout);
+  }
+
+  if (this->matrix_spec) {
+    this->matrix = calloc(this->in_channels * this->out_channels, sizeof(float));
+
+    if (parse_matrix(this) != 0) {
+      ret = validation_error(error, "invalid mix matrix %s - need %d rows of %d coefficients", this->matrix_spec, this->out_channels, this->in_channels);
+    }
+
+    free(this->matrix);
+    this->matrix = NULL;
+  }
+
+  return ret;
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->in_channels = av_get_channel_layout_nb_channels(this->channel_layout);
+  this->out_channels = av_get_channel_layout_nb_channels(this->output_channel_layout);
+
+  this->matrix = calloc(this->in_channels * this->out_channels, sizeof(float));
+
+  if (this->matrix_spec) {
+    parse_matrix(this);
+  }
+  else {
+    default_matrix(this);
+  }
+
+  this->planar_frame = av_frame_alloc();
+  this->output_frame = av_frame_alloc();
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free(this->matrix);
+  av_frame_free(&this->planar_frame);
+  av_frame_free(&this->output_frame);
+  av_buffer_pool_uninit(&this->pool);
+}
+
+static const AVOption options[] = {
+  { "sample_format", "the sample format", offsetof(codec_t, sample_format), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "channel_layout", "input channel layout", offsetof(codec_t, channel_layout), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "output_channel_layout", "output channel layout", offsetof(codec_t, output_channel_layout), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "matrix", "coefficients, one row per output channel", offsetof(codec_t, matrix_spec), AV_OPT_TYPE_STRING, {.str = NULL} },
+  { NULL },
+};
+
+static const AVClass class = {
+  .class_name = "channel mixer options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const char *required_options[] = { "sample_format", "channel_layout", "output_channel_layout", NULL };
+
+ID3ASFilter id3as_channel_mixer_filter = {
+  .name = "channel mixer",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .required_options = required_options,
+  .validate = validate
+};
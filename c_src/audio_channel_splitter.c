@@ -0,0 +1,250 @@
+#include "id3as_libav.h"
+
+// Splits multichannel audio into groups of channels, one group per
+// downstream filter.  Groups are given as e.g. "0,1|2|3|4,5" - without
+// them downstream filter i gets channel i.  Outputs are always planar:
+// planar input is split without copying, packed input is deinterleaved
+// once into a pooled planar frame and split from that.
+
+typedef void (*deinterleave_fun)(const void *samples, uint8_t **planes, int channels, int nb_samples);
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  enum AVSampleFormat sample_format;
+  int channel_layout;
+  char *outputs;
+
+  int num_channels;
+  int num_groups;
+  int *group_sizes;
+  int **groups;
+
+  deinterleave_fun deinterleave;
+
+  AVBufferPool *pool;
+  int pool_size;
+
+  AVFrame *planar_frame;
+  AVFrame *output_frame;
+
+} codec_t;
+
+static AVFrame *deinterleave_frame(codec_t *this, AVFrame *frame)
+{
+  AVFrame *planar = this->planar_frame;
+
+  av_frame_unref(planar);
+  av_frame_copy_props(planar, frame);
+
+  planar->format = av_get_planar_sample_fmt(this->sample_format);
+  planar->channel_layout = frame->channel_layout;
+  planar->nb_samples = frame->nb_samples;
+  planar->sample_rate = frame->sample_rate;
+
+  get_pooled_audio_buffer(planar, &this->pool, &this->pool_size);
+
+  this->deinterleave(frame->data[0], planar->extended_data, this->num_channels, frame->nb_samples);
+
+  return planar;
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+  AVFrame *planar = this->deinterleave ? deinterleave_frame(this, frame) : frame;
+
+  for (int i = 0; i < this->num_groups; i++)
+    {
+      select_planar_channels(planar, this->output_frame, this->groups[i], this->group_sizes[i]);
+
+      this->output_frame->opaque = frame->opaque;
+
+      send_to_filter(context->downstream_filters[i], this->output_frame, timebase);
+
+      av_frame_unref(this->output_frame);
+    }
+
+  if (this->deinterleave) {
+    av_frame_unref(planar);
+  }
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  flush_graph(context);
+}
+
+// Parses one group of comma separated channels, returning the end of it,
+// or NULL if it isn't valid
+static char *add_group(codec_t *this, char *spec)
+{
+  int *channels = malloc(sizeof(int) * this->num_channels);
+  int size = 0;
+  char *p = spec;
+
+  while (1)
+    {
+      char *end;
+      long channel = strtol(p, &end, 10);
+
+      if (end == p || channel < 0 || channel >= this->num_channels || size == this->num_channels) {
+	free(channels);
+	return NULL;
+      }
+
+      channels[size++] = channel;
+      p = end;
+
+      if (*p != ',') {
+	break;
+      }
+      p++;
+    }
+
+  this->groups = realloc(this->groups, sizeof(int *) * (this->num_groups + 1));
+  this->group_sizes = realloc(this->group_sizes, sizeof(int) * (this->num_groups + 1));
+
+  this->groups[this->num_groups] = channels;
+  this->group_sizes[this->num_groups++] = size;
+
+  return p;
+}
+
+static void free_groups(codec_t *this)
+{
+  for (int i = 0; i < this->num_groups; i++)
+    {
+      free(this->groups[i]);
+    }
+
+  free(this->groups);
+  free(this->group_sizes);
+  this->groups = NULL;
+  this->group_sizes = NULL;
+  this->num_groups = 0;
+}
+
+static int parse_groups(codec_t *this, int num_downstream_filters)
+{
+  if (this->outputs)
+    {
+      char *p = this->outputs;
+
+      while ((p = add_group(this, p)) && *p == '|')
+	{
+	  p++;
+	}
+
+      return p && !*p ? 0 : -1;
+    }
+
+  for (int i = 0; i < num_downstream_filters && i < this->num_channels; i++)
+    {
+      char spec[16];
+
+      snprintf(spec, sizeof(spec), "%d", i);
+      add_group(this, spec);
+    }
+
+  return 0;
+}
+
+static deinterleave_fun get_deinterleave(enum AVSampleFormat sample_format)
+{
+  switch (av_get_bytes_per_sample(sample_format)) {
+  case 2:
+    return deinterleave_16;
+  case 4:
+    return deinterleave_32;
+  case 8:
+    return deinterleave_64;
+  default:
+    return NULL;
+  }
+}
+
+// Everything init relies on, checked while the graph is built
+static int validate(void *priv_data, int num_downstream_filters, graph_error *error)
+{
+  codec_t *this = priv_data;
+  int ret = 0;
+
+  this->num_channels = av_get_channel_layout_nb_channels(this->channel_layout);
+
+  if (this->num_channels < 1 || this->num_channels > MAX_AUDIO_CHANNELS) {
+    return validation_error(error, "invalid channel layout %d", this->channel_layout);
+  }
+
+  if (!av_sample_fmt_is_planar(this->sample_format) && !get_deinterleave(this->sample_format)) {
+    return validation_error(error, "unsupported format %d", this->sample_format);
+  }
+
+  if (parse_groups(this, num_downstream_filters) != 0) {
+    ret = validation_error(error, "invalid channel groups %s for %d channels", this->outputs, this->num_channels);
+  }
+  else if (this->num_groups != num_downstream_filters) {
+    ret = validation_error(error, "%d groups but %d downstream filters", this->num_groups, num_downstream_filters);
+  }
+
+  free_groups(this);
+
+  return ret;
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->num_channels = av_get_channel_layout_nb_channels(this->channel_layout);
+
+  parse_groups(this, context->num_downstream_filters);
+
+  if (!av_sample_fmt_is_planar(this->sample_format)) {
+    this->deinterleave = get_deinterleave(this->sample_format);
+  }
+
+  this->planar_frame = av_frame_alloc();
+  this->output_frame = av_frame_alloc();
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free_groups(this);
+  av_frame_free(&this->planar_frame);
+  av_frame_free(&this->output_frame);
+  av_buffer_pool_uninit(&this->pool);
+}
+
+static const AVOption options[] = {
+  { "sample_format", "the sample format", offsetof(codec_t, sample_format), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "channel_layout", "channel layout", offsetof(codec_t, channel_layout), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "outputs", "channel groups, e.g. 0,1|2|3", offsetof(codec_t, outputs), AV_OPT_TYPE_STRING, {.str = NULL} },
+  { NULL },
+};
+
+static const AVClass class = {
+  .class_name = "channel splitter options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const char *required_options[] = { "sample_format", "channel_layout", NULL };
+
+ID3ASFilter id3as_channel_splitter_filter = {
+  .name = "channel splitter",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .min_downstream_filters = 1,
+  .required_options = required_options,
+  .validate = validate
+};
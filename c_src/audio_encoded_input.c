@@ -87,6 +87,14 @@ static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
   this->frame = av_frame_alloc();
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free_codec_context(&this->context);
+  av_frame_free(&this->frame);
+}
+
 static const AVOption options[] = {
   { "sample_rate", "sample rate", offsetof(codec_t, sample_rate), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "sample_format", "the sample format", offsetof(codec_t, sample_format), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
@@ -102,11 +110,17 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "codec", "sample_rate", "channel_layout", "sample_format", NULL };
+
 ID3ASFilter id3as_encoded_audio_input = {
   .name = "encoded audio input",
   .init = init,
-  .execute = process,
+  .execute_input = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .required_options = required_options,
+  .codec_option = CODEC_OPTION_DECODER
 };
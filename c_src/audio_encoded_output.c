@@ -10,6 +10,8 @@ typedef struct _codec_t
   char *codec_name;
   char *pin_name;
   int stream_id;
+  enum ExtradataMode extradata_mode;
+  output_header *header;
 
   AVCodec *codec;
   AVCodecContext *context;
@@ -67,7 +69,7 @@ static void copy_frame_to_operating_buffer(codec_t *this, AVFrame *frame)
   this->current_sample_offset += frame->nb_samples;
 }
 
-static void process(ID3ASFilterContext *context, AVFrame *frame)
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
 {
   codec_t *this = context->priv_data;
   AVPacket pkt;
@@ -107,7 +109,7 @@ static void process(ID3ASFilterContext *context, AVFrame *frame)
 	if (got_packet_ptr && should_send(this, frame))
 	  {
 	    pkt.duration = av_rescale_q(pkt.duration, this->context->time_base, (AVRational) {1, 90000});
-	    write_output_from_packet(this->pin_name, this->stream_id, this->context, &pkt, frame->opaque);
+	    write_output_from_packet(context->graph_id, this->header, this->pin_name, this->stream_id, this->context, &pkt, frame->opaque);
 	  }
       }
 
@@ -133,6 +135,8 @@ static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
 {
   codec_t *this = context->priv_data;
 
+  this->header = allocate_output_header(this->extradata_mode);
+
   // Get the codec and context
   this->codec = get_encoder(this->codec_name);
   this->context = allocate_audio_context(this->codec, this->sample_rate, this->channel_layout, this->sample_format, codec_options);
@@ -184,6 +188,17 @@ static int should_send(codec_t *this, AVFrame *frame)
 }
 
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free_codec_context(&this->context);
+  free_output_header(&this->header);
+  av_frame_free(&this->frame);
+  av_freep(&this->operating_buffer[0]);
+  av_freep(&this->output_buf);
+}
+
 static const AVOption options[] = {
   { "stream_id", "The stream id for the output stream", offsetof(codec_t, stream_id), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "pin_name", "The pin name for the output stream", offsetof(codec_t, pin_name), AV_OPT_TYPE_STRING },
@@ -191,6 +206,10 @@ static const AVOption options[] = {
   { "sample_format", "the sample format", offsetof(codec_t, sample_format), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "channel_layout", "the number of channels", offsetof(codec_t, channel_layout), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "codec", "the codec name", offsetof(codec_t, codec_name), AV_OPT_TYPE_STRING },
+  { "extradata_mode", "when to send the codec extradata", offsetof(codec_t, extradata_mode), AV_OPT_TYPE_INT, { .i64 = EXTRADATA_ALWAYS }, EXTRADATA_ALWAYS, EXTRADATA_ON_KEYFRAME, 0, "extradata_mode" },
+  { "always", "with every frame", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ALWAYS }, 0, 0, 0, "extradata_mode" },
+  { "on_change", "with the first frame and when it changes", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ON_CHANGE }, 0, 0, 0, "extradata_mode" },
+  { "keyframes", "on change and with every keyframe", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ON_KEYFRAME }, 0, 0, 0, "extradata_mode" },
   { NULL }
 };
 
@@ -201,11 +220,18 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "codec", "pin_name", "sample_rate", "channel_layout", "sample_format", NULL };
+
 ID3ASFilter id3as_output_encoded_audio_filter = {
   .name = "encoded audio output",
   .init = init,
   .execute = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .sink = 1,
+  .required_options = required_options,
+  .codec_option = CODEC_OPTION_ENCODER
 };
@@ -0,0 +1,292 @@
+#include <float.h>
+#include <math.h>
+
+#include "id3as_libav.h"
+
+// Audio QC over a sliding window of the last `window` seconds:
+//
+//   CLIPPED         at least clip_count samples at or beyond clip_level
+//   DC_OFFSET       a channel's mean is further than dc_threshold from zero
+//   PHASE_INVERTED  the first two channels are correlated below
+//                   phase_threshold (-1 is one channel inverted)
+//   DUAL_MONO       the first two channels differ by less than
+//                   dual_mono_threshold dB relative to their level
+//
+// The two channel tests are skipped while either channel is quieter than
+// noise, so silence is neither inverted nor dual mono.  The sums for each
+// frame are kept (per channel, and for the first pair) and the window's
+// totals rebuilt from them, so frames leave the window exactly.  Packed
+// input is deinterleaved into scratch planes first.
+
+typedef struct _window_entry
+{
+  int nb_samples;
+  channel_stats channels[MAX_AUDIO_CHANNELS];
+  pair_stats pair;
+
+} window_entry;
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  int initialised;
+
+  double window;
+  double clip_level;
+  int clip_count;
+  double dc_threshold;
+  double phase_threshold;
+  double dual_mono_threshold;
+  double noise;
+
+  void (*channel_stats)(const void *samples, int nb_samples, double clip_level, channel_stats *stats);
+  void (*pair_stats)(const void *left, const void *right, int nb_samples, pair_stats *stats);
+  void (*deinterleave)(const void *samples, uint8_t **planes, int channels, int nb_samples);
+  int nb_channels;
+  int bytes_per_sample;
+  int window_samples;
+
+  window_entry *entries;
+  int capacity;
+  int head;
+  int count;
+  int window_total;
+
+  uint8_t *scratch[MAX_AUDIO_CHANNELS];
+  int scratch_samples;
+
+} codec_t;
+
+static void do_init(codec_t *this, AVFrame *frame);
+
+static window_entry *push_entry(codec_t *this, int nb_samples)
+{
+  // Drop whatever the new frame pushes out of the window
+  while (this->count > 0 && this->window_total + nb_samples - this->entries[this->head].nb_samples >= this->window_samples)
+    {
+      this->window_total -= this->entries[this->head].nb_samples;
+      this->head = (this->head + 1) % this->capacity;
+      this->count--;
+    }
+
+  if (this->count == this->capacity)
+    {
+      int capacity = this->capacity ? this->capacity * 2 : 16;
+      window_entry *entries = av_malloc(sizeof(window_entry) * capacity);
+
+      for (int i = 0; i < this->count; i++)
+	{
+	  entries[i] = this->entries[(this->head + i) % this->capacity];
+	}
+
+      av_free(this->entries);
+      this->entries = entries;
+      this->capacity = capacity;
+      this->head = 0;
+    }
+
+  window_entry *entry = &this->entries[(this->head + this->count) % this->capacity];
+
+  memset(entry, 0, sizeof(window_entry));
+  entry->nb_samples = nb_samples;
+
+  this->count++;
+  this->window_total += nb_samples;
+
+  return entry;
+}
+
+static const uint8_t **get_planes(codec_t *this, AVFrame *frame)
+{
+  if (!this->deinterleave) {
+    return (const uint8_t **) frame->extended_data;
+  }
+
+  if (frame->nb_samples > this->scratch_samples)
+    {
+      for (int c = 0; c < this->nb_channels; c++)
+	{
+	  av_free(this->scratch[c]);
+	  this->scratch[c] = av_malloc(frame->nb_samples * this->bytes_per_sample);
+	}
+
+      this->scratch_samples = frame->nb_samples;
+    }
+
+  this->deinterleave(frame->data[0], this->scratch, this->nb_channels, frame->nb_samples);
+
+  return (const uint8_t **) this->scratch;
+}
+
+static int check_window(codec_t *this)
+{
+  channel_stats totals[MAX_AUDIO_CHANNELS] = {{ 0 }};
+  pair_stats pair = { 0 };
+  int flags = 0;
+  int clipped = 0;
+
+  for (int i = 0; i < this->count; i++)
+    {
+      window_entry *entry = &this->entries[(this->head + i) % this->capacity];
+
+      for (int c = 0; c < this->nb_channels; c++)
+	{
+	  totals[c].sum += entry->channels[c].sum;
+	  totals[c].sum_sq += entry->channels[c].sum_sq;
+	  totals[c].clipped += entry->channels[c].clipped;
+	}
+
+      pair.sum_lr += entry->pair.sum_lr;
+      pair.sum_ll += entry->pair.sum_ll;
+      pair.sum_rr += entry->pair.sum_rr;
+      pair.sum_diff_sq += entry->pair.sum_diff_sq;
+    }
+
+  for (int c = 0; c < this->nb_channels; c++)
+    {
+      clipped += totals[c].clipped;
+
+      if (fabs(totals[c].sum / this->window_total) > this->dc_threshold) {
+	flags |= DC_OFFSET;
+      }
+    }
+
+  if (clipped >= this->clip_count) {
+    flags |= CLIPPED;
+  }
+
+  double floor = this->noise * this->noise * this->window_total;
+
+  if (this->nb_channels >= 2 && pair.sum_ll > floor && pair.sum_rr > floor)
+    {
+      if (pair.sum_lr / sqrt(pair.sum_ll * pair.sum_rr) < this->phase_threshold) {
+	flags |= PHASE_INVERTED;
+      }
+
+      if (10 * log10(pair.sum_diff_sq / FFMAX(pair.sum_ll, pair.sum_rr) + DBL_MIN) < this->dual_mono_threshold) {
+	flags |= DUAL_MONO;
+      }
+    }
+
+  return flags;
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+
+  do_init(this, frame);
+
+  const uint8_t **planes = get_planes(this, frame);
+  window_entry *entry = push_entry(this, frame->nb_samples);
+
+  for (int c = 0; c < this->nb_channels; c++)
+    {
+      this->channel_stats(planes[c], frame->nb_samples, this->clip_level, &entry->channels[c]);
+    }
+
+  if (this->nb_channels >= 2) {
+    this->pair_stats(planes[0], planes[1], frame->nb_samples, &entry->pair);
+  }
+
+  ((frame_info *) frame->opaque)->flags |= check_window(this);
+
+  send_to_graph(context, frame, timebase);
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  this->count = 0;
+  this->window_total = 0;
+
+  flush_graph(context);
+}
+
+static void do_init(codec_t *this, AVFrame *frame)
+{
+  if (!this->initialised)
+    {
+      switch (frame->format) {
+      case AV_SAMPLE_FMT_FLT:
+	this->deinterleave = deinterleave_32;
+	/* fall through */
+      case AV_SAMPLE_FMT_FLTP:
+	this->channel_stats = channel_stats_flt;
+	this->pair_stats = pair_stats_flt;
+	break;
+      case AV_SAMPLE_FMT_S16:
+	this->deinterleave = deinterleave_16;
+	/* fall through */
+      case AV_SAMPLE_FMT_S16P:
+	this->channel_stats = channel_stats_s16;
+	this->pair_stats = pair_stats_s16;
+	break;
+      default:
+	ERRORFMT("Audio QC unable to handle format %d\n", frame->format);
+	exit(1);
+      }
+
+      this->nb_channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+      this->bytes_per_sample = av_get_bytes_per_sample(frame->format);
+      this->window_samples = FFMAX(1, this->window * frame->sample_rate);
+
+      if (this->nb_channels > MAX_AUDIO_CHANNELS) {
+	ERRORFMT("Audio QC supports up to %d channels\n", MAX_AUDIO_CHANNELS);
+	exit(1);
+      }
+
+      this->initialised = 1;
+    }
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->initialised = 0;
+}
+
+#define OFFSET(x) offsetof(codec_t, x)
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  av_freep(&this->entries);
+
+  for (int c = 0; c < MAX_AUDIO_CHANNELS; c++)
+    {
+      av_freep(&this->scratch[c]);
+    }
+}
+
+static const AVOption options[] = {
+    { "window", "seconds of audio each decision is made over", OFFSET(window), AV_OPT_TYPE_DOUBLE, {.dbl = 1.0}, 0, 60 },
+    { "clip_level", "sample level, as a fraction of full scale, counted as clipped", OFFSET(clip_level), AV_OPT_TYPE_DOUBLE, {.dbl = 0.999}, 0, 1 },
+    { "clip_count", "clipped samples in the window that set CLIPPED", OFFSET(clip_count), AV_OPT_TYPE_INT, {.i64 = 3}, 1, INT_MAX },
+    { "dc_threshold", "mean level, as a fraction of full scale, that sets DC_OFFSET", OFFSET(dc_threshold), AV_OPT_TYPE_DOUBLE, {.dbl = 0.01}, 0, 1 },
+    { "phase_threshold", "correlation below which the first two channels are out of phase", OFFSET(phase_threshold), AV_OPT_TYPE_DOUBLE, {.dbl = -0.5}, -1, 1 },
+    { "dual_mono_threshold", "difference in dB below which the first two channels are the same", OFFSET(dual_mono_threshold), AV_OPT_TYPE_DOUBLE, {.dbl = -60}, -200, 0 },
+    { "noise", "rms level below which channels aren't compared", OFFSET(noise), AV_OPT_TYPE_DOUBLE, {.dbl = 0.001}, 0, 1 },
+    { NULL }
+};
+
+static const AVClass class = {
+  .class_name = "audio qc options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+ID3ASFilter id3as_audio_qc_filter = {
+  .name = "audio qc",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO
+};
@@ -58,6 +58,13 @@ static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
   this->frame->channel_layout = this->channel_layout;
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  av_frame_free(&this->frame);
+}
+
 static const AVOption options[] = {
   { "sample_rate", "sample rate", offsetof(codec_t, sample_rate), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "channel_layout", "channel layout", offsetof(codec_t, channel_layout), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
@@ -72,11 +79,16 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "sample_rate", "channel_layout", "sample_format", NULL };
+
 ID3ASFilter id3as_raw_audio_input = {
   .name = "raw audio input",
   .init = init,
-  .execute = process,
+  .execute_input = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .required_options = required_options
 };
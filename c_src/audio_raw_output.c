@@ -5,14 +5,15 @@ typedef struct _codec_t
   AVClass *av_class;
   char *pin_name;
   int stream_id;
+  output_header *header;
 
 } codec_t;
 
-static void process(ID3ASFilterContext *context, AVFrame *frame)
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
 {
   codec_t *this = context->priv_data;
 
-  write_output_from_frame(this->pin_name, this->stream_id, frame);
+  write_output_from_frame(context->graph_id, this->header, this->pin_name, this->stream_id, frame);
 }
 
 static void flush(ID3ASFilterContext *context) 
@@ -21,6 +22,16 @@ static void flush(ID3ASFilterContext *context)
 
 static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
 {
+  codec_t *this = context->priv_data;
+
+  this->header = allocate_output_header(EXTRADATA_ALWAYS);
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free_output_header(&this->header);
 }
 
 static const AVOption options[] = {
@@ -36,11 +47,17 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "pin_name", NULL };
+
 ID3ASFilter id3as_output_raw_audio_filter = {
   .name = "raw audio output",
   .init = init,
   .execute = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .sink = 1,
+  .required_options = required_options
 };
@@ -1,6 +1,21 @@
 #include "id3as_libav.h"
 
-#define MAX_AUDIO_SAMPLES 192000 // 1 second of 192kHz audio
+// Same-rate format changes between s16 / s32 / flt (packed or planar) and
+// 32k / 44.1k / 48k rate changes with an unchanged layout are done natively
+// - the first by the sample converters in kernels.c, the second by
+// polyphase_resampler through planar float.  Everything else goes to
+// libavresample.
+//
+// Output frames are sized to what the resampler can produce from the input
+// plus whatever it is still holding, and drawn from a pool
+#define OUTPUT_SLACK 32
+
+enum ResampleMode {
+  RESAMPLE_PASSTHROUGH,
+  RESAMPLE_CONVERT,
+  RESAMPLE_NATIVE,
+  RESAMPLE_LIBAV
+};
 
 typedef struct _codec_t
 {
@@ -13,72 +28,396 @@ typedef struct _codec_t
   int output_sample_rate;
   int output_channel_layout;
   int output_sample_format;
-  int output_num_channels;
-  int output_bytes_per_sample;
 
+  int native;
+  int quality;
+
+  enum ResampleMode mode;
+
+  // frame is what we send; planar_frame and input_frame hold the native
+  // path's planar float output and input, and scratch_frame is only ever
+  // used inside convert_samples
   AVFrame *frame;
-  int max_samples;
+  AVFrame *planar_frame;
+  AVFrame *input_frame;
+  AVFrame *scratch_frame;
+  AVBufferPool *pool;
+  int pool_size;
+
+  // Where the next output sample sits, and a copy of the last frame_info,
+  // for the frames produced by a drain
+  int64_t next_pts;
+  AVRational timebase;
+  frame_info *frame_info;
 
   AVAudioResampleContext *resample_context;
+  polyphase_resampler *polyphase;
 
 } codec_t;
 
-static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+static int is_native_format(enum AVSampleFormat format)
+{
+  switch (av_get_packed_sample_fmt(format)) {
+  case AV_SAMPLE_FMT_S16:
+  case AV_SAMPLE_FMT_S32:
+  case AV_SAMPLE_FMT_FLT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void open_libav(codec_t *this)
+{
+  this->resample_context = avresample_alloc_context();
+
+  av_opt_set_int(this->resample_context, "in_channel_layout", this->input_channel_layout, 0);
+  av_opt_set_int(this->resample_context, "out_channel_layout", this->output_channel_layout, 0);
+  av_opt_set_int(this->resample_context, "in_sample_fmt", this->input_sample_format, 0);
+  av_opt_set_int(this->resample_context, "out_sample_fmt", this->output_sample_format, 0);
+  av_opt_set_int(this->resample_context, "in_sample_rate", this->input_sample_rate, 0);
+  av_opt_set_int(this->resample_context, "out_sample_rate", this->output_sample_rate, 0);
+
+  if (avresample_open(this->resample_context) < 0) {
+    ERRORFMT("Failed to open resampler %d -> %d\n", this->input_sample_rate, this->output_sample_rate);
+    exit(-1);
+  }
+}
+
+static void open_resampler(codec_t *this)
+{
+  int native = this->native &&
+    this->input_channel_layout == this->output_channel_layout &&
+    is_native_format(this->input_sample_format) &&
+    is_native_format(this->output_sample_format);
+
+  if (this->input_sample_rate == this->output_sample_rate &&
+      this->input_channel_layout == this->output_channel_layout &&
+      this->input_sample_format == this->output_sample_format) {
+    this->mode = RESAMPLE_PASSTHROUGH;
+  }
+  else if (native && this->input_sample_rate == this->output_sample_rate) {
+    this->mode = RESAMPLE_CONVERT;
+  }
+  else if (native && (this->polyphase = allocate_polyphase_resampler(this->input_sample_rate, this->output_sample_rate,
+								      av_get_channel_layout_nb_channels(this->input_channel_layout),
+								      this->quality))) {
+    this->mode = RESAMPLE_NATIVE;
+  }
+  else {
+    this->mode = RESAMPLE_LIBAV;
+    open_libav(this);
+  }
+}
+
+static void close_resampler(codec_t *this)
+{
+  avresample_free(&this->resample_context);
+  free_polyphase_resampler(&this->polyphase);
+}
+
+static void set_output_format(codec_t *this, AVFrame *frame, enum AVSampleFormat format, int nb_samples)
+{
+  frame->format = format;
+  frame->channel_layout = this->output_channel_layout;
+  frame->sample_rate = this->output_sample_rate;
+  frame->nb_samples = nb_samples;
+
+  get_pooled_audio_buffer(frame, &this->pool, &this->pool_size);
+}
+
+static void send_output(ID3ASFilterContext *context, int nb_samples)
 {
   codec_t *this = context->priv_data;
 
+  if (nb_samples > 0) {
+    this->frame->nb_samples = nb_samples;
+    this->frame->pts = this->next_pts;
+    this->frame->opaque = this->frame_info;
+
+    send_to_graph(context, this->frame, this->timebase);
+
+    this->next_pts += av_rescale_q(nb_samples, (AVRational){1, this->output_sample_rate}, this->timebase);
+  }
+
+  av_frame_unref(this->frame);
+}
+
+static void repack(AVFrame *src, AVFrame *dst, int channels)
+{
+  if (av_sample_fmt_is_planar(dst->format))
+    {
+      switch (av_get_bytes_per_sample(src->format)) {
+      case 2: deinterleave_16(src->data[0], dst->extended_data, channels, src->nb_samples); break;
+      case 4: deinterleave_32(src->data[0], dst->extended_data, channels, src->nb_samples); break;
+      case 8: deinterleave_64(src->data[0], dst->extended_data, channels, src->nb_samples); break;
+      }
+    }
+  else
+    {
+      switch (av_get_bytes_per_sample(src->format)) {
+      case 2: interleave_16((const uint8_t **) src->extended_data, dst->data[0], channels, src->nb_samples); break;
+      case 4: interleave_32((const uint8_t **) src->extended_data, dst->data[0], channels, src->nb_samples); break;
+      case 8: interleave_64((const uint8_t **) src->extended_data, dst->data[0], channels, src->nb_samples); break;
+      }
+    }
+}
+
+// Converts src into dst, which already has its format and buffer.  A
+// change of both sample type and packing goes through a scratch frame in
+// dst's sample type, so each pass is a straight contiguous loop.
+static void convert_samples(codec_t *this, AVFrame *src, AVFrame *dst)
+{
+  int channels = av_get_channel_layout_nb_channels(src->channel_layout);
+  int src_planar = av_sample_fmt_is_planar(src->format);
+  sample_converter converter = get_sample_converter(src->format, dst->format);
+
+  if (src_planar == av_sample_fmt_is_planar(dst->format))
+    {
+      int planes = src_planar ? channels : 1;
+      int n = src_planar ? src->nb_samples : src->nb_samples * channels;
+
+      for (int i = 0; i < planes; i++)
+	{
+	  if (converter) {
+	    converter(src->extended_data[i], dst->extended_data[i], n);
+	  }
+	  else {
+	    memcpy(dst->extended_data[i], src->extended_data[i], n * av_get_bytes_per_sample(src->format));
+	  }
+	}
+    }
+  else if (!converter)
+    {
+      repack(src, dst, channels);
+    }
+  else
+    {
+      AVFrame *scratch = this->scratch_frame;
+
+      set_output_format(this, scratch, src_planar ? av_get_planar_sample_fmt(dst->format) : av_get_packed_sample_fmt(dst->format), src->nb_samples);
+
+      convert_samples(this, src, scratch);
+      repack(scratch, dst, channels);
+
+      av_frame_unref(scratch);
+    }
+}
+
+// Input of NULL drains the resampler
+static void convert_libav(ID3ASFilterContext *context, AVFrame *input)
+{
+  codec_t *this = context->priv_data;
+  int delay = avresample_get_delay(this->resample_context);
+  int in_samples = input ? input->nb_samples : 0;
+  int max_samples = av_rescale_rnd(delay + in_samples, this->output_sample_rate, this->input_sample_rate, AV_ROUND_UP)
+    + avresample_available(this->resample_context) + OUTPUT_SLACK;
+
+  set_output_format(this, this->frame, this->output_sample_format, max_samples);
+
   int nb_samples = avresample_convert(this->resample_context,
-				      this->frame->data, this->frame->linesize[0], this->max_samples, 
-				      frame->data, frame->linesize[0], frame->nb_samples); 
+				      this->frame->extended_data, this->frame->linesize[0], max_samples,
+				      input ? input->extended_data : NULL, input ? input->linesize[0] : 0, in_samples);
   if (nb_samples < 0) { 
     ERRORFMT("avresample_convert failed with %d\n", nb_samples);
     exit(-1);
   } 
 
-  this->frame->nb_samples = nb_samples;
-  
-  av_samples_get_buffer_size(&this->frame->linesize[0], 
-			     this->output_num_channels,
-			     nb_samples,
-			     this->output_sample_format, 
-			     0);
+  send_output(context, nb_samples);
+
+  // Anything that still didn't fit went to the output FIFO
+  while (avresample_available(this->resample_context) > 0)
+    {
+      set_output_format(this, this->frame, this->output_sample_format, avresample_available(this->resample_context));
+
+      send_output(context, avresample_read(this->resample_context, this->frame->extended_data, this->frame->nb_samples));
+    }
+}
+
+// Resamples in planar float, converting on the way in and out if needed.
+// Input of NULL drains the resampler.
+static void convert_native(ID3ASFilterContext *context, AVFrame *input)
+{
+  codec_t *this = context->priv_data;
+  AVFrame *in = input;
+  AVFrame *out = this->output_sample_format == AV_SAMPLE_FMT_FLTP ? this->frame : this->planar_frame;
+  int max_samples = polyphase_max_output(this->polyphase, input ? input->nb_samples : 0);
+
+  if (input && input->format != AV_SAMPLE_FMT_FLTP)
+    {
+      in = this->input_frame;
+      in->format = AV_SAMPLE_FMT_FLTP;
+      in->channel_layout = input->channel_layout;
+      in->nb_samples = input->nb_samples;
+      get_pooled_audio_buffer(in, &this->pool, &this->pool_size);
+
+      convert_samples(this, input, in);
+    }
+
+  set_output_format(this, out, AV_SAMPLE_FMT_FLTP, max_samples);
+
+  int nb_samples = polyphase_resample(this->polyphase, in ? (const float **) in->extended_data : NULL, in ? in->nb_samples : 0,
+				      (float **) out->extended_data, max_samples);
+
+  if (in && in != input) {
+    av_frame_unref(in);
+  }
+
+  if (out != this->frame)
+    {
+      out->nb_samples = nb_samples;
+      set_output_format(this, this->frame, this->output_sample_format, nb_samples);
+      convert_samples(this, out, this->frame);
+      av_frame_unref(out);
+    }
+
+  send_output(context, nb_samples);
+}
+
+static void convert_format(ID3ASFilterContext *context, AVFrame *input)
+{
+  codec_t *this = context->priv_data;
+
+  set_output_format(this, this->frame, this->output_sample_format, input->nb_samples);
+
+  convert_samples(this, input, this->frame);
+
+  send_output(context, input->nb_samples);
+}
+
+static void drain(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  if (!this->timebase.den) {
+    return;
+  }
+
+  switch (this->mode) {
+  case RESAMPLE_LIBAV:
+    convert_libav(context, NULL);
+    break;
+  case RESAMPLE_NATIVE:
+    convert_native(context, NULL);
+    break;
+  default:
+    break;
+  }
+}
+
+// Output starts with the samples the resampler was already holding
+static int64_t next_output_pts(codec_t *this, AVFrame *frame, AVRational timebase)
+{
+  AVRational delay_base;
+  int64_t delay;
+
+  switch (this->mode) {
+  case RESAMPLE_LIBAV:
+    return frame->pts
+      - av_rescale_q(avresample_get_delay(this->resample_context), (AVRational){1, this->input_sample_rate}, timebase)
+      - av_rescale_q(avresample_available(this->resample_context), (AVRational){1, this->output_sample_rate}, timebase);
+
+  case RESAMPLE_NATIVE:
+    delay = polyphase_next_output(this->polyphase, &delay_base);
+    return frame->pts + av_rescale_q(delay, delay_base, timebase);
+
+  default:
+    return frame->pts;
+  }
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+
+  // Source rate / layout / format change - finish off what the old
+  // resampler holds and start again
+  if ((frame->sample_rate > 0 && frame->sample_rate != this->input_sample_rate) ||
+      (frame->channel_layout && frame->channel_layout != this->input_channel_layout) ||
+      frame->format != this->input_sample_format)
+    {
+      drain(context);
+      close_resampler(this);
+
+      if (frame->sample_rate > 0) this->input_sample_rate = frame->sample_rate;
+      if (frame->channel_layout) this->input_channel_layout = frame->channel_layout;
+      this->input_sample_format = frame->format;
+
+      open_resampler(this);
+    }
+
+  if (this->mode == RESAMPLE_PASSTHROUGH) {
+    send_to_graph(context, frame, timebase);
+    return;
+  }
+
+  this->timebase = timebase;
+  if (frame->opaque)
+    {
+      frame_info *info = frame->opaque;
 
-  this->frame->pts = frame->pts;
-  this->frame->opaque = frame->opaque;
-  send_to_graph(context, this->frame, timebase);
+      this->frame_info = realloc(this->frame_info, sizeof(frame_info) + info->buffer_size);
+      memcpy(this->frame_info, info, sizeof(frame_info) + info->buffer_size);
+    }
+
+  this->next_pts = next_output_pts(this, frame, timebase);
+
+  switch (this->mode) {
+  case RESAMPLE_CONVERT:
+    convert_format(context, frame);
+    break;
+  case RESAMPLE_NATIVE:
+    convert_native(context, frame);
+    break;
+  default:
+    convert_libav(context, frame);
+    break;
+  }
 }
 
 static void flush(ID3ASFilterContext *context) 
 {
+  drain(context);
+
   flush_graph(context);
 }
 
+// The option range lets through lengths between the three the polyphase
+// resampler has tables for
+static int validate(void *priv_data, int num_downstream_filters, graph_error *error)
+{
+  codec_t *this = priv_data;
+
+  if (this->quality != 16 && this->quality != 32 && this->quality != 64) {
+    return validation_error(error, "invalid quality %d - must be low (16), medium (32) or high (64)", this->quality);
+  }
+
+  return 0;
+}
+
 static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
 {
   codec_t *this = context->priv_data;
 
-  this->resample_context = avresample_alloc_context();
+  open_resampler(this);
 
-  av_opt_set_int(this->resample_context, "in_channel_layout", this->input_channel_layout, 0);
-  av_opt_set_int(this->resample_context, "out_channel_layout", this->output_channel_layout, 0);
-  av_opt_set_int(this->resample_context, "in_sample_fmt", this->input_sample_format, 0);
-  av_opt_set_int(this->resample_context, "out_sample_fmt", this->output_sample_format, 0);
-  av_opt_set_int(this->resample_context, "in_sample_rate", this->input_sample_rate, 0);
-  av_opt_set_int(this->resample_context, "out_sample_rate", this->output_sample_rate, 0);
+  this->frame = av_frame_alloc();
+  this->planar_frame = av_frame_alloc();
+  this->input_frame = av_frame_alloc();
+  this->scratch_frame = av_frame_alloc();
+}
 
-  avresample_open(this->resample_context);
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
 
-  // Get the frame
-  this->frame = av_frame_alloc();
-  this->frame->format = this->output_sample_format;
-  this->frame->channel_layout = this->output_channel_layout;
-  this->frame->sample_rate = this->output_sample_rate;
-  this->frame->nb_samples = MAX_AUDIO_SAMPLES;
-  this->max_samples = MAX_AUDIO_SAMPLES;
-  av_frame_get_buffer(this->frame, 32);
-  
-  this->output_num_channels = av_get_channel_layout_nb_channels(this->output_channel_layout);
-  this->output_bytes_per_sample = av_get_bytes_per_sample(this->frame->format);
+  close_resampler(this);
+  av_frame_free(&this->frame);
+  av_frame_free(&this->planar_frame);
+  av_frame_free(&this->input_frame);
+  av_frame_free(&this->scratch_frame);
+  av_buffer_pool_uninit(&this->pool);
+  free(this->frame_info);
 }
 
 static const AVOption options[] = {
@@ -88,6 +427,11 @@ static const AVOption options[] = {
   { "output_sample_rate", "the output sample rate", offsetof(codec_t, output_sample_rate), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "output_channel_layout", "the output channel layout", offsetof(codec_t, output_channel_layout), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "output_sample_format", "the output sample format", offsetof(codec_t, output_sample_format), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "native", "use the built in converters where possible", offsetof(codec_t, native), AV_OPT_TYPE_INT, { .i64 = 1 }, 0, 1 },
+  { "quality", "filter length of the built in resampler", offsetof(codec_t, quality), AV_OPT_TYPE_INT, { .i64 = 32 }, 16, 64, 0, "quality" },
+  { "low", "16 taps", 0, AV_OPT_TYPE_CONST, { .i64 = 16 }, 0, 0, 0, "quality" },
+  { "medium", "32 taps", 0, AV_OPT_TYPE_CONST, { .i64 = 32 }, 0, 0, 0, "quality" },
+  { "high", "64 taps", 0, AV_OPT_TYPE_CONST, { .i64 = 64 }, 0, 0, 0, "quality" },
   { NULL }
 };
 
@@ -98,11 +442,17 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "input_sample_rate", "input_channel_layout", "input_sample_format", "output_sample_rate", "output_channel_layout", "output_sample_format", NULL };
+
 ID3ASFilter id3as_resample_audio_filter = {
   .name = "audio resampler",
   .init = init,
   .execute = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .required_options = required_options,
+  .validate = validate
 };
@@ -17,33 +17,13 @@ typedef struct _codec_t
   int noise_sample_count_threshold;
   int silent;
   
-  double (*calc_avg)(AVFrame *insamples, int nb_samples);
+  double (*calc_avg)(const void *samples, int nb_samples);
+  int planar;
 
 } codec_t;
 
 static void do_init(codec_t *this, AVFrame *frame);
 
-#define CALC_AVG(name, type)						\
-  static double calc_avg_##name(AVFrame *insamples, int nb_samples)	\
-  {									\
-  const type *p = (const type *)insamples->data[0];			\
-  int i;								\
-  type sum = 0;								\
-									\
-  for (i = 0; i < nb_samples; i++, p++)					\
-    if (*p < 0)								\
-      sum -= *p++;							\
-    else								\
-      sum += *p++;							\
-									\
-  return (sum / nb_samples);						\
-  }
-
-CALC_AVG(dbl, double)
-CALC_AVG(flt, float)
-CALC_AVG(s32, int32_t)
-CALC_AVG(s16, int16_t)
-
 static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
 {
   codec_t *this = context->priv_data;
@@ -55,7 +35,21 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
   double level;
   int is_silence;
 
-  level = this->calc_avg(frame, nb_samples);
+  if (this->planar) 
+    {
+      level = 0;
+
+      for (int i = 0; i < nb_channels; i++) 
+	{
+	  level += this->calc_avg(frame->extended_data[i], frame->nb_samples);
+	}
+
+      level /= nb_channels;
+    }
+  else 
+    {
+      level = this->calc_avg(frame->data[0], nb_samples);
+    }
 
   is_silence = level < this->noise_threshold;
 
@@ -105,6 +99,7 @@ static void do_init(codec_t *this, AVFrame *frame)
 	break;
       case AV_SAMPLE_FMT_FLTP: 
 	this->calc_avg = calc_avg_flt; 
+	this->planar = 1;
 	break;
       case AV_SAMPLE_FMT_S32:
         this->noise_threshold *= INT32_MAX;
@@ -162,5 +157,6 @@ ID3ASFilter id3as_silence_detect_filter = {
   .execute = process,
   .flush = flush,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO
 };
@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/mem.h>
@@ -10,6 +13,7 @@
 
 typedef struct _metadata_t {
 
+  long graph_id;
   enum AVMediaType type;
 
   char *pin_name;
@@ -23,8 +27,9 @@ typedef struct _metadata_t {
   const char *codec_name;
 
   int sample_rate;
-  char *sample_format_name;
-  char *channel_layout_name;
+  const char *sample_format_name;
+  uint64_t channel_layout;
+  const char *channel_layout_name;
 
   int keyframe;
   int width;
@@ -32,7 +37,7 @@ typedef struct _metadata_t {
   int interlaced;
   AVRational time_base;
   AVRational pixel_aspect_ratio;
-  char *pixel_format_name;
+  const char *pixel_format_name;
   int profile;
   int level;
 
@@ -42,16 +47,43 @@ typedef struct _metadata_t {
 
 } metadata_t;
 
-static void write_frame(metadata_t *metadata, char *frame_info, int frame_info_size, char *data, int data_size);
+// The parts of an output pin's frame terms that only change with the
+// codec parameters, pre-encoded so that each frame only encodes its
+// timestamps, flags, frame type and data.  preamble is everything before
+// the frame info, prefix the frame header up to the frame type (or the
+// extradata, for audio) and suffix the rest of a video header up to the
+// extradata.
+struct _output_header
+{
+  enum ExtradataMode extradata_mode;
+
+  int valid;
+  metadata_t metadata;
+  uint8_t *extradata;
+  int extradata_size;
+
+  char *preamble;
+  int preamble_size;
+  char *prefix;
+  int prefix_size;
+  char *suffix;
+  int suffix_size;
+};
+
+static void write_frame(metadata_t *metadata, output_header *header, char *frame_info, int frame_info_size, struct iovec *data, int nb_data);
 static void write_data(char *data, int size);
+static void write_data_gathered(char *data, int size, int data_offset, struct iovec *segments, int nb_segments);
 static void resize_buffer(int bytes_required, char **output_buffer, int *buffer_size);
-static char *get_pixel_format_name(enum PixelFormat pixel_format);
-static char *get_sample_format_name(int sample_format);
-static char *get_channel_layout_name(int channel_layout);
-static int encode_frame(char *output_buffer, metadata_t *metadata, char *frame_info, int frame_info_size, char *data, int data_size);
-static void encode_audio_header(char *output_buffer, int *i, metadata_t *metadata);
-static void encode_video_header(char *output_buffer, int *i, metadata_t *metadata);
+static const char *get_pixel_format_name(enum PixelFormat pixel_format);
+static const char *get_sample_format_name(enum AVSampleFormat sample_format);
+static const char *get_channel_layout_name(uint64_t channel_layout, char *buffer, int size);
+static int encode_frame(char *output_buffer, metadata_t *metadata, output_header *header, char *frame_info, int frame_info_size, int data_size, int *data_offset);
+static void encode_preamble(char *output_buffer, int *i, metadata_t *metadata);
+static void encode_header_prefix(char *output_buffer, int *i, metadata_t *metadata);
+static void encode_header_suffix(char *output_buffer, int *i, metadata_t *metadata);
 static void encode_timestamp(char *output_buffer, int *i, int64_t timestamp);
+static void encode_graph_header(char *output_buffer, int *i, long graph_id);
+static void encode_latency(char *output_buffer, int *i, int valid, latency_summary *summary);
 
 static i_mutex_t mutex = INITIALISE_STATIC_MUTEX();
 
@@ -65,11 +97,31 @@ void unlock_output()
   i_mutex_unlock(&mutex);
 }
 
+void send_to_filter(ID3ASFilterContext *filter, AVFrame *frame, AVRational timebase)
+{
+  if (__atomic_load_n(&filter->pending_reconfiguration, __ATOMIC_RELAXED)) {
+    apply_reconfiguration(filter);
+  }
+
+  // A frame with no picture only carries the packets an encoded video input
+  // had left at flush; it goes straight past filters with no use for it
+  if (!frame->data[0] && !filter->filter->takes_packet_frames) {
+    send_to_graph(filter, frame, timebase);
+    return;
+  }
+
+  uint64_t start = latency_now();
+
+  filter->execute(filter, frame, timebase);
+
+  record_latency(filter->execute_latency, latency_now() - start);
+}
+
 void send_to_graph(ID3ASFilterContext *this, AVFrame *frame, AVRational timebase)
 {
   for (int i = 0; i < this->num_downstream_filters; i++)
     {
-      this->downstream_filters[i]->filter->execute(this->downstream_filters[i], frame, timebase);
+      send_to_filter(this->downstream_filters[i], frame, timebase);
     }
 }
 
@@ -109,63 +161,114 @@ AVCodec *get_decoder(char *codec_name)
   return codec;
 }
 
-static char *get_sample_format_name(int sample_format)
+// Names as sent to Erlang (as atoms) in output metadata.  Anything not in
+// these tables falls back to libav's own name rather than failing, so
+// formats flow through to the outputs without a conversion stage that
+// exists only to produce a name we recognise.
+
+typedef struct _format_name
 {
-  if (sample_format == AV_SAMPLE_FMT_U8)
-    {
-      return "u8";
-    }
-  else if (sample_format == AV_SAMPLE_FMT_S16)
-    {
-      return "s16";
-    }
-  else if (sample_format == AV_SAMPLE_FMT_S16P)
-    {
-      return "s16p";
-    }
-  else if (sample_format == AV_SAMPLE_FMT_FLT)
-    {
-      return "flt";
-    }
-  else if (sample_format == AV_SAMPLE_FMT_FLTP)
+  uint64_t format;
+  const char *name;
+
+} format_name;
+
+static const format_name pixel_format_names[] = {
+  { PIX_FMT_YUV420P, "yuv420p" },
+  { AV_PIX_FMT_YUVJ420P, "yuvj420p" },
+  { AV_PIX_FMT_YUV422P, "yuv422p" },
+  { AV_PIX_FMT_YUVJ422P, "yuvj422p" },
+  { AV_PIX_FMT_YUV444P, "yuv444p" },
+  { AV_PIX_FMT_YUVJ444P, "yuvj444p" },
+  { AV_PIX_FMT_YUV420P10LE, "yuv420p10le" },
+  { AV_PIX_FMT_YUV422P10LE, "yuv422p10le" },
+  { AV_PIX_FMT_YUV444P10LE, "yuv444p10le" },
+  { AV_PIX_FMT_NV12, "nv12" },
+  { AV_PIX_FMT_UYVY422, "uyvy422" },
+  { AV_PIX_FMT_YUYV422, "yuyv422" },
+  { AV_PIX_FMT_GRAY8, "gray" },
+  { PIX_FMT_BGR24, "bgr24" },
+  { AV_PIX_FMT_RGB24, "rgb24" },
+  { AV_PIX_FMT_BGRA, "bgra" },
+  { AV_PIX_FMT_RGBA, "rgba" },
+};
+
+static const format_name sample_format_names[] = {
+  { AV_SAMPLE_FMT_U8, "u8" },
+  { AV_SAMPLE_FMT_S16, "s16" },
+  { AV_SAMPLE_FMT_S32, "s32" },
+  { AV_SAMPLE_FMT_FLT, "flt" },
+  { AV_SAMPLE_FMT_DBL, "dbl" },
+  { AV_SAMPLE_FMT_U8P, "u8p" },
+  { AV_SAMPLE_FMT_S16P, "s16p" },
+  { AV_SAMPLE_FMT_S32P, "s32p" },
+  { AV_SAMPLE_FMT_FLTP, "fltp" },
+  { AV_SAMPLE_FMT_DBLP, "dblp" },
+};
+
+static const format_name channel_layout_names[] = {
+  { AV_CH_LAYOUT_MONO, "mono" },
+  { AV_CH_LAYOUT_STEREO, "stereo" },
+  { AV_CH_LAYOUT_2POINT1, "2.1" },
+  { AV_CH_LAYOUT_SURROUND, "3.0" },
+  { AV_CH_LAYOUT_QUAD, "quad" },
+  { AV_CH_LAYOUT_5POINT0, "5.0(side)" },
+  { AV_CH_LAYOUT_5POINT1, "5.1(side)" },
+  { AV_CH_LAYOUT_5POINT0_BACK, "5.0" },
+  { AV_CH_LAYOUT_5POINT1_BACK, "5.1" },
+  { AV_CH_LAYOUT_6POINT1, "6.1" },
+  { AV_CH_LAYOUT_7POINT0, "7.0" },
+  { AV_CH_LAYOUT_7POINT1, "7.1" },
+};
+
+#define LOOKUP_NAME(table, format) lookup_name(table, sizeof(table) / sizeof(table[0]), format)
+
+static const char *lookup_name(const format_name *table, int size, uint64_t format)
+{
+  for (int i = 0; i < size; i++)
     {
-      return "fltp";
+      if (table[i].format == format) {
+	return table[i].name;
+      }
     }
 
-  ERRORFMT("Invalid sample format %d", sample_format);
-  exit(1);
+  return NULL;
 }
 
-static char *get_channel_layout_name(int channel_layout)
+static const char *get_sample_format_name(enum AVSampleFormat sample_format)
 {
-  switch (channel_layout) {
-  case AV_CH_LAYOUT_MONO:
-    return "mono";
-  case AV_CH_LAYOUT_STEREO:
-    return "stereo";
-  default:
-    ERRORFMT("Invalid channel layout %d", channel_layout);
-    exit(1);
+  const char *name = LOOKUP_NAME(sample_format_names, sample_format);
+
+  if (!name) {
+    name = av_get_sample_fmt_name(sample_format);
   }
+
+  return name ? name : "unknown";
 }
 
-static char * get_pixel_format_name(enum PixelFormat pixel_format)
+// Layouts without a name of their own get libav's description, which
+// spells out the channel count and positions, written into buffer
+static const char *get_channel_layout_name(uint64_t channel_layout, char *buffer, int size)
 {
-  if (pixel_format == PIX_FMT_YUV420P)
-    {
-      return "yuv420p";
-    }
-  else if (pixel_format == PIX_FMT_BGR24)
-    {
-      return "bgr24";
-    }
-  else if (pixel_format == AV_PIX_FMT_YUVJ420P)
-    {
-      return "yuvj420p";
-    }
+  const char *name = LOOKUP_NAME(channel_layout_names, channel_layout);
 
-  ERRORFMT("unknown pixel format %d", pixel_format);
-  exit(1);
+  if (!name) {
+    av_get_channel_layout_string(buffer, size, 0, channel_layout);
+    name = buffer;
+  }
+
+  return name;
+}
+
+static const char *get_pixel_format_name(enum PixelFormat pixel_format)
+{
+  const char *name = LOOKUP_NAME(pixel_format_names, pixel_format);
+
+  if (!name) {
+    name = av_get_pix_fmt_name(pixel_format);
+  }
+
+  return name ? name : "unknown";
 }
 
 AVCodecContext *allocate_audio_context(AVCodec *codec, int sample_rate, int channel_layout, enum AVSampleFormat sample_format, AVDictionary *codec_options)
@@ -210,9 +313,9 @@ AVCodecContext *allocate_video_context(AVCodec *codec, int width, int height, en
   c->extradata = extradata;
   c->refcounted_frames = 1;
 
-  if (strcmp(codec->name, "libx264") == 0) {
-    AVDictionaryEntry *profileEntry = av_dict_get(codec_options, "profile", NULL, 0);
+  AVDictionaryEntry *profileEntry = av_dict_get(codec_options, "profile", NULL, 0);
 
+  if (strcmp(codec->name, "libx264") == 0 && profileEntry) {
     if (strcmp(profileEntry->value, "baseline") == 0) {
       c->profile = FF_PROFILE_H264_BASELINE;
     }
@@ -253,6 +356,76 @@ AVCodecContext *allocate_video_context(AVCodec *codec, int width, int height, en
   return c;
 }
 
+// For contexts from allocate_audio_context / allocate_video_context, or
+// ones that were never opened; any extradata they were given goes too
+void free_codec_context(AVCodecContext **context)
+{
+  if (!*context) {
+    return;
+  }
+
+  avcodec_close(*context);
+  av_freep(&(*context)->extradata);
+  av_freep(context);
+}
+
+// Gives an audio frame, with format, channel_layout and nb_samples already
+// set, one buffer from the pool for all of its planes.  The pool is replaced
+// whenever a frame needs more than its buffers hold.
+void get_pooled_audio_buffer(AVFrame *frame, AVBufferPool **pool, int *pool_size)
+{
+  int channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+  int planar = av_sample_fmt_is_planar(frame->format);
+  int planes = planar ? channels : 1;
+  int linesize = FFALIGN(frame->nb_samples * av_get_bytes_per_sample(frame->format) * (planar ? 1 : channels), 32);
+
+  if (linesize * planes > *pool_size) {
+    av_buffer_pool_uninit(pool);
+    *pool = av_buffer_pool_init(linesize * planes, NULL);
+    *pool_size = linesize * planes;
+  }
+
+  frame->buf[0] = av_buffer_pool_get(*pool);
+  frame->linesize[0] = linesize;
+
+  if (planes > AV_NUM_DATA_POINTERS) {
+    frame->extended_data = av_mallocz(sizeof(uint8_t *) * planes);
+  }
+  else {
+    frame->extended_data = frame->data;
+  }
+
+  for (int i = 0; i < planes; i++)
+    {
+      frame->extended_data[i] = frame->buf[0]->data + i * linesize;
+      if (i < AV_NUM_DATA_POINTERS) {
+	frame->data[i] = frame->extended_data[i];
+      }
+    }
+}
+
+// As get_pooled_audio_buffer, for a video frame with format, width and
+// height set.  Lines are padded to 32 bytes.
+void get_pooled_video_buffer(AVFrame *frame, AVBufferPool **pool, int *pool_size)
+{
+  int size;
+
+  av_image_fill_linesizes(frame->linesize, frame->format, FFALIGN(frame->width, 32));
+
+  size = av_image_fill_pointers(frame->data, frame->format, frame->height, NULL, frame->linesize);
+
+  if (size > *pool_size) {
+    av_buffer_pool_uninit(pool);
+    *pool = av_buffer_pool_init(size + FF_INPUT_BUFFER_PADDING_SIZE, NULL);
+    *pool_size = size;
+  }
+
+  frame->buf[0] = av_buffer_pool_get(*pool);
+  frame->extended_data = frame->data;
+
+  av_image_fill_pointers(frame->data, frame->format, frame->height, frame->buf[0]->data, frame->linesize);
+}
+
 void set_packet_metadata(AVPacket *pkt, unsigned char *metadata)
 {
   char *buf = (char *) metadata;
@@ -280,36 +453,245 @@ void set_frame_metadata(AVFrame *frame, unsigned char *metadata)
   I_DECODE_LONGLONG(buf, &index, (long long *) &frame->pts);
 }
 
-static int encode_done(char *type, char *output_buffer)
+static int encode_done(long graph_id, char *type, char *output_buffer)
 {
   int i = 0;
 
   ei_encode_version(output_buffer, &i);
+  encode_graph_header(output_buffer, &i, graph_id);
   ei_encode_atom(output_buffer, &i, type);
 
   return i;
 }
 
-void write_done(char *type) {
+void write_done(long graph_id, char *type) {
+
+  static char *output_buffer = NULL;
+  static int buffer_size = 0;
+
+  i_mutex_lock(&mutex);
+
+  int bytes_required = encode_done(graph_id, type, NULL);
+
+  resize_buffer(bytes_required, &output_buffer, &buffer_size);
+
+  encode_done(graph_id, type, output_buffer);
+
+  write_data(output_buffer, bytes_required);
+
+  i_mutex_unlock(&mutex);
+}
+
+typedef struct _filter_stats
+{
+  const char *name;
+  int has_execute_latency;
+  int has_queue_latency;
+  latency_summary execute_latency;
+  latency_summary queue_latency;
+
+} filter_stats;
+
+// The graph can change shape and its histograms keep counting while we
+// write, so everything is read in one depth-first pass up front and the
+// sizing and writing passes both work from that
+static void collect_filter_stats(ID3ASFilterContext *this, filter_stats **stats, int *count, int *capacity)
+{
+  ID3ASFilterContext **downstream_filters;
+  int num_downstream_filters = get_downstream_filters(this, &downstream_filters);
+
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    *stats = realloc(*stats, sizeof(filter_stats) * *capacity);
+  }
+
+  filter_stats *entry = &(*stats)[(*count)++];
+
+  entry->name = this->filter->name;
+  entry->has_execute_latency = this->execute_latency != NULL;
+  entry->has_queue_latency = this->queue_latency != NULL;
+
+  if (this->execute_latency) {
+    get_latency_summary(this->execute_latency, &entry->execute_latency);
+  }
+  if (this->queue_latency) {
+    get_latency_summary(this->queue_latency, &entry->queue_latency);
+  }
+
+  for (int j = 0; j < num_downstream_filters; j++)
+    {
+      collect_filter_stats(downstream_filters[j], stats, count, capacity);
+    }
+}
+
+// One {Index, Name, ExecuteLatency, QueueLatency} entry per filter, in
+// depth-first order
+static int encode_stats(char *output_buffer, long graph_id, filter_stats *stats, int count)
+{
+  int i = 0;
+
+  ei_encode_version(output_buffer, &i);
+  encode_graph_header(output_buffer, &i, graph_id);
+  ei_encode_tuple_header(output_buffer, &i, 2);
+  ei_encode_atom(output_buffer, &i, "stats");
+  ei_encode_list_header(output_buffer, &i, count);
+
+  for (int j = 0; j < count; j++)
+    {
+      ei_encode_tuple_header(output_buffer, &i, 4);
+      ei_encode_long(output_buffer, &i, j);
+      ei_encode_atom(output_buffer, &i, stats[j].name);
+      encode_latency(output_buffer, &i, stats[j].has_execute_latency, &stats[j].execute_latency);
+      encode_latency(output_buffer, &i, stats[j].has_queue_latency, &stats[j].queue_latency);
+    }
+
+  ei_encode_empty_list(output_buffer, &i);
+
+  return i;
+}
+
+void write_stats(ID3ASFilterContext *graph)
+{
+  static char *output_buffer = NULL;
+  static int buffer_size = 0;
+  static filter_stats *stats = NULL;
+  static int capacity = 0;
+  int count = 0;
+
+  i_mutex_lock(&mutex);
+
+  collect_filter_stats(graph, &stats, &count, &capacity);
+
+  int bytes_required = encode_stats(NULL, graph->graph_id, stats, count);
 
+  resize_buffer(bytes_required, &output_buffer, &buffer_size);
+
+  encode_stats(output_buffer, graph->graph_id, stats, count);
+
+  write_data(output_buffer, bytes_required);
+
+  i_mutex_unlock(&mutex);
+}
+
+static int encode_graph_error(char *output_buffer, long graph_id, char *reason, graph_error *error)
+{
+  int i = 0;
+
+  ei_encode_version(output_buffer, &i);
+  encode_graph_header(output_buffer, &i, graph_id);
+  ei_encode_tuple_header(output_buffer, &i, 2);
+  ei_encode_atom(output_buffer, &i, "error");
+  ei_encode_tuple_header(output_buffer, &i, 4);
+  ei_encode_atom(output_buffer, &i, reason);
+
+  if (error->depth > 0) {
+    ei_encode_list_header(output_buffer, &i, error->depth);
+    for (int j = 0; j < error->depth; j++)
+      {
+	ei_encode_long(output_buffer, &i, error->path[j]);
+      }
+  }
+  ei_encode_empty_list(output_buffer, &i);
+
+  ei_encode_binary(output_buffer, &i, error->filter_name, strlen(error->filter_name));
+  ei_encode_binary(output_buffer, &i, error->message, strlen(error->message));
+
+  return i;
+}
+
+// {error, {Reason, Path, FilterName, Message}} where Path is the list
+// of downstream indices from the input to the offending filter
+void write_graph_error(long graph_id, char *reason, graph_error *error)
+{
   static char *output_buffer = NULL;
   static int buffer_size = 0;
 
-  int bytes_required = encode_done(type, NULL);
+  i_mutex_lock(&mutex);
+
+  int bytes_required = encode_graph_error(NULL, graph_id, reason, error);
 
   resize_buffer(bytes_required, &output_buffer, &buffer_size);
 
-  encode_done(type, output_buffer);
+  encode_graph_error(output_buffer, graph_id, reason, error);
 
   write_data(output_buffer, bytes_required);
+
+  i_mutex_unlock(&mutex);
+}
+
+// Raw frames are written straight from their planes: write_frame gathers
+// these segments after the encoded term rather than copying them into it.
+// Adjacent segments are merged, so a tightly packed frame is one segment.
+static struct iovec *frame_segments = NULL;
+static int nb_frame_segments = 0;
+static int frame_segments_size = 0;
+
+static void add_frame_segment(uint8_t *data, int size)
+{
+  struct iovec *last = nb_frame_segments ? &frame_segments[nb_frame_segments - 1] : NULL;
+
+  if (last && (uint8_t *) last->iov_base + last->iov_len == data) {
+    last->iov_len += size;
+    return;
+  }
+
+  if (nb_frame_segments == frame_segments_size) {
+    frame_segments_size = frame_segments_size ? frame_segments_size * 2 : 64;
+    frame_segments = realloc(frame_segments, sizeof(struct iovec) * frame_segments_size);
+  }
+
+  frame_segments[nb_frame_segments].iov_base = data;
+  frame_segments[nb_frame_segments].iov_len = size;
+  nb_frame_segments++;
+}
+
+// Video planes are sent one after the other without any row padding, and
+// audio as the frame's own layout - interleaved samples, or each channel's
+// plane in turn
+static void add_frame_segments(AVFrame *frame, enum AVMediaType type)
+{
+  if (type == AVMEDIA_TYPE_AUDIO)
+    {
+      int channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+      int planar = av_sample_fmt_is_planar(frame->format);
+      int plane_size = frame->nb_samples * av_get_bytes_per_sample(frame->format) * (planar ? 1 : channels);
+
+      for (int p = 0; p < (planar ? channels : 1); p++)
+	{
+	  add_frame_segment(frame->extended_data[p], plane_size);
+	}
+
+      return;
+    }
+
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+
+  for (int p = 0; p < av_pix_fmt_count_planes(frame->format); p++)
+    {
+      int row_size = av_image_get_linesize(frame->format, frame->width, p);
+      int rows = (p == 1 || p == 2) ? -((-frame->height) >> desc->log2_chroma_h) : frame->height;
+
+      if (frame->linesize[p] == row_size) {
+	add_frame_segment(frame->data[p], row_size * rows);
+	continue;
+      }
+
+      for (int y = 0; y < rows; y++)
+	{
+	  add_frame_segment(frame->data[p] + y * frame->linesize[p], row_size);
+	}
+    }
 }
 
-void write_output_from_frame(char *pin_name, int stream_id, AVFrame *frame)
+void write_output_from_frame(long graph_id, output_header *header, char *pin_name, int stream_id, AVFrame *frame)
 {
+  char layout_name[64];
+
   i_mutex_lock(&mutex);
 
   metadata_t metadata = {
-    .type = frame->pict_type == 0 ? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_VIDEO,
+    .graph_id = graph_id,
+    .type = frame->nb_samples > 0 ? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_VIDEO,
     .pin_name = pin_name,
     .stream_id = stream_id,
     .pts = frame->pts,
@@ -326,7 +708,9 @@ void write_output_from_frame(char *pin_name, int stream_id, AVFrame *frame)
     metadata.keyframe = frame->key_frame;
     metadata.width = frame->width;
     metadata.height = frame->height;
+    metadata.interlaced = frame->interlaced_frame;
     metadata.pixel_format_name = get_pixel_format_name(frame->format);
+    metadata.pixel_aspect_ratio = frame->sample_aspect_ratio;
     metadata.profile = -1;
     metadata.level = -1;
     break;
@@ -334,7 +718,8 @@ void write_output_from_frame(char *pin_name, int stream_id, AVFrame *frame)
   case AVMEDIA_TYPE_AUDIO:
     metadata.sample_rate = frame->sample_rate;
     metadata.sample_format_name = get_sample_format_name(frame->format);
-    metadata.channel_layout_name = get_channel_layout_name(frame->channel_layout);
+    metadata.channel_layout = frame->channel_layout;
+    metadata.channel_layout_name = get_channel_layout_name(frame->channel_layout, layout_name, sizeof(layout_name));
     break;
 
   default:
@@ -342,15 +727,21 @@ void write_output_from_frame(char *pin_name, int stream_id, AVFrame *frame)
     exit(-1);
   }
 
-  write_frame(&metadata, NULL, 0, (char *)frame->data[0], frame->linesize[0]);
+  nb_frame_segments = 0;
+  add_frame_segments(frame, metadata.type);
+
+  write_frame(&metadata, header, NULL, 0, frame_segments, nb_frame_segments);
   i_mutex_unlock(&mutex);
 }
 
-void write_output_from_packet(char *pin_name, int stream_id, AVCodecContext *codec_context, AVPacket *pkt, frame_info *frame_info)
+void write_output_from_packet(long graph_id, output_header *header, char *pin_name, int stream_id, AVCodecContext *codec_context, AVPacket *pkt, frame_info *frame_info)
 {
+  char layout_name[64];
+
   i_mutex_lock(&mutex);
 
   metadata_t metadata = {
+    .graph_id = graph_id,
     .type = codec_context->codec_type,
     .pin_name = pin_name,
     .stream_id = stream_id,
@@ -383,7 +774,8 @@ void write_output_from_packet(char *pin_name, int stream_id, AVCodecContext *cod
   case AVMEDIA_TYPE_AUDIO:
     metadata.sample_rate = codec_context->sample_rate;
     metadata.sample_format_name = get_sample_format_name(codec_context->sample_fmt);
-    metadata.channel_layout_name = get_channel_layout_name(codec_context->channel_layout);
+    metadata.channel_layout = codec_context->channel_layout;
+    metadata.channel_layout_name = get_channel_layout_name(codec_context->channel_layout, layout_name, sizeof(layout_name));
     metadata.profile = codec_context->profile;
     metadata.level = codec_context->level;
     break;
@@ -393,7 +785,9 @@ void write_output_from_packet(char *pin_name, int stream_id, AVCodecContext *cod
     exit(-1);
   }
 
-  write_frame(&metadata, (char *)frame_info->buffer, frame_info->buffer_size, (char *)pkt->data, pkt->size);
+  struct iovec data = { .iov_base = pkt->data, .iov_len = pkt->size };
+
+  write_frame(&metadata, header, (char *)frame_info->buffer, frame_info->buffer_size, &data, 1);
 
   i_mutex_unlock(&mutex);
 }
@@ -404,78 +798,309 @@ static void write_data(char *data, int size)
   write_buffer_to_port(PACKET_SIZE, (unsigned char *)data, size);
 }
 
-static void write_frame(metadata_t *metadata, char *frame_info, int frame_info_size, char *data, int data_size)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// The same packet as write_data, with the segments' bytes spliced in at
+// data_offset, written with as few system calls as the segments allow
+static void write_data_gathered(char *data, int size, int data_offset, struct iovec *segments, int nb_segments)
+{
+  static struct iovec *iov = NULL;
+  static int iov_size = 0;
+
+  uint32_t length = size;
+  unsigned char header[PACKET_SIZE];
+  int iovcnt = 0;
+
+  for (int j = 0; j < nb_segments; j++)
+    {
+      length += segments[j].iov_len;
+    }
+
+  for (int j = 0; j < PACKET_SIZE; j++)
+    {
+      header[j] = length >> (8 * (PACKET_SIZE - 1 - j));
+    }
+
+  if (iov_size < nb_segments + 3) {
+    iov_size = nb_segments + 3;
+    iov = realloc(iov, sizeof(struct iovec) * iov_size);
+  }
+
+  iov[iovcnt++] = (struct iovec) { .iov_base = header, .iov_len = PACKET_SIZE };
+  iov[iovcnt++] = (struct iovec) { .iov_base = data, .iov_len = data_offset };
+  memcpy(iov + iovcnt, segments, sizeof(struct iovec) * nb_segments);
+  iovcnt += nb_segments;
+  iov[iovcnt++] = (struct iovec) { .iov_base = data + data_offset, .iov_len = size - data_offset };
+
+  struct iovec *next = iov;
+
+  while (iovcnt > 0)
+    {
+      ssize_t written = writev(STDOUT_FILENO, next, FFMIN(iovcnt, IOV_MAX));
+
+      if (written < 0)
+	{
+	  if (errno == EINTR) {
+	    continue;
+	  }
+
+	  ERRORFMT("Failed to write frame: %s\n", strerror(errno));
+	  exit(1);
+	}
+
+      while (iovcnt > 0 && written >= next->iov_len)
+	{
+	  written -= next->iov_len;
+	  next++;
+	  iovcnt--;
+	}
+
+      if (iovcnt > 0) {
+	next->iov_base = (char *) next->iov_base + written;
+	next->iov_len -= written;
+      }
+    }
+}
+
+output_header *allocate_output_header(enum ExtradataMode extradata_mode)
+{
+  output_header *this = calloc(1, sizeof(output_header));
+
+  this->extradata_mode = extradata_mode;
+
+  return this;
+}
+
+void free_output_header(output_header **header)
+{
+  output_header *this = *header;
+
+  if (!this) {
+    return;
+  }
+
+  free(this->extradata);
+  free(this->preamble);
+  free(this->prefix);
+  free(this->suffix);
+  free(this);
+
+  *header = NULL;
+}
+
+static int same_static_metadata(metadata_t *a, metadata_t *b)
+{
+  return a->graph_id == b->graph_id &&
+    a->type == b->type &&
+    a->stream_id == b->stream_id &&
+    strcmp(a->pin_name, b->pin_name) == 0 &&
+    strcmp(a->codec_name, b->codec_name) == 0 &&
+    a->profile == b->profile &&
+    a->level == b->level &&
+    a->sample_rate == b->sample_rate &&
+    a->sample_format_name == b->sample_format_name &&
+    a->channel_layout == b->channel_layout &&
+    a->width == b->width &&
+    a->height == b->height &&
+    a->interlaced == b->interlaced &&
+    a->pixel_format_name == b->pixel_format_name &&
+    a->pixel_aspect_ratio.num == b->pixel_aspect_ratio.num &&
+    a->pixel_aspect_ratio.den == b->pixel_aspect_ratio.den &&
+    a->time_base.num == b->time_base.num &&
+    a->time_base.den == b->time_base.den;
+}
+
+static void encode_cached(char **cached, int *cached_size, void (*encode)(char *, int *, metadata_t *), metadata_t *metadata)
+{
+  int size = 0;
+
+  encode(NULL, &size, metadata);
+
+  *cached = realloc(*cached, size);
+  *cached_size = 0;
+
+  encode(*cached, cached_size, metadata);
+}
+
+static void append_cached(char *output_buffer, int *i, char *cached, int cached_size)
+{
+  if (output_buffer) {
+    memcpy(output_buffer + *i, cached, cached_size);
+  }
+
+  *i += cached_size;
+}
+
+// Re-encodes the cached terms if the codec parameters have changed, and
+// clears the metadata's extradata if this frame shouldn't carry it
+static void update_output_header(output_header *this, metadata_t *metadata)
+{
+  int send_extradata = this->extradata_mode == EXTRADATA_ALWAYS ||
+    (this->extradata_mode == EXTRADATA_ON_KEYFRAME && metadata->keyframe);
+
+  if (metadata->extradata_size != this->extradata_size ||
+      memcmp(metadata->extradata, this->extradata, metadata->extradata_size) != 0)
+    {
+      this->extradata = realloc(this->extradata, metadata->extradata_size);
+      this->extradata_size = metadata->extradata_size;
+      memcpy(this->extradata, metadata->extradata, metadata->extradata_size);
+      send_extradata = 1;
+    }
+
+  if (!this->valid || !same_static_metadata(metadata, &this->metadata))
+    {
+      encode_cached(&this->preamble, &this->preamble_size, encode_preamble, metadata);
+      encode_cached(&this->prefix, &this->prefix_size, encode_header_prefix, metadata);
+      encode_cached(&this->suffix, &this->suffix_size, encode_header_suffix, metadata);
+
+      this->metadata = *metadata;
+      this->valid = 1;
+      send_extradata = 1;
+    }
+
+  if (!send_extradata) {
+    metadata->extradata = NULL;
+    metadata->extradata_size = 0;
+  }
+}
+
+static void write_frame(metadata_t *metadata, output_header *header, char *frame_info, int frame_info_size, struct iovec *data, int nb_data)
 {
   static char *output_buffer = NULL;
   static int buffer_size = 0;
 
-  int bytes_required = encode_frame(NULL, metadata, frame_info, frame_info_size, data, data_size);
+  int data_size = 0;
+  int data_offset;
+
+  for (int j = 0; j < nb_data; j++)
+    {
+      data_size += data[j].iov_len;
+    }
+
+  if (header) {
+    update_output_header(header, metadata);
+  }
+
+  int bytes_required = encode_frame(NULL, metadata, header, frame_info, frame_info_size, data_size, &data_offset);
 
   resize_buffer(bytes_required, &output_buffer, &buffer_size);
 
-  encode_frame(output_buffer, metadata, frame_info, frame_info_size, data, data_size);
+  encode_frame(output_buffer, metadata, header, frame_info, frame_info_size, data_size, &data_offset);
 
-  write_data(output_buffer, bytes_required);
+  write_data_gathered(output_buffer, bytes_required, data_offset, data, nb_data);
 }
 
-static int encode_frame(char *output_buffer, metadata_t *metadata, char *frame_info, int frame_info_size, char *data, int data_size)
+// An ei binary's tag and length, leaving the caller to supply its bytes
+static void encode_binary_header(char *output_buffer, int *i, int size)
+{
+  if (output_buffer) {
+    unsigned char *p = (unsigned char *) output_buffer + *i;
+
+    p[0] = ERL_BINARY_EXT;
+    p[1] = size >> 24;
+    p[2] = size >> 16;
+    p[3] = size >> 8;
+    p[4] = size;
+  }
+
+  *i += 5;
+}
+
+// header may be NULL, in which case everything is encoded from metadata.
+// The frame's data is left out: the term is only complete once data_size
+// bytes are inserted at *data_offset.
+static int encode_frame(char *output_buffer, metadata_t *metadata, output_header *header, char *frame_info, int frame_info_size, int data_size, int *data_offset)
 {
   int i = 0;
 
-  ei_encode_version(output_buffer, &i);
+  if (header) {
+    append_cached(output_buffer, &i, header->preamble, header->preamble_size);
+  }
+  else {
+    encode_preamble(output_buffer, &i, metadata);
+  }
 
-  ei_encode_tuple_header(output_buffer, &i, 3);
-  ei_encode_atom(output_buffer, &i, "output_frame");
-  ei_encode_atom(output_buffer, &i, metadata->pin_name);
-  ei_encode_tuple_header(output_buffer, &i, 8);
-  ei_encode_atom(output_buffer, &i, "frame");
   ei_encode_binary(output_buffer, &i, frame_info, frame_info_size); // info
   encode_timestamp(output_buffer, &i, metadata->pts); // pts
   encode_timestamp(output_buffer, &i, metadata->dts); // dts
   ei_encode_long(output_buffer, &i, metadata->duration);       // duration
   ei_encode_long(output_buffer, &i, metadata->flags); // flags
-  ei_encode_binary(output_buffer, &i, data, data_size); // data
+  encode_binary_header(output_buffer, &i, data_size); // data
+  *data_offset = i;
 
+  if (header) {
+    append_cached(output_buffer, &i, header->prefix, header->prefix_size);
+  }
+  else {
+    encode_header_prefix(output_buffer, &i, metadata);
+  }
+
+  if (metadata->type == AVMEDIA_TYPE_VIDEO) {
+    ei_encode_atom(output_buffer, &i, metadata->keyframe ? "iframe" : "bp_frame");  // frame_type
+  }
+
+  if (header) {
+    append_cached(output_buffer, &i, header->suffix, header->suffix_size);
+  }
+  else {
+    encode_header_suffix(output_buffer, &i, metadata);
+  }
+
+  ei_encode_binary(output_buffer, &i, metadata->extradata, metadata->extradata_size); // extradata
+
+  return i;
+}
+
+static void encode_preamble(char *output_buffer, int *i, metadata_t *metadata)
+{
+  ei_encode_version(output_buffer, i);
+  encode_graph_header(output_buffer, i, metadata->graph_id);
+
+  ei_encode_tuple_header(output_buffer, i, 3);
+  ei_encode_atom(output_buffer, i, "output_frame");
+  ei_encode_atom(output_buffer, i, metadata->pin_name);
+  ei_encode_tuple_header(output_buffer, i, 8);
+  ei_encode_atom(output_buffer, i, "frame");
+}
+
+static void encode_header_prefix(char *output_buffer, int *i, metadata_t *metadata)
+{
   switch (metadata->type) {
   case AVMEDIA_TYPE_VIDEO:
-    encode_video_header(output_buffer, &i, metadata);
+    ei_encode_tuple_header(output_buffer, i, 12);
+    ei_encode_atom(output_buffer, i, "video_frame");
+    ei_encode_atom(output_buffer, i, metadata->codec_name); // format
+    ei_encode_tuple_header(output_buffer, i, 2); // profile_level
+    ei_encode_long(output_buffer, i, metadata->profile);
+    ei_encode_long(output_buffer, i, metadata->level);
     break;
+
   case AVMEDIA_TYPE_AUDIO:
-    encode_audio_header(output_buffer, &i, metadata);
+    ei_encode_tuple_header(output_buffer, i, 7);
+    ei_encode_atom(output_buffer, i, "audio_frame");
+    ei_encode_atom(output_buffer, i, metadata->codec_name); // format
+    ei_encode_tuple_header(output_buffer, i, 2); // profile_level
+    ei_encode_long(output_buffer, i, metadata->profile);
+    ei_encode_long(output_buffer, i, metadata->level);
+    ei_encode_long(output_buffer, i, metadata->sample_rate);  // sample_rate
+    ei_encode_atom(output_buffer, i, metadata->sample_format_name); // sample_fmt
+    ei_encode_atom(output_buffer, i, metadata->channel_layout_name); // channel_layout
     break;
+
   default:
     ERRORFMT("Unsupported codec type %d\n", metadata->type);
     exit(-1);
   }
-
-  return i;
 }
 
-static void encode_audio_header(char *output_buffer, int *i, metadata_t *metadata)
+static void encode_header_suffix(char *output_buffer, int *i, metadata_t *metadata)
 {
-  ei_encode_tuple_header(output_buffer, i, 7);
-  ei_encode_atom(output_buffer, i, "audio_frame");
-  ei_encode_atom(output_buffer, i, metadata->codec_name); // format
-  ei_encode_tuple_header(output_buffer, i, 2); // profile_level
-  ei_encode_long(output_buffer, i, metadata->profile);
-  ei_encode_long(output_buffer, i, metadata->level);
-  ei_encode_long(output_buffer, i, metadata->sample_rate);  // sample_rate
-  ei_encode_atom(output_buffer, i, metadata->sample_format_name); // sample_fmt
-  ei_encode_atom(output_buffer, i, metadata->channel_layout_name); // channel_layout
-  ei_encode_binary(output_buffer, i, metadata->extradata, metadata->extradata_size); // extradata
-}
-
-
+  if (metadata->type != AVMEDIA_TYPE_VIDEO) {
+    return;
+  }
 
-static void encode_video_header(char *output_buffer, int *i, metadata_t *metadata)
-{
-  ei_encode_tuple_header(output_buffer, i, 12);
-  ei_encode_atom(output_buffer, i, "video_frame");
-  ei_encode_atom(output_buffer, i, metadata->codec_name); // format
-  ei_encode_tuple_header(output_buffer, i, 2); // profile_level
-  ei_encode_long(output_buffer, i, metadata->profile);
-  ei_encode_long(output_buffer, i, metadata->level);
-  ei_encode_atom(output_buffer, i, metadata->keyframe ? "iframe" : "bp_frame");  // frame_type
   ei_encode_atom(output_buffer, i, metadata->interlaced ? "true" : "false"); // interlaced
   ei_encode_long(output_buffer, i, metadata->width); // width
   ei_encode_long(output_buffer, i, metadata->height); // height
@@ -487,7 +1112,6 @@ static void encode_video_header(char *output_buffer, int *i, metadata_t *metadat
   ei_encode_tuple_header(output_buffer, i, 2); // frame_rate
   ei_encode_long(output_buffer, i, metadata->time_base.den);
   ei_encode_long(output_buffer, i, metadata->time_base.num);
-  ei_encode_binary(output_buffer, i, metadata->extradata, metadata->extradata_size); // extradata
 }
 
 static void encode_timestamp(char *output_buffer, int *i, int64_t timestamp)
@@ -495,6 +1119,35 @@ static void encode_timestamp(char *output_buffer, int *i, int64_t timestamp)
   ei_encode_long(output_buffer, i, timestamp);
 }
 
+// Replies for graphs other than 0 are wrapped as {graph, GraphId, Reply} so
+// the Erlang side can route them; graph 0 keeps the original unwrapped form
+static void encode_graph_header(char *output_buffer, int *i, long graph_id)
+{
+  if (graph_id != 0) {
+    ei_encode_tuple_header(output_buffer, i, 3);
+    ei_encode_atom(output_buffer, i, "graph");
+    ei_encode_long(output_buffer, i, graph_id);
+  }
+}
+
+// {latency, Count, TotalNs, P50Ns, P99Ns, P999Ns, MaxNs}
+static void encode_latency(char *output_buffer, int *i, int valid, latency_summary *summary)
+{
+  if (!valid) {
+    ei_encode_atom(output_buffer, i, "undefined");
+    return;
+  }
+
+  ei_encode_tuple_header(output_buffer, i, 7);
+  ei_encode_atom(output_buffer, i, "latency");
+  ei_encode_ulonglong(output_buffer, i, summary->count);
+  ei_encode_ulonglong(output_buffer, i, summary->total);
+  ei_encode_ulonglong(output_buffer, i, summary->p50);
+  ei_encode_ulonglong(output_buffer, i, summary->p99);
+  ei_encode_ulonglong(output_buffer, i, summary->p999);
+  ei_encode_ulonglong(output_buffer, i, summary->max);
+}
+
 static void resize_buffer(int bytes_required, char **output_buffer, int *buffer_size)
 {
   if (bytes_required > *buffer_size) {
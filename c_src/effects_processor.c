@@ -4,11 +4,22 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
+// Runs a libavfilter graph description over the frames.  The buffer source
+// (video) or abuffer source (audio) is created from the first frame, which
+// is also when the graph is configured.  Flushing sends EOF through the
+// graph so buffering filters (yadif, fps, select...) give up what they hold.
+
 typedef struct _codec_t {
   AVClass *av_class;
   int initialised;
   
   char *filter_graph_desc;
+  int threads;
+  int thread_type;
+
+  // Audio frames carry their frame_info in opaque, which libavfilter
+  // doesn't preserve
+  frame_info *frame_info;
   
   AVFilterContext *buffersink_ctx;
   AVFilterContext *buffersrc_ctx;
@@ -20,17 +31,11 @@ typedef struct _codec_t {
 
 static void do_init(codec_t *this, AVFrame *frame, AVRational timebase);
 
-static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+static void send_filtered_frames(ID3ASFilterContext *context)
 {
   codec_t *this = context->priv_data;
   int ret;
 
-  do_init(this, frame, timebase);
-
-  if (av_buffersrc_write_frame(this->buffersrc_ctx, frame) < 0) {
-    ERROR("Error while feeding the filtergraph\n");
-    exit(-1);
-  }
   while (1) {
     ret = av_buffersink_get_frame(this->buffersink_ctx, this->output_frame);
 
@@ -40,14 +45,75 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
       ERROR("Error from get_frame");
       exit(-1);
     }
+
+    if (this->frame_info && !this->output_frame->opaque) {
+      this->output_frame->opaque = this->frame_info;
+    }
+
+    // The filters will have changed the picture the stats describe
+    drop_luma_stats(this->output_frame);
+
     send_to_graph(context, this->output_frame, this->output_timebase);
 
     av_frame_unref(this->output_frame);
   }
 }
 
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+
+  do_init(this, frame, timebase);
+
+  if (frame->opaque && !frame->width)
+    {
+      frame_info *info = frame->opaque;
+
+      this->frame_info = realloc(this->frame_info, sizeof(frame_info) + info->buffer_size);
+      memcpy(this->frame_info, info, sizeof(frame_info) + info->buffer_size);
+    }
+
+  // The graph takes its own reference; the frame stays ours
+  if (av_buffersrc_add_frame_flags(this->buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
+    ERROR("Error while feeding the filtergraph\n");
+    exit(-1);
+  }
+
+  send_filtered_frames(context);
+}
+
+// Signals EOF, pushes out everything the graph was holding and throws the
+// graph away - a new one is built from the next frame
+static void drain(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  if (!this->initialised) {
+    return;
+  }
+
+  if (av_buffersrc_add_frame_flags(this->buffersrc_ctx, NULL, 0) == 0) {
+    send_filtered_frames(context);
+  }
+
+  avfilter_graph_free(&this->filter_graph);
+  av_frame_free(&this->output_frame);
+  this->initialised = 0;
+}
+
+static void reconfigure(ID3ASFilterContext *context, reconfiguration *change)
+{
+  codec_t *this = context->priv_data;
+
+  av_opt_set_dict(this, &change->options);
+
+  drain(context);
+}
+
 static void flush(ID3ASFilterContext *context) 
 {
+  drain(context);
+
   flush_graph(context);
 }
 
@@ -67,26 +133,36 @@ static void do_init(codec_t *this, AVFrame *frame, AVRational timebase)
   char args[512];
   AVFilterInOut *outputs = avfilter_inout_alloc();
   AVFilterInOut *inputs  = avfilter_inout_alloc();
+  int audio = frame->width == 0;
   int ret;
 
   this->filter_graph = avfilter_graph_alloc();
+  this->filter_graph->nb_threads = this->threads;
+  this->filter_graph->thread_type = this->thread_type;
   this->output_frame = av_frame_alloc();
 
-  ret = avfilter_graph_create_filter(&this->buffersink_ctx, avfilter_get_by_name("buffersink"), "out", NULL, NULL, this->filter_graph);
+  ret = avfilter_graph_create_filter(&this->buffersink_ctx, avfilter_get_by_name(audio ? "abuffersink" : "buffersink"), "out", NULL, NULL, this->filter_graph);
 
   if (ret < 0) {
     ERROR("Cannot create buffer sink\n");
     exit(-1);
   }
 
-  snprintf(args, sizeof(args),
-	   "%d:%d:%d:%d:%d:%d:%d",
-	   //"video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-	   frame->width, frame->height, frame->format,
-	   timebase.num, timebase.den,
-	   frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den);
+  if (audio) {
+    snprintf(args, sizeof(args),
+	     "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%" PRIx64,
+	     timebase.num, timebase.den, frame->sample_rate,
+	     av_get_sample_fmt_name(frame->format), frame->channel_layout);
+  }
+  else {
+    snprintf(args, sizeof(args),
+	     "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+	     frame->width, frame->height, frame->format,
+	     timebase.num, timebase.den,
+	     frame->sample_aspect_ratio.num, FFMAX(frame->sample_aspect_ratio.den, 1));
+  }
 
-  ret = avfilter_graph_create_filter(&this->buffersrc_ctx, avfilter_get_by_name("buffer"), "in", args, NULL, this->filter_graph);
+  ret = avfilter_graph_create_filter(&this->buffersrc_ctx, avfilter_get_by_name(audio ? "abuffer" : "buffer"), "in", args, NULL, this->filter_graph);
 
   if (ret < 0) {
     ERROR("Cannot create buffer source\n");
@@ -122,8 +198,21 @@ static void do_init(codec_t *this, AVFrame *frame, AVRational timebase)
   this->initialised = 1;
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  avfilter_graph_free(&this->filter_graph);
+  av_frame_free(&this->output_frame);
+  free(this->frame_info);
+}
+
 static const AVOption options[] = {
   { "graph", "The filter graph description", offsetof(codec_t, filter_graph_desc), AV_OPT_TYPE_STRING },
+  { "threads", "Threads for the filter graph, 0 for automatic", offsetof(codec_t, threads), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX },
+  { "thread_type", "Threading the filter graph may use", offsetof(codec_t, thread_type), AV_OPT_TYPE_INT, { .i64 = AVFILTER_THREAD_SLICE }, 0, INT_MAX, 0, "thread_type" },
+  { "none", "no threading", 0, AV_OPT_TYPE_CONST, { .i64 = 0 }, 0, 0, 0, "thread_type" },
+  { "slice", "slice threading", 0, AV_OPT_TYPE_CONST, { .i64 = AVFILTER_THREAD_SLICE }, 0, 0, 0, "thread_type" },
   { NULL }
 };
 
@@ -134,11 +223,17 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "graph", NULL };
+
 ID3ASFilter id3as_effects_processor_filter = {
   .name = "effects processor",
   .init = init,
   .execute = process,
   .flush = flush,
+  .reconfigure = reconfigure,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_UNKNOWN,
+  .required_options = required_options
 };
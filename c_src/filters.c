@@ -7,16 +7,17 @@
 
 #define REGISTER_INPUT(name) {				\
     extern ID3ASFilter id3as_##name##_input;		\
-    register_filter(&id3as_##name##_input); }
+    register_filter(&id3as_##name##_input, 1); }
 
 #define REGISTER_FILTER(name) {				\
     extern ID3ASFilter id3as_##name##_filter;		\
-    register_filter(&id3as_##name##_filter); }
+    register_filter(&id3as_##name##_filter, 0); }
 
+#define FILTER_TABLE_SIZE 64 // power of two
 
-static ID3ASFilter *first_filter = NULL;
+static ID3ASFilter *filter_table[FILTER_TABLE_SIZE];
 
-static void register_filter(ID3ASFilter *filter);
+static void register_filter(ID3ASFilter *filter, int is_input);
 
 void id3as_filters_register_all() 
 {
@@ -28,22 +29,45 @@ void id3as_filters_register_all()
 
   REGISTER_FILTER(resample_audio);
   REGISTER_FILTER(rescale_video);
+  REGISTER_FILTER(ladder_scale_video);
+  REGISTER_FILTER(deinterlace_video);
   REGISTER_FILTER(black_detect);
+  REGISTER_FILTER(scene_detect);
+  REGISTER_FILTER(freeze_detect);
   REGISTER_FILTER(silence_detect);
+  REGISTER_FILTER(audio_qc);
   REGISTER_FILTER(output_raw_audio);
   REGISTER_FILTER(output_encoded_audio);
   REGISTER_FILTER(output_raw_video);
   REGISTER_FILTER(output_encoded_video);
+  REGISTER_FILTER(output_passthrough_video);
+  REGISTER_FILTER(output_thumbnail_video);
   REGISTER_FILTER(stereo_splitter);
+  REGISTER_FILTER(channel_splitter);
+  REGISTER_FILTER(channel_mixer);
   REGISTER_FILTER(effects_processor);
   REGISTER_FILTER(parallel);
   REGISTER_FILTER(async_parallel);
 }
 
+// FNV-1a
+static unsigned int hash_name(const char *name)
+{
+  unsigned int hash = 2166136261u;
+
+  while (*name)
+    {
+      hash ^= (unsigned char) *name++;
+      hash *= 16777619u;
+    }
+
+  return hash & (FILTER_TABLE_SIZE - 1);
+}
+
 ID3ASFilter *find_filter(char *name) 
 {
-  ID3ASFilter *p = NULL;
-  p = first_filter;
+  ID3ASFilter *p = filter_table[hash_name(name)];
+
   while (p) 
     {
       if (strcmp(p->name, name) == 0) {
@@ -52,40 +76,93 @@ ID3ASFilter *find_filter(char *name)
       p = p->next;
     }
 
-  ERRORFMT("Failed to find filter %s\n", name);
-  exit(-1);
+  return NULL;
 }
 
+// The context, its private data and its downstream list are placed one
+// after the other in the graph's arena; init_instance is run separately,
+// once everything downstream has been initialised
 ID3ASFilterContext *allocate_instance(ID3ASFilter *filter, 
-				      AVDictionary *options, 
-				      AVDictionary *codec_options,
-				      ID3ASFilterContext **downstream_filters, 
+				      long graph_id,
+				      int sync_mode,
+				      arena *arena,
 				      int num_downstream_filters) 
 {
-  ID3ASFilterContext *instance = av_mallocz(sizeof(ID3ASFilterContext));
+  ID3ASFilterContext *instance = arena_mallocz(arena, sizeof(ID3ASFilterContext));
 
   instance->filter = filter;
-  instance->priv_data = av_mallocz(filter->priv_data_size);
-  instance->downstream_filters = downstream_filters;
+  instance->graph_id = graph_id;
+  instance->sync_mode = sync_mode;
+  instance->arena = arena;
+  instance->priv_data = arena_mallocz(arena, filter->priv_data_size);
+  instance->execute = filter->execute;
+  instance->downstream_filters = arena_mallocz(arena, sizeof(ID3ASFilterContext*) * num_downstream_filters);
   instance->num_downstream_filters = num_downstream_filters;
+  instance->execute_latency = allocate_latency_histogram();
 
   *(AVClass**)instance->priv_data = (AVClass *) filter->priv_class;
 
   av_opt_set_defaults(instance->priv_data);
-  
+
+  return instance;
+}
+
+void init_instance(ID3ASFilterContext *instance, AVDictionary *options, AVDictionary *codec_options)
+{
   av_opt_set_dict(instance->priv_data, &options);
 
-  filter->init(instance, codec_options);
+  instance->filter->init(instance, codec_options);
+}
 
-  return instance;
+// The new lists are built in the arena by reconfigure_graph, as the arena
+// can't be touched from the thread applying the change.  The command thread
+// may be walking the graph meanwhile (see get_downstream_filters), so a
+// list is never edited in place: the new array is published first and the
+// count second.
+void add_downstream_filter(ID3ASFilterContext *context, reconfiguration *change)
+{
+  __atomic_store_n(&context->downstream_filters, change->downstream_filters, __ATOMIC_RELEASE);
+  __atomic_store_n(&context->num_downstream_filters, context->num_downstream_filters + 1, __ATOMIC_RELEASE);
+}
+
+ID3ASFilterContext *remove_downstream_filter(ID3ASFilterContext *context, reconfiguration *change)
+{
+  ID3ASFilterContext *downstream_filter = context->downstream_filters[change->branch_index];
+
+  __atomic_store_n(&context->downstream_filters, change->downstream_filters, __ATOMIC_RELEASE);
+  __atomic_store_n(&context->num_downstream_filters, context->num_downstream_filters - 1, __ATOMIC_RELEASE);
+
+  return downstream_filter;
 }
 
-static void register_filter(ID3ASFilter *filter) 
+// For walks on the command thread.  A count is only ever seen with its own
+// array or a newer one, and a shortened array keeps a slot for the removed
+// branch, so every index below the count is valid.
+int get_downstream_filters(ID3ASFilterContext *context, ID3ASFilterContext ***filters)
 {
-  ID3ASFilter **p;
+  int count = __atomic_load_n(&context->num_downstream_filters, __ATOMIC_ACQUIRE);
+
+  *filters = __atomic_load_n(&context->downstream_filters, __ATOMIC_ACQUIRE);
 
-  p = &first_filter;
-  while (*p != NULL) p = &(*p)->next;
-  *p = filter;
-  filter->next = NULL;
+  return count;
+}
+
+static void register_filter(ID3ASFilter *filter, int is_input) 
+{
+  unsigned int bucket = hash_name(filter->name);
+
+  if (find_filter(filter->name)) {
+    ERRORFMT("Filter %s registered twice\n", filter->name);
+    exit(-1);
+  }
+
+  if (is_input ? (!filter->execute_input || filter->execute) : (!filter->execute || filter->execute_input)) {
+    ERRORFMT("%s %s must set %s and not %s\n", is_input ? "Input" : "Filter", filter->name,
+	     is_input ? "execute_input" : "execute", is_input ? "execute" : "execute_input");
+    exit(-1);
+  }
+
+  filter->is_input = is_input;
+  filter->next = filter_table[bucket];
+  filter_table[bucket] = filter;
 }
@@ -37,6 +37,27 @@ void init_frame_info_queue(frame_info_queue **queue)
   (*queue)->inbound_list_tail = NULL;
 }
 
+void free_frame_info_queue(frame_info_queue **queue)
+{
+  if (!*queue) {
+    return;
+  }
+
+  frame_info_queue_item *item = (*queue)->inbound_list_head;
+
+  while (item)
+    {
+      frame_info_queue_item *next = item->next;
+
+      free(item->frame_info);
+      free(item);
+      item = next;
+    }
+
+  free(*queue);
+  *queue = NULL;
+}
+
 void queue_frame_info_from_frame(frame_info_queue *queue, AVFrame *frame) 
 {
   AVFrameSideData *side_data = av_frame_get_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE);
@@ -70,6 +91,16 @@ void add_frame_info_to_frame(frame_info_queue *queue, AVFrame *frame)
   free(frame_inf);
 }
 
+void add_frame_info_side_data(AVFrame *frame, unsigned char *frame_info_data, unsigned int frame_info_size)
+{
+  AVFrameSideData *side_data = av_frame_new_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE, sizeof(frame_info) + frame_info_size);
+  frame_info *info = (frame_info *)side_data->data;
+
+  info->flags = 0;
+  info->buffer_size = frame_info_size;
+  memcpy(info->buffer, frame_info_data, frame_info_size);
+}
+
 static frame_info *remove_from_queue(frame_info_queue *queue, frame_info_queue_item *item, frame_info_queue_item *prev)
 {
   frame_info *frame_info;
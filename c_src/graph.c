@@ -0,0 +1,654 @@
+#include <stdarg.h>
+
+#include "id3as_libav.h"
+
+// A graph is built in three passes: the initialisation term is read into a
+// tree of descriptions, the whole tree is validated, and only then are the
+// filters allocated and initialised.  Mistakes in the description therefore
+// come back as a graph_error rather than a crash on the first frame.
+//
+// reconfigure_graph uses the same machinery to check a change to a running
+// graph, then parks it on the target filter for apply_reconfiguration.
+//
+// Each graph has an arena (see arena.c) holding its contexts, private data
+// and downstream lists, laid out depth first as send_to_graph visits them.
+// The descriptions only live while a graph or branch is built, so theirs
+// come from a scratch arena dropped straight afterwards.
+
+typedef struct _filter_description filter_description;
+
+struct _filter_description
+{
+  char *name;
+  ID3ASFilter *filter;
+  AVDictionary *params;
+  AVDictionary *codec_params;
+  int num_downstream_filters;
+  filter_description *downstream_filters;
+};
+
+static void read_filter(char *buf, int *index, filter_description *description, arena *scratch);
+static AVDictionary *read_params(char *buf, int *index);
+static int validate_filter(filter_description *description, enum AVMediaType upstream_type, graph_error *error);
+static ID3ASFilterContext *allocate_filter(filter_description *description, long graph_id, int sync_mode, arena *arena);
+static void init_filter(ID3ASFilterContext *context, filter_description *description);
+static void free_description(filter_description *description);
+static int validate_options(ID3ASFilter *filter, AVDictionary *params, filter_description *description, graph_error *error);
+static int validate_codec_options(const char *filter_name, AVDictionary *codec_options, graph_error *error);
+static int fail(graph_error *error, const char *filter_name, const char *format, ...);
+
+ID3ASFilterContext *build_graph(char *buf, long graph_id, int sync_mode, graph_error *error)
+{
+  int index = 0;
+  int version;
+  filter_description root;
+  ID3ASFilterContext *graph = NULL;
+  arena *scratch = allocate_arena();
+
+  ei_decode_version(buf, &index, &version);
+
+  read_filter(buf, &index, &root, scratch);
+
+  error->depth = 0;
+
+  if (validate_filter(&root, AVMEDIA_TYPE_UNKNOWN, error) == 0) {
+    graph = allocate_filter(&root, graph_id, sync_mode, allocate_arena());
+    init_filter(graph, &root);
+  }
+
+  free_description(&root);
+  free_arena(&scratch);
+
+  return graph;
+}
+
+static void read_filter(char *buf, int *index, filter_description *description, arena *scratch)
+{
+  int arity;
+
+  I_DECODE_TUPLE_HEADER(buf, index, &arity);
+
+  I_DECODE_STRING(buf, index, &description->name);
+
+  description->params = read_params(buf, index);
+
+  description->codec_params = read_params(buf, index);
+
+  I_DECODE_LIST_HEADER(buf, index, &description->num_downstream_filters);
+
+  description->downstream_filters = arena_mallocz(scratch, sizeof(filter_description) * description->num_downstream_filters);
+
+  for (int i = 0; i < description->num_downstream_filters; i++)
+    {
+      read_filter(buf, index, &description->downstream_filters[i], scratch);
+    }
+
+  if (description->num_downstream_filters > 0) {
+    I_SKIP_NULL(buf, index);
+  }
+
+  description->filter = find_filter(description->name);
+}
+
+static AVDictionary *read_params(char *buf, int *index)
+{
+  int num_params;
+  AVDictionary *dict = NULL;
+
+  I_DECODE_LIST_HEADER(buf, index, &num_params);
+
+  for (int i = 0; i < num_params; i++)
+    {
+      char *name;
+      char *value;
+      int arity;
+
+      I_DECODE_TUPLE_HEADER(buf, index, &arity);
+
+      I_DECODE_STRING(buf, index, &name);
+      I_DECODE_STRING(buf, index, &value);
+
+      av_dict_set(&dict, name, value, AV_DICT_DONT_STRDUP_KEY | AV_DICT_DONT_STRDUP_VAL);
+    }
+
+  I_SKIP_NULL(buf, index);
+
+  return dict;
+}
+
+static int fail(graph_error *error, const char *filter_name, const char *format, ...)
+{
+  va_list args;
+
+  snprintf(error->filter_name, sizeof(error->filter_name), "%s", filter_name);
+
+  va_start(args, format);
+  vsnprintf(error->message, sizeof(error->message), format, args);
+  va_end(args);
+
+  return -1;
+}
+
+// For a filter's validate callback; build_graph fills in the filter name
+int validation_error(graph_error *error, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(error->message, sizeof(error->message), format, args);
+  va_end(args);
+
+  return -1;
+}
+
+static const char *media_type_name(enum AVMediaType media_type)
+{
+  switch (media_type) {
+  case AVMEDIA_TYPE_VIDEO:
+    return "video";
+  case AVMEDIA_TYPE_AUDIO:
+    return "audio";
+  default:
+    return "any";
+  }
+}
+
+// The codec named by a filter's "codec" option (or its default) must exist,
+// and take every codec option, as allocate_*_context gives up on any left
+// unused
+static int validate_codec(ID3ASFilter *filter, void *options, AVDictionary *codec_options, graph_error *error)
+{
+  const AVClass *class = avcodec_get_class();
+  AVDictionaryEntry *entry = NULL;
+  uint8_t *codec_name = NULL;
+  AVCodec *codec = NULL;
+  int ret = 0;
+
+  if (filter->codec_option == CODEC_OPTION_NONE) {
+    return 0;
+  }
+
+  if (av_opt_get(options, "codec", 0, &codec_name) < 0 || !codec_name) {
+    return fail(error, filter->name, "missing required option 'codec'");
+  }
+
+  if (filter->codec_option == CODEC_OPTION_ENCODER) {
+    codec = avcodec_find_encoder_by_name((char *) codec_name);
+  }
+  else {
+    codec = avcodec_find_decoder_by_name((char *) codec_name);
+  }
+
+  if (!codec) {
+    ret = fail(error, filter->name, "unknown %s '%s'",
+	       filter->codec_option == CODEC_OPTION_ENCODER ? "encoder" : "decoder", codec_name);
+  }
+
+  while (ret == 0 && (entry = av_dict_get(codec_options, "", entry, AV_DICT_IGNORE_SUFFIX)))
+    {
+      if (!av_opt_find(&class, entry->key, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ) &&
+	  !(codec->priv_class && av_opt_find((void *) &codec->priv_class, entry->key, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ))) {
+	ret = fail(error, filter->name, "codec option '%s' isn't used by %s", entry->key, codec_name);
+      }
+    }
+
+  av_free(codec_name);
+
+  return ret;
+}
+
+// Sets every option on a throwaway instance of the filter's private data,
+// so unknown names and unparseable values are found without running init.
+// When building (description isn't NULL) the instance then goes to the
+// codec check and the filter's own validate, which see the options just
+// as init would.
+static int validate_options(ID3ASFilter *filter, AVDictionary *params, filter_description *description, graph_error *error)
+{
+  AVDictionaryEntry *entry = NULL;
+  int ret = 0;
+
+  if (!filter->priv_class) {
+    return 0;
+  }
+
+  void *scratch = av_mallocz(filter->priv_data_size);
+  *(const AVClass **) scratch = filter->priv_class;
+  av_opt_set_defaults(scratch);
+
+  while ((entry = av_dict_get(params, "", entry, AV_DICT_IGNORE_SUFFIX)))
+    {
+      int rc = av_opt_set(scratch, entry->key, entry->value, 0);
+
+      if (rc == AVERROR_OPTION_NOT_FOUND) {
+	ret = fail(error, filter->name, "unknown option '%s'", entry->key);
+	break;
+      }
+      else if (rc < 0) {
+	ret = fail(error, filter->name, "invalid value '%s' for option '%s'", entry->value, entry->key);
+	break;
+      }
+    }
+
+  if (ret == 0 && description) {
+    ret = validate_codec(filter, scratch, description->codec_params, error);
+  }
+
+  if (ret == 0 && description && filter->validate &&
+      filter->validate(scratch, description->num_downstream_filters, error) != 0) {
+    snprintf(error->filter_name, sizeof(error->filter_name), "%s", filter->name);
+    ret = -1;
+  }
+
+  av_opt_free(scratch);
+  av_free(scratch);
+
+  return ret;
+}
+
+static int validate_filter(filter_description *description, enum AVMediaType upstream_type, graph_error *error)
+{
+  ID3ASFilter *filter = description->filter;
+  int is_root = error->depth == 0;
+
+  if (!filter) {
+    return fail(error, description->name, "unknown filter");
+  }
+
+  if (is_root && !filter->is_input) {
+    return fail(error, description->name, "graph must start with an input");
+  }
+
+  if (!is_root && filter->is_input) {
+    return fail(error, description->name, "inputs can only be used at the start of a graph");
+  }
+
+  if (filter->media_type != AVMEDIA_TYPE_UNKNOWN &&
+      upstream_type != AVMEDIA_TYPE_UNKNOWN &&
+      filter->media_type != upstream_type) {
+    return fail(error, description->name, "expects %s but is sent %s",
+		media_type_name(filter->media_type), media_type_name(upstream_type));
+  }
+
+  if (filter->sink && description->num_downstream_filters > 0) {
+    return fail(error, description->name, "cannot have downstream filters");
+  }
+
+  if (description->num_downstream_filters < filter->min_downstream_filters) {
+    return fail(error, description->name, "needs at least %d downstream filters", filter->min_downstream_filters);
+  }
+
+  for (const char **required = filter->required_options; required && *required; required++)
+    {
+      if (!av_dict_get(description->params, *required, NULL, 0)) {
+	return fail(error, description->name, "missing required option '%s'", *required);
+      }
+    }
+
+  if (validate_options(filter, description->params, description, error) != 0) {
+    return -1;
+  }
+
+  if (validate_codec_options(description->name, description->codec_params, error) != 0) {
+    return -1;
+  }
+
+  if (description->num_downstream_filters > 0 && error->depth == MAX_GRAPH_DEPTH) {
+    return fail(error, description->name, "graph is more than %d filters deep", MAX_GRAPH_DEPTH);
+  }
+
+  enum AVMediaType output_type = filter->media_type != AVMEDIA_TYPE_UNKNOWN ? filter->media_type : upstream_type;
+
+  for (int i = 0; i < description->num_downstream_filters; i++)
+    {
+      error->path[error->depth++] = i;
+
+      if (validate_filter(&description->downstream_filters[i], output_type, error) != 0) {
+	return -1;
+      }
+
+      error->depth--;
+    }
+
+  return 0;
+}
+
+// Every context is placed before anything downstream of it
+static ID3ASFilterContext *allocate_filter(filter_description *description, long graph_id, int sync_mode, arena *arena)
+{
+  ID3ASFilterContext *instance = allocate_instance(description->filter,
+						   graph_id,
+						   sync_mode,
+						   arena,
+						   description->num_downstream_filters);
+
+  for (int i = 0; i < description->num_downstream_filters; i++)
+    {
+      instance->downstream_filters[i] = allocate_filter(&description->downstream_filters[i], graph_id, sync_mode, arena);
+    }
+
+  return instance;
+}
+
+// ...but initialised after them, as a filter's init may already use its
+// downstream filters (the parallel filters start a thread on each)
+static void init_filter(ID3ASFilterContext *context, filter_description *description)
+{
+  for (int i = 0; i < description->num_downstream_filters; i++)
+    {
+      init_filter(context->downstream_filters[i], &description->downstream_filters[i]);
+    }
+
+  init_instance(context, description->params, description->codec_params);
+
+  // init_instance took both dictionaries
+  description->params = NULL;
+  description->codec_params = NULL;
+}
+
+static void free_description(filter_description *description)
+{
+  for (int i = 0; i < description->num_downstream_filters; i++)
+    {
+      free_description(&description->downstream_filters[i]);
+    }
+
+  free(description->name);
+  av_dict_free(&description->params);
+  av_dict_free(&description->codec_params);
+}
+
+// Erlang sends a list of small integers as a string
+static int decode_path(char *buf, int *index, graph_error *error)
+{
+  int type;
+  int size;
+
+  ei_get_type(buf, index, &type, &size);
+
+  if (size > MAX_GRAPH_DEPTH) {
+    return -1;
+  }
+
+  if (type == ERL_STRING_EXT) {
+    char path[MAX_GRAPH_DEPTH + 1];
+
+    ei_decode_string(buf, index, path);
+
+    for (int i = 0; i < size; i++)
+      {
+	error->path[i] = (unsigned char) path[i];
+      }
+  }
+  else {
+    int arity;
+
+    I_DECODE_LIST_HEADER(buf, index, &arity);
+
+    for (int i = 0; i < arity; i++)
+      {
+	long value;
+	ei_decode_long(buf, index, &value);
+	error->path[i] = value;
+      }
+
+    if (arity > 0) {
+      I_SKIP_NULL(buf, index);
+    }
+  }
+
+  error->depth = size;
+
+  return 0;
+}
+
+// Follows the first depth entries of error->path from the input, noting the
+// media type that flows out of the filter it ends up at
+static ID3ASFilterContext *find_context(ID3ASFilterContext *graph, int depth, enum AVMediaType *media_type, graph_error *error)
+{
+  ID3ASFilterContext *context = graph;
+
+  *media_type = graph->filter->media_type;
+
+  for (int i = 0; i < depth; i++)
+    {
+      ID3ASFilterContext **downstream_filters;
+      int num_downstream_filters = get_downstream_filters(context, &downstream_filters);
+
+      if (error->path[i] < 0 || error->path[i] >= num_downstream_filters) {
+	error->depth = i;
+	fail(error, context->filter->name, "has no downstream filter %d", error->path[i]);
+	return NULL;
+      }
+
+      context = downstream_filters[error->path[i]];
+
+      if (context->filter->media_type != AVMEDIA_TYPE_UNKNOWN) {
+	*media_type = context->filter->media_type;
+      }
+    }
+
+  error->depth = depth;
+
+  return context;
+}
+
+static int validate_codec_options(const char *filter_name, AVDictionary *codec_options, graph_error *error)
+{
+  const AVClass *class = avcodec_get_class();
+  AVDictionaryEntry *entry = NULL;
+
+  while ((entry = av_dict_get(codec_options, "", entry, AV_DICT_IGNORE_SUFFIX)))
+    {
+      if (!av_opt_find(&class, entry->key, NULL, 0, AV_OPT_SEARCH_CHILDREN | AV_OPT_SEARCH_FAKE_OBJ)) {
+	return fail(error, filter_name, "unknown codec option '%s'", entry->key);
+      }
+    }
+
+  return 0;
+}
+
+static int read_set_options(char *buf, int *index, ID3ASFilterContext *target, reconfiguration *change, graph_error *error)
+{
+  change->type = RECONFIGURE_OPTIONS;
+  change->options = read_params(buf, index);
+  change->codec_options = read_params(buf, index);
+
+  if (!target->filter->reconfigure) {
+    return fail(error, target->filter->name, "cannot be reconfigured");
+  }
+
+  if (validate_options(target->filter, change->options, NULL, error) != 0) {
+    return -1;
+  }
+
+  return validate_codec_options(target->filter->name, change->codec_options, error);
+}
+
+static int read_add_branch(char *buf, int *index, ID3ASFilterContext *target, enum AVMediaType media_type, reconfiguration *change, graph_error *error)
+{
+  filter_description description;
+  arena *scratch;
+  int ret = 0;
+
+  change->type = RECONFIGURE_ADD_BRANCH;
+
+  if (!target->filter->dynamic_branches) {
+    return fail(error, target->filter->name, "cannot have branches added");
+  }
+
+  if (error->depth == MAX_GRAPH_DEPTH) {
+    return fail(error, target->filter->name, "graph is more than %d filters deep", MAX_GRAPH_DEPTH);
+  }
+
+  scratch = allocate_arena();
+
+  read_filter(buf, index, &description, scratch);
+
+  error->path[error->depth++] = target->num_downstream_filters;
+
+  // The graph's arena is only ever used from this thread, and the target's
+  // downstream list can't change until this change has been applied
+  if (validate_filter(&description, media_type, error) == 0) {
+    change->branch = allocate_filter(&description, target->graph_id, target->sync_mode, target->arena);
+    init_filter(change->branch, &description);
+
+    change->downstream_filters = arena_mallocz(target->arena, sizeof(ID3ASFilterContext*) * (target->num_downstream_filters + 1));
+    memcpy(change->downstream_filters, target->downstream_filters, sizeof(ID3ASFilterContext*) * target->num_downstream_filters);
+    change->downstream_filters[target->num_downstream_filters] = change->branch;
+  }
+  else {
+    ret = -1;
+  }
+
+  free_description(&description);
+  free_arena(&scratch);
+
+  return ret;
+}
+
+static int read_remove_branch(ID3ASFilterContext *target, int branch_index, reconfiguration *change, graph_error *error)
+{
+  change->type = RECONFIGURE_REMOVE_BRANCH;
+  change->branch_index = branch_index;
+
+  if (!target->filter->dynamic_branches) {
+    return fail(error, target->filter->name, "cannot have branches removed");
+  }
+
+  if (branch_index < 0 || branch_index >= target->num_downstream_filters) {
+    return fail(error, target->filter->name, "has no downstream filter %d", branch_index);
+  }
+
+  if (target->num_downstream_filters - 1 < target->filter->min_downstream_filters) {
+    return fail(error, target->filter->name, "needs at least %d downstream filters", target->filter->min_downstream_filters);
+  }
+
+  // The removed branch goes at the end, in case the new list is read with
+  // the old count
+  int n = target->num_downstream_filters;
+
+  change->downstream_filters = arena_mallocz(target->arena, sizeof(ID3ASFilterContext*) * n);
+  memcpy(change->downstream_filters, target->downstream_filters, sizeof(ID3ASFilterContext*) * branch_index);
+  memcpy(&change->downstream_filters[branch_index], &target->downstream_filters[branch_index + 1],
+	 sizeof(ID3ASFilterContext*) * (n - branch_index - 1));
+  change->downstream_filters[n - 1] = target->downstream_filters[branch_index];
+
+  error->path[error->depth++] = branch_index;
+
+  return 0;
+}
+
+// Accepts {set_options, Path, Options, CodecOptions}, {add_branch, Path,
+// Filter} or {remove_branch, Path}.  Path leads from the input to the
+// filter being changed; for remove_branch it leads to the branch itself.
+int reconfigure_graph(ID3ASFilterContext *graph, char *buf, graph_error *error)
+{
+  int index = 0;
+  int version;
+  int arity;
+  int ret;
+  char type[MAXATOMLEN];
+  enum AVMediaType media_type;
+  ID3ASFilterContext *target;
+
+  ei_decode_version(buf, &index, &version);
+
+  I_DECODE_TUPLE_HEADER(buf, &index, &arity);
+
+  ei_decode_atom(buf, &index, type);
+
+  error->depth = 0;
+
+  if (decode_path(buf, &index, error) != 0) {
+    return fail(error, graph->filter->name, "path is more than %d filters deep", MAX_GRAPH_DEPTH);
+  }
+
+  int is_removal = strcmp(type, "remove_branch") == 0;
+
+  if (is_removal && error->depth == 0) {
+    return fail(error, graph->filter->name, "the input cannot be removed");
+  }
+
+  if (!(target = find_context(graph, error->depth - is_removal, &media_type, error))) {
+    return -1;
+  }
+
+  if (__atomic_load_n(&target->pending_reconfiguration, __ATOMIC_ACQUIRE)) {
+    return fail(error, target->filter->name, "previous reconfiguration not yet applied");
+  }
+
+  reconfiguration *change = calloc(1, sizeof(reconfiguration));
+
+  if (strcmp(type, "set_options") == 0) {
+    ret = read_set_options(buf, &index, target, change, error);
+  }
+  else if (strcmp(type, "add_branch") == 0) {
+    ret = read_add_branch(buf, &index, target, media_type, change, error);
+  }
+  else if (is_removal) {
+    ret = read_remove_branch(target, error->path[error->depth], change, error);
+  }
+  else {
+    ret = fail(error, target->filter->name, "unknown reconfiguration '%s'", type);
+  }
+
+  if (ret != 0) {
+    av_dict_free(&change->options);
+    av_dict_free(&change->codec_options);
+    free(change);
+    return ret;
+  }
+
+  __atomic_store_n(&target->pending_reconfiguration, change, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+void apply_reconfiguration(ID3ASFilterContext *context)
+{
+  reconfiguration *change = __atomic_exchange_n(&context->pending_reconfiguration, NULL, __ATOMIC_ACQUIRE);
+
+  if (!change) {
+    return;
+  }
+
+  context->filter->reconfigure(context, change);
+
+  av_dict_free(&change->options);
+  av_dict_free(&change->codec_options);
+  free(change);
+}
+
+// Tears down everything the filters hold outside the arena, for a graph
+// (or a removed branch) that won't be sent anything again.  Each filter is
+// closed before its downstream filters, so any threads it sends them
+// frames on have stopped by the time they go.
+void close_graph(ID3ASFilterContext *context)
+{
+  reconfiguration *change = __atomic_exchange_n(&context->pending_reconfiguration, NULL, __ATOMIC_ACQUIRE);
+
+  if (context->filter->close) {
+    context->filter->close(context);
+  }
+
+  for (int i = 0; i < context->num_downstream_filters; i++)
+    {
+      close_graph(context->downstream_filters[i]);
+    }
+
+  // A branch that was built but never added
+  if (change)
+    {
+      if (change->type == RECONFIGURE_ADD_BRANCH && change->branch) {
+	close_graph(change->branch);
+      }
+
+      av_dict_free(&change->options);
+      av_dict_free(&change->codec_options);
+      free(change);
+    }
+
+  av_opt_free(context->priv_data);
+  av_freep(&context->execute_latency);
+  av_freep(&context->queue_latency);
+}
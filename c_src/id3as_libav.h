@@ -10,6 +10,7 @@
 #include <libavutil/mathematics.h>
 #include <libavutil/mem.h>
 #include <libavutil/base64.h>
+#include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 #include <libavutil/opt.h>
 #include <libavutil/avutil.h>
@@ -19,15 +20,52 @@
 #define SUBSYSTEM "id3as_codecs"
 #define PACKET_SIZE 4
 #define FRAME_INFO_SIDE_DATA_TYPE 99 // Must not match anything in libavutil/frame.h:AVFrameSideDataType
+#define PACKETS_SIDE_DATA_TYPE 98    // packet_records for passthrough outputs
+#define LUMA_STATS_SIDE_DATA_TYPE 97 // luma_stats, see get_luma_stats
+#define SCENE_STATS_SIDE_DATA_TYPE 96 // scene_stats from scene detect
 
 #define NINETY_KHZ (AVRational){1, 90000}
 
+#define MAX_AUDIO_CHANNELS 64
+
+// Kernels are built for several instruction sets and the best one is chosen
+// at load time, unless the whole build already targets a specific CPU
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 6) && !defined(ID3AS_NO_KERNEL_CLONES)
+#define ID3AS_KERNEL __attribute__((target_clones("avx2", "default")))
+#define ID3AS_FMA_KERNEL __attribute__((target_clones("arch=haswell", "default")))
+#else
+#define ID3AS_KERNEL
+#define ID3AS_FMA_KERNEL
+#endif
+
 #define FRAMES_TO_BYTES(frames, sample_format, num_channels) (frames) * (av_get_bytes_per_sample(sample_format)) * (num_channels)
 #define BYTES_TO_FRAMES(bytes, sample_format, num_channels) (bytes) / (av_get_bytes_per_sample(sample_format)) / (num_channels)
 
 typedef struct _ID3ASFilterContext ID3ASFilterContext;
 typedef struct _ID3ASFilter ID3ASFilter;
 typedef struct _sized_buffer sized_buffer;
+typedef struct _graph_error graph_error;
+typedef struct _reconfiguration reconfiguration;
+typedef struct _latency_histogram latency_histogram;
+typedef struct _latency_summary latency_summary;
+typedef struct _polyphase_resampler polyphase_resampler;
+typedef struct _slice_threads slice_threads;
+typedef struct _output_header output_header;
+typedef struct _arena arena;
+
+// One slice of a job split across slice_threads
+typedef void (*slice_fun)(void *arg, int slice, int nb_slices);
+
+// Converts n samples between two packed (or one plane of two planar) formats
+typedef void (*sample_converter)(const void *src, void *dst, int n);
+
+// Inputs are handed each process_frame command as it arrives; everything
+// else is sent decoded frames by its upstream filter
+typedef void (*input_execute_fun)(ID3ASFilterContext *context,
+				  unsigned char *metadata, unsigned int metadata_size,
+				  unsigned char *frame_info, unsigned int frame_info_size,
+				  unsigned char *data, unsigned int data_size);
+typedef void (*filter_execute_fun)(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase);
 
 struct _ID3ASFilterContext
 {
@@ -35,17 +73,52 @@ struct _ID3ASFilterContext
   ID3ASFilterContext** downstream_filters;
   int num_downstream_filters;
   void *priv_data;
+  filter_execute_fun execute;         // filter->execute, so send_to_filter needn't go through filter
+
+  latency_histogram *execute_latency; // time spent in execute, including downstream
+  latency_histogram *queue_latency;   // time spent queued, for async_parallel branches
+
+  long graph_id;                      // 0 for the graph set up by the legacy initialise command
+  int sync_mode;                      // the graph's initialise mode wasn't async
+  arena *arena;                       // shared by the whole graph; owns this context, priv_data and downstream_filters
+
+  reconfiguration *pending_reconfiguration;
+};
+
+// What a filter's "codec" option names, so build_graph can look it up
+enum CodecOption {
+  CODEC_OPTION_NONE,
+  CODEC_OPTION_ENCODER,
+  CODEC_OPTION_DECODER
 };
 
 struct _ID3ASFilter
 {
   char *name;
-  void (*execute)();
-  void (*flush)();
+  filter_execute_fun execute;     // filters only
+  input_execute_fun execute_input; // inputs only
+  void (*flush)(ID3ASFilterContext *context);
   void (*init)(ID3ASFilterContext *context, AVDictionary *codec_options);
+  void (*reconfigure)(ID3ASFilterContext *context, reconfiguration *change);
+  // Optional; stops the filter's threads and releases whatever it holds
+  // outside the arena.  Run by close_graph, upstream filters first.
+  void (*close)(ID3ASFilterContext *context);
   int priv_data_size;
   const AVClass *priv_class;
 
+  // Checked by build_graph before any filter is allocated
+  enum AVMediaType media_type;    // AVMEDIA_TYPE_UNKNOWN if any media is passed through
+  int sink;                       // no downstream filters allowed
+  int min_downstream_filters;
+  const char **required_options;  // NULL terminated
+  int dynamic_branches;           // reconfigure accepts branch additions and removals
+  enum CodecOption codec_option;
+  int takes_packet_frames;        // is sent frames with no picture that only carry packets (see send_to_filter)
+  // Optional checks on the parsed options (priv_data with them applied,
+  // not yet initialised) and fan-out, reported with validation_error
+  int (*validate)(void *priv_data, int num_downstream_filters, graph_error *error);
+
+  int is_input;
   ID3ASFilter *next;
 };
 
@@ -58,7 +131,13 @@ struct _sized_buffer
 enum FrameFlags {
   DISCONTINUITY = 0x01,
   BLACK = 0x02,
-  SILENT = 0x04
+  SILENT = 0x04,
+  SCENE_CHANGE = 0x08,
+  FROZEN = 0x10,
+  CLIPPED = 0x20,
+  PHASE_INVERTED = 0x40,
+  DC_OFFSET = 0x80,
+  DUAL_MONO = 0x100
 };
 
 typedef struct _frame_info 
@@ -69,21 +148,137 @@ typedef struct _frame_info
 
 } frame_info;
 
+// A compressed packet carried through the graph alongside the decoded frames,
+// so a passthrough output can forward it untouched.  Records are packed back
+// to back in PACKETS_SIDE_DATA_TYPE side data, each padded to 8 bytes.
+typedef struct _packet_record
+{
+  int64_t pts;
+  int64_t dts;
+  int frame_info_size;
+  int data_size;
+  unsigned char buffer[0]; // frame_info bytes, then the packet data
+
+} packet_record;
+
+#define PACKET_RECORD_SIZE(frame_info_size, data_size) FFALIGN(sizeof(packet_record) + (frame_info_size) + (data_size), 8)
+
+#define LUMA_BLOCK_SIZE 8
+
+// One pass over a video frame's luma plane, shared by every analysis filter
+// that sees the frame: a histogram of all of it, and the mean of each
+// LUMA_BLOCK_SIZE square block (partial blocks at the edges are left out)
+typedef struct _luma_stats
+{
+  int width;
+  int height;
+  uint32_t histogram[256];
+  int blocks_width;
+  int blocks_height;
+  uint8_t blocks[0];
+
+} luma_stats;
+
+typedef struct _scene_stats
+{
+  float scene_score;          // 0 - 1, how sharply the frame differs from the last
+  float histogram_difference; // 0 - 1, the share of pixels whose level moved
+  float temporal_complexity;  // mean absolute block difference from the last frame
+  float spatial_complexity;   // mean absolute difference between neighbouring blocks
+
+} scene_stats;
+
+// Audio QC sums, in full scale units
+typedef struct _channel_stats
+{
+  double sum;
+  double sum_sq;
+  int clipped;
+
+} channel_stats;
+
+typedef struct _pair_stats
+{
+  double sum_lr;
+  double sum_ll;
+  double sum_rr;
+  double sum_diff_sq;
+
+} pair_stats;
+
 typedef struct _frame_info_queue frame_info_queue;
 
-extern volatile int sync_mode;
+// When an output sends its codec extradata; the rest of the time the
+// extradata field of the frame header is an empty binary
+enum ExtradataMode {
+  EXTRADATA_ALWAYS,
+  EXTRADATA_ON_CHANGE,
+  EXTRADATA_ON_KEYFRAME      // on change and on every keyframe
+};
+
+#define MAX_GRAPH_DEPTH 32
+
+// Where and why a graph description was rejected; path holds the index of
+// each filter in its parent's downstream list, starting from the input
+struct _graph_error
+{
+  int path[MAX_GRAPH_DEPTH];
+  int depth;
+  char filter_name[64];
+  char message[256];
+};
+
+enum ReconfigurationType {
+  RECONFIGURE_OPTIONS,
+  RECONFIGURE_ADD_BRANCH,
+  RECONFIGURE_REMOVE_BRANCH
+};
+
+// A validated change from the reconfigure command.  It is parked on the
+// target context and handed to the filter's reconfigure callback by
+// send_to_filter, on the thread that runs the filter, before its next frame.
+struct _reconfiguration
+{
+  enum ReconfigurationType type;
+  AVDictionary *options;
+  AVDictionary *codec_options;
+  ID3ASFilterContext *branch;      // RECONFIGURE_ADD_BRANCH
+  ID3ASFilterContext **downstream_filters; // the target's new list; for a removal the removed branch is kept in the last slot
+  int branch_index;                // RECONFIGURE_REMOVE_BRANCH
+};
+
+// All values in nanoseconds
+struct _latency_summary
+{
+  uint64_t count;
+  uint64_t total;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
 
 //******************************************************************************
 // Utility functions
 //******************************************************************************
 void id3as_filters_register_all();
 ID3ASFilter *find_filter(char *name);
+ID3ASFilterContext *build_graph(char *buf, long graph_id, int sync_mode, graph_error *error);
+int reconfigure_graph(ID3ASFilterContext *graph, char *buf, graph_error *error);
+int validation_error(graph_error *error, const char *format, ...);
+void apply_reconfiguration(ID3ASFilterContext *context);
+void close_graph(ID3ASFilterContext *context);
 ID3ASFilterContext *allocate_instance(ID3ASFilter *filter, 
-				      AVDictionary *options, 
-				      AVDictionary *codec_options, 
-				      ID3ASFilterContext **downstream_filters, 
+				      long graph_id,
+				      int sync_mode,
+				      arena *arena,
 				      int num_downstream_filters);
+void init_instance(ID3ASFilterContext *instance, AVDictionary *options, AVDictionary *codec_options);
+void add_downstream_filter(ID3ASFilterContext *context, reconfiguration *change);
+ID3ASFilterContext *remove_downstream_filter(ID3ASFilterContext *context, reconfiguration *change);
+int get_downstream_filters(ID3ASFilterContext *context, ID3ASFilterContext ***filters);
 
+void send_to_filter(ID3ASFilterContext *filter, AVFrame *frame, AVRational timebase);
 void send_to_graph(ID3ASFilterContext *processor, AVFrame *frame, AVRational timebase);
 void flush_graph(ID3ASFilterContext *this);
 
@@ -93,17 +288,76 @@ void unlock_output();
 void set_packet_metadata(AVPacket *pkt, unsigned char *metadata);
 void set_frame_metadata(AVFrame *frame, unsigned char *metadata);
 
-void write_done(char *type);
-void write_output_from_frame(char *pin_name, int stream_id, AVFrame *frame);
-void write_output_from_packet(char *pin_name, int stream_id, AVCodecContext *codec_context, AVPacket *pkt, frame_info *frame_info);
+void write_done(long graph_id, char *type);
+void write_stats(ID3ASFilterContext *graph);
+void write_graph_error(long graph_id, char *reason, graph_error *error);
+void write_output_from_frame(long graph_id, output_header *header, char *pin_name, int stream_id, AVFrame *frame);
+void write_output_from_packet(long graph_id, output_header *header, char *pin_name, int stream_id, AVCodecContext *codec_context, AVPacket *pkt, frame_info *frame_info);
+output_header *allocate_output_header(enum ExtradataMode extradata_mode);
+void free_output_header(output_header **header);
 
 AVCodec *get_encoder(char *codec_name);
 AVCodec *get_decoder(char *codec_name);
 AVCodecContext *allocate_audio_context(AVCodec *codec, int sample_rate, int channel_layout, enum AVSampleFormat sample_format, AVDictionary *codec_options);
 AVCodecContext *allocate_video_context(AVCodec *codec, int width, int height, enum PixelFormat pixfmt, uint8_t *extradata, int extradata_size, AVDictionary *codec_options);
+void free_codec_context(AVCodecContext **context);
+void get_pooled_audio_buffer(AVFrame *frame, AVBufferPool **pool, int *pool_size);
+void get_pooled_video_buffer(AVFrame *frame, AVBufferPool **pool, int *pool_size);
 
 void queue_frame_info_from_frame(frame_info_queue *queue, AVFrame *frame);
 void queue_frame_info(frame_info_queue *queue, unsigned char *frame_info, unsigned int frame_info_size, int64_t pts);
 void add_frame_info_to_frame(frame_info_queue *queue, AVFrame *frame);
+void add_frame_info_side_data(AVFrame *frame, unsigned char *frame_info_data, unsigned int frame_info_size);
 void init_frame_info_queue(frame_info_queue **queue);
+void free_frame_info_queue(frame_info_queue **queue);
 frame_info *get_frame_info(frame_info_queue *queue, int64_t pts, int drop_old_pts);
+
+luma_stats *get_luma_stats(AVFrame *frame);
+void drop_luma_stats(AVFrame *frame);
+void add_analysis_side_data(AVFrame *frame, int type, const void *data, int size);
+
+void luma_stats_pass(const uint8_t *p, int linesize, int width, int height, uint8_t *blocks, int blocks_width, uint32_t *histogram);
+uint64_t sum_abs_diff(const uint8_t *a, const uint8_t *b, int n);
+int max_abs_diff(const uint8_t *a, const uint8_t *b, int n);
+double calc_avg_dbl(const void *samples, int nb_samples);
+double calc_avg_flt(const void *samples, int nb_samples);
+double calc_avg_s32(const void *samples, int nb_samples);
+double calc_avg_s16(const void *samples, int nb_samples);
+void channel_stats_flt(const void *samples, int nb_samples, double clip_level, channel_stats *stats);
+void channel_stats_s16(const void *samples, int nb_samples, double clip_level, channel_stats *stats);
+void pair_stats_flt(const void *left, const void *right, int nb_samples, pair_stats *stats);
+void pair_stats_s16(const void *left, const void *right, int nb_samples, pair_stats *stats);
+void select_planar_channels(AVFrame *src, AVFrame *dst, const int *channels, int nb_channels);
+void select_planar_channel(AVFrame *src, AVFrame *dst, int channel);
+void deinterleave_16(const void *samples, uint8_t **planes, int channels, int nb_samples);
+void deinterleave_32(const void *samples, uint8_t **planes, int channels, int nb_samples);
+void deinterleave_64(const void *samples, uint8_t **planes, int channels, int nb_samples);
+void interleave_16(const uint8_t **planes, void *samples, int channels, int nb_samples);
+void interleave_32(const uint8_t **planes, void *samples, int channels, int nb_samples);
+void interleave_64(const uint8_t **planes, void *samples, int channels, int nb_samples);
+sample_converter get_sample_converter(enum AVSampleFormat from, enum AVSampleFormat to);
+int polyphase_filter(const float *src, int length, float *dst, const float *bank, int taps,
+		     int L, int M, int *pos, int *phase, int max_out);
+void interpolate_line(uint8_t *dst, const uint8_t *above, const uint8_t *below, int width);
+void motion_adaptive_line(uint8_t *dst, const uint8_t *above, const uint8_t *below, const uint8_t *cur, const uint8_t *prev, int width, int threshold);
+void mix_channels_flt(const float **in, float **out, const float *matrix, int in_channels, int out_channels, int nb_samples);
+
+latency_histogram *allocate_latency_histogram();
+uint64_t latency_now();
+void record_latency(latency_histogram *histogram, uint64_t latency);
+void get_latency_summary(latency_histogram *histogram, latency_summary *summary);
+
+polyphase_resampler *allocate_polyphase_resampler(int input_sample_rate, int output_sample_rate, int channels, int taps);
+void free_polyphase_resampler(polyphase_resampler **resampler);
+int polyphase_max_output(polyphase_resampler *resampler, int nb_samples);
+int polyphase_resample(polyphase_resampler *resampler, const float **in, int nb_samples, float **out, int max_out);
+int64_t polyphase_next_output(polyphase_resampler *resampler, AVRational *time_base);
+
+arena *allocate_arena();
+void *arena_mallocz(arena *arena, size_t size);
+void free_arena(arena **arena);
+
+slice_threads *allocate_slice_threads(int nb_threads);
+void free_slice_threads(slice_threads **threads);
+int slice_thread_count(slice_threads *threads);
+void run_slices(slice_threads *threads, slice_fun fun, void *arg);
@@ -0,0 +1,511 @@
+#include "id3as_libav.h"
+
+// The per-sample / per-pixel inner loops used by the filters.  They live
+// here rather than in the filters themselves so that bench/id3as_microbench
+// can measure them in isolation.  The scalar loops are written to be
+// auto-vectorised; ID3AS_KERNEL adds an AVX2 variant chosen at runtime.
+
+// Block sums and the histogram are kept in separate loops so the first
+// can be vectorised; the histogram is spread over four tables so that
+// runs of equal pixels don't serialise on one counter
+ID3AS_KERNEL void luma_stats_pass(const uint8_t *p, int linesize, int width, int height, uint8_t *blocks, int blocks_width, uint32_t *histogram)
+{
+  uint32_t counts[4][256] = {{ 0 }};
+  uint16_t sums[blocks_width + 1];
+  int blocks_height = height / LUMA_BLOCK_SIZE;
+
+  for (int y = 0; y < height; y++)
+    {
+      const uint8_t *row = p + y * linesize;
+      int block_row = y / LUMA_BLOCK_SIZE;
+
+      if (y % LUMA_BLOCK_SIZE == 0) {
+	memset(sums, 0, sizeof(sums));
+      }
+
+      if (block_row < blocks_height)
+	{
+	  for (int x = 0; x < blocks_width * LUMA_BLOCK_SIZE; x++)
+	    {
+	      sums[x / LUMA_BLOCK_SIZE] += row[x];
+	    }
+	}
+
+      int x = 0;
+
+      for (; x + 4 <= width; x += 4)
+	{
+	  counts[0][row[x]]++;
+	  counts[1][row[x + 1]]++;
+	  counts[2][row[x + 2]]++;
+	  counts[3][row[x + 3]]++;
+	}
+      for (; x < width; x++)
+	{
+	  counts[0][row[x]]++;
+	}
+
+      if (block_row < blocks_height && y % LUMA_BLOCK_SIZE == LUMA_BLOCK_SIZE - 1)
+	{
+	  uint8_t *out = blocks + block_row * blocks_width;
+
+	  for (int b = 0; b < blocks_width; b++)
+	    {
+	      out[b] = (sums[b] + LUMA_BLOCK_SIZE * LUMA_BLOCK_SIZE / 2) / (LUMA_BLOCK_SIZE * LUMA_BLOCK_SIZE);
+	    }
+	}
+    }
+
+  for (int i = 0; i < 256; i++)
+    {
+      histogram[i] = counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+    }
+}
+
+ID3AS_KERNEL uint64_t sum_abs_diff(const uint8_t *a, const uint8_t *b, int n)
+{
+  uint64_t sum = 0;
+
+  for (int i = 0; i < n; i++)
+    {
+      sum += abs(a[i] - b[i]);
+    }
+
+  return sum;
+}
+
+ID3AS_KERNEL int max_abs_diff(const uint8_t *a, const uint8_t *b, int n)
+{
+  uint8_t max = 0;
+
+  for (int i = 0; i < n; i++)
+    {
+      uint8_t diff = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+      max = diff > max ? diff : max;
+    }
+
+  return max;
+}
+
+#define CALC_AVG(name, type, sum_type)					\
+  ID3AS_KERNEL double calc_avg_##name(const void *samples, int nb_samples) \
+  {									\
+  const type *p = (const type *)samples;				\
+  sum_type sum = 0;							\
+									\
+  for (int i = 0; i < nb_samples; i++)					\
+    if (p[i] < 0)							\
+      sum -= (sum_type) p[i];						\
+    else								\
+      sum += p[i];							\
+									\
+  return ((double) sum / nb_samples);					\
+  }
+
+CALC_AVG(dbl, double, double)
+CALC_AVG(flt, float, float)
+CALC_AVG(s32, int32_t, int64_t)
+CALC_AVG(s16, int16_t, int64_t)
+
+// Audio QC sums over one channel, or one pair of channels, in full scale
+// units.  Eight partial sums per statistic let the float versions
+// vectorise without reassociating a single sum.
+#define CHANNEL_STATS(name, type, acc_type, full_scale)			\
+  ID3AS_KERNEL void channel_stats_##name(const void *samples, int nb_samples, double clip_level, channel_stats *stats) \
+  {									\
+  const type *p = (const type *)samples;				\
+  const acc_type clip = clip_level * full_scale;			\
+  acc_type sum[8] = { 0 }, sum_sq[8] = { 0 };				\
+  int clipped[8] = { 0 };						\
+  int i = 0;								\
+									\
+  for (; i + 8 <= nb_samples; i += 8)					\
+    for (int j = 0; j < 8; j++)						\
+      {									\
+	acc_type x = p[i + j];						\
+	sum[j] += x;							\
+	sum_sq[j] += x * x;						\
+	clipped[j] += x >= clip || x <= -clip;				\
+      }									\
+  for (; i < nb_samples; i++)						\
+    {									\
+      acc_type x = p[i];						\
+      sum[0] += x;							\
+      sum_sq[0] += x * x;						\
+      clipped[0] += x >= clip || x <= -clip;				\
+    }									\
+									\
+  for (int j = 0; j < 8; j++)						\
+    {									\
+      stats->sum += (double) sum[j] / full_scale;			\
+      stats->sum_sq += (double) sum_sq[j] / ((double) full_scale * full_scale); \
+      stats->clipped += clipped[j];					\
+    }									\
+  }
+
+CHANNEL_STATS(flt, float, float, 1.0f)
+CHANNEL_STATS(s16, int16_t, int64_t, INT16_MAX)
+
+#define PAIR_STATS(name, type, acc_type, full_scale)			\
+  ID3AS_KERNEL void pair_stats_##name(const void *left, const void *right, int nb_samples, pair_stats *stats) \
+  {									\
+  const type *l = (const type *)left;					\
+  const type *r = (const type *)right;					\
+  acc_type lr[8] = { 0 }, ll[8] = { 0 }, rr[8] = { 0 }, dd[8] = { 0 }; \
+  int i = 0;								\
+									\
+  for (; i + 8 <= nb_samples; i += 8)					\
+    for (int j = 0; j < 8; j++)						\
+      {									\
+	acc_type a = l[i + j], b = r[i + j], d = a - b;			\
+	lr[j] += a * b;							\
+	ll[j] += a * a;							\
+	rr[j] += b * b;							\
+	dd[j] += d * d;							\
+      }									\
+  for (; i < nb_samples; i++)						\
+    {									\
+      acc_type a = l[i], b = r[i], d = a - b;				\
+      lr[0] += a * b;							\
+      ll[0] += a * a;							\
+      rr[0] += b * b;							\
+      dd[0] += d * d;							\
+    }									\
+									\
+  const double scale = (double) full_scale * full_scale;		\
+									\
+  for (int j = 0; j < 8; j++)						\
+    {									\
+      stats->sum_lr += lr[j] / scale;					\
+      stats->sum_ll += ll[j] / scale;					\
+      stats->sum_rr += rr[j] / scale;					\
+      stats->sum_diff_sq += dd[j] / scale;				\
+    }									\
+  }
+
+PAIR_STATS(flt, float, float, 1.0f)
+PAIR_STATS(s16, int16_t, int64_t, INT16_MAX)
+
+// Makes dst a planar frame of the given channels of src without copying any
+// samples.  dst takes references on the buffers behind the planes it uses,
+// so it stays valid after src is unreferenced.
+void select_planar_channels(AVFrame *src, AVFrame *dst, const int *channels, int nb_channels)
+{
+  AVBufferRef *buffers[MAX_AUDIO_CHANNELS];
+  int nb_buffers = 0;
+
+  av_frame_unref(dst);
+  av_frame_copy_props(dst, src);
+
+  dst->format = src->format;
+  dst->nb_samples = src->nb_samples;
+  dst->sample_rate = src->sample_rate;
+  dst->channel_layout = nb_channels == 1 ? AV_CH_LAYOUT_MONO : av_get_default_channel_layout(nb_channels);
+  dst->linesize[0] = src->linesize[0];
+
+  if (nb_channels > AV_NUM_DATA_POINTERS) {
+    dst->extended_data = av_mallocz(sizeof(uint8_t *) * nb_channels);
+  }
+  else {
+    dst->extended_data = dst->data;
+  }
+
+  for (int i = 0; i < nb_channels; i++)
+    {
+      AVBufferRef *buffer = av_frame_get_plane_buffer(src, channels[i]);
+      int seen = 0;
+
+      dst->extended_data[i] = src->extended_data[channels[i]];
+      if (i < AV_NUM_DATA_POINTERS) {
+	dst->data[i] = dst->extended_data[i];
+      }
+
+      for (int j = 0; j < nb_buffers; j++) seen |= buffers[j] == buffer;
+
+      if (buffer && !seen) {
+	buffers[nb_buffers++] = buffer;
+      }
+    }
+
+  if (nb_buffers > AV_NUM_DATA_POINTERS) {
+    dst->nb_extended_buf = nb_buffers - AV_NUM_DATA_POINTERS;
+    dst->extended_buf = av_mallocz(sizeof(AVBufferRef *) * dst->nb_extended_buf);
+  }
+
+  for (int i = 0; i < nb_buffers; i++)
+    {
+      if (i < AV_NUM_DATA_POINTERS) {
+	dst->buf[i] = av_buffer_ref(buffers[i]);
+      }
+      else {
+	dst->extended_buf[i - AV_NUM_DATA_POINTERS] = av_buffer_ref(buffers[i]);
+      }
+    }
+}
+
+void select_planar_channel(AVFrame *src, AVFrame *dst, int channel)
+{
+  select_planar_channels(src, dst, &channel, 1);
+}
+
+// Packed to planar.  The common channel counts get their own loops so the
+// compiler can turn the stride into shuffles.
+#define DEINTERLEAVE_CHANNELS(type, channels)				\
+  for (int c = 0; c < channels; c++)					\
+    {									\
+      type *d = (type *) planes[c];					\
+      for (int i = 0; i < nb_samples; i++)				\
+	d[i] = src[i * channels + c];					\
+    }
+
+#define DEINTERLEAVE(name, type)					\
+  ID3AS_KERNEL void deinterleave_##name(const void *samples, uint8_t **planes, int channels, int nb_samples) \
+  {									\
+  const type *src = (const type *) samples;				\
+									\
+  switch (channels) {							\
+  case 2:								\
+    {									\
+      type *restrict l = (type *) planes[0];				\
+      type *restrict r = (type *) planes[1];				\
+      for (int i = 0; i < nb_samples; i++)				\
+	{								\
+	  l[i] = src[2 * i];						\
+	  r[i] = src[2 * i + 1];					\
+	}								\
+    }									\
+    break;								\
+  case 6:								\
+    DEINTERLEAVE_CHANNELS(type, 6);					\
+    break;								\
+  case 8:								\
+    DEINTERLEAVE_CHANNELS(type, 8);					\
+    break;								\
+  case 16:								\
+    DEINTERLEAVE_CHANNELS(type, 16);					\
+    break;								\
+  default:								\
+    DEINTERLEAVE_CHANNELS(type, channels);				\
+    break;								\
+  }									\
+  }
+
+DEINTERLEAVE(16, int16_t)
+DEINTERLEAVE(32, int32_t)
+DEINTERLEAVE(64, int64_t)
+
+#define INTERLEAVE_CHANNELS(type, channels)				\
+  for (int c = 0; c < channels; c++)					\
+    {									\
+      const type *s = (const type *) planes[c];			\
+      for (int i = 0; i < nb_samples; i++)				\
+	dst[i * channels + c] = s[i];					\
+    }
+
+// Planar to packed, the inverse of DEINTERLEAVE
+#define INTERLEAVE(name, type)						\
+  ID3AS_KERNEL void interleave_##name(const uint8_t **planes, void *samples, int channels, int nb_samples) \
+  {									\
+  type *dst = (type *) samples;						\
+									\
+  switch (channels) {							\
+  case 2:								\
+    {									\
+      const type *restrict l = (const type *) planes[0];		\
+      const type *restrict r = (const type *) planes[1];		\
+      for (int i = 0; i < nb_samples; i++)				\
+	{								\
+	  dst[2 * i] = l[i];						\
+	  dst[2 * i + 1] = r[i];					\
+	}								\
+    }									\
+    break;								\
+  case 6:								\
+    INTERLEAVE_CHANNELS(type, 6);					\
+    break;								\
+  case 8:								\
+    INTERLEAVE_CHANNELS(type, 8);					\
+    break;								\
+  default:								\
+    INTERLEAVE_CHANNELS(type, channels);				\
+    break;								\
+  }									\
+  }
+
+INTERLEAVE(16, int16_t)
+INTERLEAVE(32, int32_t)
+INTERLEAVE(64, int64_t)
+
+// Sample conversion over a contiguous run - a whole packed buffer or one
+// plane.  Float to integer clips and rounds to nearest.
+#define CONVERT_SAMPLES(name, from, to, expr)				\
+  ID3AS_KERNEL static void convert_##name(const void *src, void *dst, int n) \
+  {									\
+    const from *restrict s = (const from *) src;			\
+    to *restrict d = (to *) dst;					\
+    for (int i = 0; i < n; i++)						\
+      {									\
+	from x = s[i];							\
+	d[i] = expr;							\
+      }									\
+  }
+
+#define CLIP_ROUND(type, v, lo, hi) (type) (FFMIN(FFMAX((v), lo), hi) + ((v) >= 0 ? 0.5f : -0.5f))
+
+CONVERT_SAMPLES(s16_flt, int16_t, float, x * (1.0f / 32768))
+CONVERT_SAMPLES(s32_flt, int32_t, float, x * (1.0f / 2147483648.0f))
+CONVERT_SAMPLES(flt_s16, float, int16_t, CLIP_ROUND(int16_t, x * 32768.0f, -32768.0f, 32767.0f))
+CONVERT_SAMPLES(flt_s32, float, int32_t, CLIP_ROUND(int32_t, x * 2147483648.0f, -2147483648.0f, 2147483520.0f))
+CONVERT_SAMPLES(s16_s32, int16_t, int32_t, (int32_t) x * 65536)
+CONVERT_SAMPLES(s32_s16, int32_t, int16_t, x >> 16)
+
+// The converter between the packed forms of two formats, or NULL when they
+// only differ in layout (or not at all) or aren't s16 / s32 / flt
+sample_converter get_sample_converter(enum AVSampleFormat from, enum AVSampleFormat to)
+{
+  from = av_get_packed_sample_fmt(from);
+  to = av_get_packed_sample_fmt(to);
+
+  switch (from << 8 | to) {
+  case AV_SAMPLE_FMT_S16 << 8 | AV_SAMPLE_FMT_FLT: return convert_s16_flt;
+  case AV_SAMPLE_FMT_S32 << 8 | AV_SAMPLE_FMT_FLT: return convert_s32_flt;
+  case AV_SAMPLE_FMT_FLT << 8 | AV_SAMPLE_FMT_S16: return convert_flt_s16;
+  case AV_SAMPLE_FMT_FLT << 8 | AV_SAMPLE_FMT_S32: return convert_flt_s32;
+  case AV_SAMPLE_FMT_S16 << 8 | AV_SAMPLE_FMT_S32: return convert_s16_s32;
+  case AV_SAMPLE_FMT_S32 << 8 | AV_SAMPLE_FMT_S16: return convert_s32_s16;
+  default: return NULL;
+  }
+}
+
+// One output sample per step of a polyphase FIR: the phase picks the row
+// of the filter bank, and the input position advances by M/L per output.
+// Eight partial sums let the dot product vectorise without -ffast-math.
+#define POLYPHASE(taps)							\
+  ID3AS_FMA_KERNEL static int polyphase_##taps(const float *src, int length, float *dst, const float *bank, \
+					       int L, int M, int *pos, int *phase, int max_out) \
+  {									\
+    int p = *pos, ph = *phase, n = 0;					\
+									\
+    while (n < max_out && p + taps <= length)				\
+      {									\
+	const float *restrict h = bank + ph * taps;			\
+	const float *restrict s = src + p;				\
+	float acc[8] = { 0 };						\
+									\
+	for (int j = 0; j < taps; j += 8)				\
+	  for (int k = 0; k < 8; k++)					\
+	    acc[k] += h[j + k] * s[j + k];				\
+									\
+	dst[n++] = ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7])); \
+									\
+	ph += M;							\
+	p += ph / L;							\
+	ph %= L;							\
+      }									\
+									\
+    *pos = p;								\
+    *phase = ph;							\
+									\
+    return n;								\
+  }
+
+POLYPHASE(16)
+POLYPHASE(32)
+POLYPHASE(64)
+
+int polyphase_filter(const float *src, int length, float *dst, const float *bank, int taps,
+		     int L, int M, int *pos, int *phase, int max_out)
+{
+  switch (taps) {
+  case 16: return polyphase_16(src, length, dst, bank, L, M, pos, phase, max_out);
+  case 32: return polyphase_32(src, length, dst, bank, L, M, pos, phase, max_out);
+  default: return polyphase_64(src, length, dst, bank, L, M, pos, phase, max_out);
+  }
+}
+
+// Fills a line of the missing field from the lines either side of it
+ID3AS_KERNEL void interpolate_line(uint8_t *dst, const uint8_t *above, const uint8_t *below, int width)
+{
+  for (int i = 0; i < width; i++)
+    {
+      dst[i] = (above[i] + below[i] + 1) >> 1;
+    }
+}
+
+// Where the missing field's line hasn't changed since the previous frame
+// the picture is static and the line is kept (weave); elsewhere it is
+// interpolated (bob)
+ID3AS_KERNEL void motion_adaptive_line(uint8_t *dst, const uint8_t *above, const uint8_t *below, const uint8_t *cur, const uint8_t *prev, int width, int threshold)
+{
+  for (int i = 0; i < width; i++)
+    {
+      int interpolated = (above[i] + below[i] + 1) >> 1;
+      int motion = abs(cur[i] - prev[i]);
+
+      dst[i] = motion < threshold ? cur[i] : interpolated;
+    }
+}
+
+// out[o] = sum of matrix[o * in_channels + i] * in[i], all planar float.
+// Fixed channel counts let the compiler unroll the matrix row into
+// registers; kernels.o is built with -ffp-contract=fast so the multiply-adds
+// become FMAs where the CPU has them.
+#define MIX_FIXED(in_channels, out_channels)				\
+  ID3AS_FMA_KERNEL static void mix_##in_channels##_##out_channels(const float **in, float **out, const float *matrix, int nb_samples) \
+  {									\
+    for (int o = 0; o < out_channels; o++)				\
+      {									\
+	const float *m = matrix + o * in_channels;			\
+	float *restrict d = out[o];					\
+									\
+	for (int i = 0; i < nb_samples; i++)				\
+	  {								\
+	    float acc = 0;						\
+	    for (int c = 0; c < in_channels; c++)			\
+	      acc += m[c] * in[c][i];					\
+	    d[i] = acc;							\
+	  }								\
+      }									\
+  }
+
+MIX_FIXED(2, 1)
+MIX_FIXED(1, 2)
+MIX_FIXED(6, 2)
+MIX_FIXED(8, 2)
+MIX_FIXED(8, 6)
+
+// Any other shape - one pass over the output per input channel, skipping
+// the zero coefficients that make up most of a routing matrix
+ID3AS_FMA_KERNEL static void mix_any(const float **in, float **out, const float *matrix, int in_channels, int out_channels, int nb_samples)
+{
+  for (int o = 0; o < out_channels; o++)
+    {
+      float *restrict d = out[o];
+
+      memset(d, 0, nb_samples * sizeof(float));
+
+      for (int c = 0; c < in_channels; c++)
+	{
+	  const float *restrict s = in[c];
+	  float m = matrix[o * in_channels + c];
+
+	  if (m == 0) continue;
+
+	  for (int i = 0; i < nb_samples; i++)
+	    d[i] += m * s[i];
+	}
+    }
+}
+
+void mix_channels_flt(const float **in, float **out, const float *matrix, int in_channels, int out_channels, int nb_samples)
+{
+  switch (in_channels << 8 | out_channels) {
+  case 2 << 8 | 1: mix_2_1(in, out, matrix, nb_samples); break;
+  case 1 << 8 | 2: mix_1_2(in, out, matrix, nb_samples); break;
+  case 6 << 8 | 2: mix_6_2(in, out, matrix, nb_samples); break;
+  case 8 << 8 | 2: mix_8_2(in, out, matrix, nb_samples); break;
+  case 8 << 8 | 6: mix_8_6(in, out, matrix, nb_samples); break;
+  default: mix_any(in, out, matrix, in_channels, out_channels, nb_samples); break;
+  }
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE             /* See feature_test_macros(7) */
+#include <time.h>
+
+#include "id3as_libav.h"
+
+// Log-linear ("HDR style") histogram of latencies in clock ticks.  Values
+// below 2^SUB_BUCKET_BITS are recorded exactly, above that each power of two
+// is split into SUB_BUCKET_COUNT linear buckets, giving a relative error of
+// at most 1 / SUB_BUCKET_COUNT (~3%).  Anything above 2^MAX_MAGNITUDE ticks
+// (several minutes) lands in the last bucket.
+//
+// On x86 the clock is the TSC, which is several times cheaper to read than
+// clock_gettime; ticks are only converted to nanoseconds when a summary is
+// taken, using the TSC rate measured since the first histogram was allocated.
+//
+// A filter context is only ever executed from a single thread (its parent's),
+// so each histogram has exactly one writer and recording is a handful of
+// relaxed loads and stores - no locks and no atomic read-modify-write.
+// Readers (the stats command) may see a slightly torn snapshot, which is fine
+// for monitoring.
+
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+#define MAX_MAGNITUDE 40
+#define NUM_BUCKETS ((MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT)
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+struct _latency_histogram
+{
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t buckets[NUM_BUCKETS];
+};
+
+static inline int bucket_index(uint64_t value)
+{
+  if (value < SUB_BUCKET_COUNT) {
+    return (int) value;
+  }
+
+  int msb = 63 - __builtin_clzll(value);
+
+  if (msb > MAX_MAGNITUDE) {
+    return NUM_BUCKETS - 1;
+  }
+
+  int shift = msb - SUB_BUCKET_BITS;
+  int sub_bucket = (int) (value >> shift);
+
+  return ((shift + 1) << SUB_BUCKET_BITS) + (sub_bucket - SUB_BUCKET_COUNT);
+}
+
+// The highest value that would have been recorded in the bucket
+static uint64_t bucket_value(int index)
+{
+  if (index < 2 * SUB_BUCKET_COUNT) {
+    return index;
+  }
+
+  int shift = (index >> SUB_BUCKET_BITS) - 1;
+  uint64_t sub_bucket = SUB_BUCKET_COUNT + (index & (SUB_BUCKET_COUNT - 1));
+
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t latency_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return monotonic_ns();
+#endif
+}
+
+static uint64_t epoch_ticks = 0;
+static uint64_t epoch_ns = 0;
+
+static double ns_per_tick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ticks = latency_now() - epoch_ticks;
+  uint64_t ns = monotonic_ns() - epoch_ns;
+
+  return ticks > 0 ? (double) ns / ticks : 1.0;
+#else
+  return 1.0;
+#endif
+}
+
+latency_histogram *allocate_latency_histogram()
+{
+  if (epoch_ticks == 0) {
+    epoch_ns = monotonic_ns();
+    epoch_ticks = latency_now();
+  }
+
+  return av_mallocz(sizeof(latency_histogram));
+}
+
+void record_latency(latency_histogram *histogram, uint64_t latency)
+{
+  int index = bucket_index(latency);
+
+  STORE(histogram->buckets[index], LOAD(histogram->buckets[index]) + 1);
+  STORE(histogram->total, LOAD(histogram->total) + latency);
+  STORE(histogram->count, LOAD(histogram->count) + 1);
+
+  if (latency > LOAD(histogram->max)) {
+    STORE(histogram->max, latency);
+  }
+}
+
+void get_latency_summary(latency_histogram *histogram, latency_summary *summary)
+{
+  static const double percentiles[] = { 0.5, 0.99, 0.999 };
+  uint64_t *results[] = { &summary->p50, &summary->p99, &summary->p999 };
+  uint64_t seen = 0;
+  int p = 0;
+  double scale = ns_per_tick();
+
+  summary->count = LOAD(histogram->count);
+  summary->total = LOAD(histogram->total) * scale;
+  summary->max = LOAD(histogram->max) * scale;
+  summary->p50 = summary->p99 = summary->p999 = 0;
+
+  for (int i = 0; i < NUM_BUCKETS && p < 3; i++)
+    {
+      seen += LOAD(histogram->buckets[i]);
+
+      while (p < 3 && seen > 0 && seen >= percentiles[p] * summary->count)
+	{
+	  *results[p] = bucket_value(i) * scale;
+	  p++;
+	}
+    }
+
+  // Bucket upper bounds can overshoot the true maximum
+  for (int i = 0; i < 3; i++)
+    {
+      if (*results[i] > summary->max) {
+	*results[i] = summary->max;
+      }
+    }
+}
@@ -0,0 +1,109 @@
+#include "id3as_libav.h"
+#include "i_utils.h"
+
+// Analysis filters (black detect, scene detect, ...) all start from the
+// same pass over the luma plane.  The first of them to see a frame makes
+// the pass and attaches the result as LUMA_STATS_SIDE_DATA_TYPE side data;
+// the rest, and anything downstream of them, find it there.
+//
+// Side data is added to the frame that was passed in, which a parallel
+// filter hands to all its branches at once, so lookups and additions are
+// serialised here.  Analysis filters are best placed before any fan-out
+// all the same, so that the pass is made only once.
+//
+// av_frame_copy_props carries the stats across with everything else, so
+// filters that write new pixels drop them from their output with
+// drop_luma_stats.  Stats for a different picture size are recomputed in
+// case anything else carries them over.
+
+static i_mutex_t mutex = INITIALISE_STATIC_MUTEX();
+
+static void check_format(AVFrame *frame)
+{
+  switch (frame->format) {
+  case PIX_FMT_YUV420P:
+  case PIX_FMT_YUV422P:
+  case PIX_FMT_YUV444P:
+  case PIX_FMT_YUVJ420P:
+  case PIX_FMT_YUVJ422P:
+  case PIX_FMT_YUVJ444P:
+  case PIX_FMT_GRAY8:
+  case AV_PIX_FMT_NV12:
+    break;
+
+  default:
+    ERRORFMT("Unsupported pixel format for luma analysis: %d\n", frame->format);
+    exit(1);
+  }
+}
+
+static int matches(AVFrameSideData *side_data, AVFrame *frame)
+{
+  luma_stats *stats = (luma_stats *) side_data->data;
+
+  return stats->width == frame->width && stats->height == frame->height;
+}
+
+luma_stats *get_luma_stats(AVFrame *frame)
+{
+  i_mutex_lock(&mutex);
+  AVFrameSideData *side_data = av_frame_get_side_data(frame, LUMA_STATS_SIDE_DATA_TYPE);
+  i_mutex_unlock(&mutex);
+
+  if (side_data && matches(side_data, frame)) {
+    return (luma_stats *) side_data->data;
+  }
+
+  check_format(frame);
+
+  // The pass is made without the lock held; if another branch got there
+  // first, its result is used and ours dropped
+  int blocks_width = frame->width / LUMA_BLOCK_SIZE;
+  int blocks_height = frame->height / LUMA_BLOCK_SIZE;
+  int size = sizeof(luma_stats) + blocks_width * blocks_height;
+  luma_stats *stats = av_malloc(size);
+
+  stats->width = frame->width;
+  stats->height = frame->height;
+  stats->blocks_width = blocks_width;
+  stats->blocks_height = blocks_height;
+
+  luma_stats_pass(frame->data[0], frame->linesize[0], frame->width, frame->height, stats->blocks, blocks_width, stats->histogram);
+
+  i_mutex_lock(&mutex);
+
+  side_data = av_frame_get_side_data(frame, LUMA_STATS_SIDE_DATA_TYPE);
+
+  if (side_data && !matches(side_data, frame)) {
+    av_frame_remove_side_data(frame, LUMA_STATS_SIDE_DATA_TYPE);
+    side_data = NULL;
+  }
+
+  if (!side_data) {
+    side_data = av_frame_new_side_data(frame, LUMA_STATS_SIDE_DATA_TYPE, size);
+    memcpy(side_data->data, stats, size);
+  }
+
+  i_mutex_unlock(&mutex);
+
+  av_free(stats);
+
+  return (luma_stats *) side_data->data;
+}
+
+void drop_luma_stats(AVFrame *frame)
+{
+  av_frame_remove_side_data(frame, LUMA_STATS_SIDE_DATA_TYPE);
+}
+
+// For analysis results of filters that may share their frame with other
+// branches, under the same lock as the luma stats
+void add_analysis_side_data(AVFrame *frame, int type, const void *data, int size)
+{
+  i_mutex_lock(&mutex);
+
+  AVFrameSideData *side_data = av_frame_new_side_data(frame, type, size);
+  memcpy(side_data->data, data, size);
+
+  i_mutex_unlock(&mutex);
+}
@@ -7,20 +7,65 @@
 
 #define CUSTOM_VARARGS_READ_PROCESSOR NULL
 
-static ID3ASFilterContext *build_graph(char *buffer);
-static ID3ASFilterContext *read_filter(char *buf, int *index);
-static AVDictionary *read_params(char *buf, int *index);
+#define GRAPH_TABLE_SIZE 256 // power of two
 
-ID3ASFilterContext *input;
-volatile int sync_mode;
+// Graphs hosted by this process, keyed by the id the Erlang side gave them.
+// The legacy initialise / process_frame / flush / stats commands act on
+// graph 0.
+typedef struct _hosted_graph hosted_graph;
+
+struct _hosted_graph
+{
+  long id;
+  ID3ASFilterContext *input;
+  int flushed;
+  hosted_graph *next;
+};
+
+static hosted_graph *graph_table[GRAPH_TABLE_SIZE];
 
 static unsigned long long int bytes_read = 0;
 
-void initialise(char *mode, void *initialisation_data, int length) 
+static hosted_graph **find_graph_slot(long graph_id)
 {
-  sync_mode = (strncmp(mode, "async", 5) != 0);
+  hosted_graph **p = &graph_table[(unsigned long) graph_id & (GRAPH_TABLE_SIZE - 1)];
+
+  while (*p && (*p)->id != graph_id) p = &(*p)->next;
+
+  return p;
+}
 
-  input = build_graph((char *) initialisation_data);
+static hosted_graph *find_graph(long graph_id)
+{
+  return *find_graph_slot(graph_id);
+}
+
+void graph_initialise(long graph_id, char *mode, void *initialisation_data, int length) 
+{
+  hosted_graph **slot = find_graph_slot(graph_id);
+
+  if (*slot) {
+    write_done(graph_id, "graph_exists");
+    return;
+  }
+
+  graph_error error;
+
+  // Each graph keeps its own mode, so a new one can't change how frames are
+  // answered for those already running
+  ID3ASFilterContext *input = build_graph((char *) initialisation_data, graph_id, strncmp(mode, "async", 5) != 0, &error);
+
+  if (!input) {
+    write_graph_error(graph_id, "invalid_graph", &error);
+    return;
+  }
+
+  hosted_graph *graph = malloc(sizeof(hosted_graph));
+  graph->id = graph_id;
+  graph->input = input;
+  graph->flushed = 0;
+  graph->next = NULL;
+  *slot = graph;
   /*
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
@@ -31,7 +76,7 @@ void initialise(char *mode, void *initialisation_data, int length)
   */
 }
 
-void process_frame(void *metadata, int metadata_size, void *frame_info, int frame_info_size) 
+void graph_process_frame(long graph_id, void *metadata, int metadata_size, void *frame_info, int frame_info_size) 
 {
   static unsigned char *data = NULL;
   static unsigned int data_buffer_size = 0;
@@ -41,21 +86,125 @@ void process_frame(void *metadata, int metadata_size, void *frame_info, int fram
   bytes_read += data_size;
   // TRACEFMT("IN %llu", bytes_read);
 
-  input->filter->execute(input, 
-			 metadata, metadata_size,
-			 frame_info, frame_info_size,
-			 data, data_size);
+  hosted_graph *graph = find_graph(graph_id);
+
+  if (!graph || graph->flushed) {
+    write_done(graph_id, "no_graph");
+    return;
+  }
+
+  ID3ASFilterContext *input = graph->input;
+  uint64_t start = latency_now();
+
+  input->filter->execute_input(input,
+			       metadata, metadata_size,
+			       frame_info, frame_info_size,
+			       data, data_size);
+
+  record_latency(input->execute_latency, latency_now() - start);
+
+  if (input->sync_mode) {
+    write_done(graph_id, "frame_done");
+  }
+}
+
+void graph_flush(long graph_id) 
+{
+  hosted_graph *graph = find_graph(graph_id);
+
+  if (!graph || graph->flushed) {
+    write_done(graph_id, "no_graph");
+    return;
+  }
+
+  graph->input->filter->flush(graph->input);
+  graph->flushed = 1;
+
+  write_done(graph_id, "flush_done");
+}
+
+void graph_stats(long graph_id)
+{
+  hosted_graph *graph = find_graph(graph_id);
+
+  if (!graph) {
+    write_done(graph_id, "no_graph");
+    return;
+  }
+
+  write_stats(graph->input);
+}
+
+// The change is checked here and picked up by the target filter before its
+// next frame, so frames already in flight are not held up
+void graph_reconfigure(long graph_id, void *reconfiguration_data, int length)
+{
+  hosted_graph *graph = find_graph(graph_id);
+  graph_error error;
+
+  if (!graph || graph->flushed) {
+    write_done(graph_id, "no_graph");
+  }
+  else if (reconfigure_graph(graph->input, (char *) reconfiguration_data, &error) != 0) {
+    write_graph_error(graph_id, "invalid_reconfiguration", &error);
+  }
+  else {
+    write_done(graph_id, "reconfigure_done");
+  }
+}
+
+// Flushes the graph if that hasn't been done already, closes every filter
+// (joining their threads and releasing codecs, scalers and pools) and
+// forgets it, so the id can be reused.  The graph's arena goes last.
+void graph_close(long graph_id)
+{
+  hosted_graph **slot = find_graph_slot(graph_id);
+  hosted_graph *graph = *slot;
+
+  if (!graph) {
+    write_done(graph_id, "no_graph");
+    return;
+  }
 
-  if (sync_mode) {
-    write_done("frame_done");
+  if (!graph->flushed) {
+    graph->input->filter->flush(graph->input);
   }
+
+  // The input context is itself in the arena
+  arena *arena = graph->input->arena;
+
+  close_graph(graph->input);
+
+  *slot = graph->next;
+  free_arena(&arena);
+  free(graph);
+
+  write_done(graph_id, "close_done");
+}
+
+void initialise(char *mode, void *initialisation_data, int length) 
+{
+  graph_initialise(0, mode, initialisation_data, length);
+}
+
+void process_frame(void *metadata, int metadata_size, void *frame_info, int frame_info_size) 
+{
+  graph_process_frame(0, metadata, metadata_size, frame_info, frame_info_size);
 }
 
 void flush() 
 {
-  input->filter->flush(input);
+  graph_flush(0);
+}
+
+void stats()
+{
+  graph_stats(0);
+}
 
-  write_done("flush_done");
+void reconfigure(void *reconfiguration_data, int length)
+{
+  graph_reconfigure(0, reconfiguration_data, length);
 }
 
 void command_loop() 
@@ -68,8 +217,9 @@ void command_loop()
 
   do
     {
-      void *initialisation_data = NULL, *metadata = NULL, *frame_info = NULL;
+      void *initialisation_data = NULL, *metadata = NULL, *frame_info = NULL, *reconfiguration_data = NULL;
       char *mode = NULL;
+      long graph_id;
       long length1, length2, length3;
 
       len = read_port_command(PACKET_SIZE, SUBSYSTEM, (unsigned char **) &buf, &buf_size, &command, &index);
@@ -81,6 +231,14 @@ void command_loop()
 	  HANDLE_MATCH3(initialise, "~a~b", mode, initialisation_data, length1)
 	  HANDLE_MATCH4(process_frame, "~b~b", metadata, length2, frame_info, length3)
 	  HANDLE_MATCH0(flush)
+	  HANDLE_MATCH0(stats)
+	  HANDLE_MATCH2(reconfigure, "~b", reconfiguration_data, length1)
+	  HANDLE_MATCH4(graph_initialise, "~l~a~b", graph_id, mode, initialisation_data, length1)
+	  HANDLE_MATCH5(graph_process_frame, "~l~b~b", graph_id, metadata, length2, frame_info, length3)
+	  HANDLE_MATCH1(graph_flush, "~l", graph_id)
+	  HANDLE_MATCH1(graph_stats, "~l", graph_id)
+	  HANDLE_MATCH3(graph_reconfigure, "~l~b", graph_id, reconfiguration_data, length1)
+	  HANDLE_MATCH1(graph_close, "~l", graph_id)
 	  
 	  HANDLE_UNMATCHED()
 	  free(command);
@@ -103,75 +261,3 @@ int main(int argc, char **argv)
 
   return 0;
 }
-
-static ID3ASFilterContext *build_graph(char *buf) 
-{
-  int index = 0;
-  int version;
-
-  ei_decode_version(buf, &index, &version);
-
-  return read_filter(buf, &index);
-}
-
-static ID3ASFilterContext *read_filter(char *buf, int *index)
-{
-  int arity;
-  char *name = NULL;
-  AVDictionary *params = NULL;
-  AVDictionary *codec_params = NULL;
-  int num_downstream_filters;
-  ID3ASFilterContext **downstream_filters;
-
-  I_DECODE_TUPLE_HEADER(buf, index, &arity);
-
-  I_DECODE_STRING(buf, index, &name);
-
-  params = read_params(buf, index);
-
-  codec_params = read_params(buf, index);
-
-  I_DECODE_LIST_HEADER(buf, index, &num_downstream_filters);
-
-  downstream_filters = malloc(sizeof(ID3ASFilterContext*) * num_downstream_filters);
-
-  for (int i = 0; i < num_downstream_filters; i++)
-    {
-      downstream_filters[i] = read_filter(buf, index);
-    }
-
-  I_SKIP_NULL(buf, index);
-
-  ID3ASFilter *filter = find_filter(name);
-
-  free(name);
-
-  return allocate_instance(filter, params, codec_params, downstream_filters, num_downstream_filters);
-}
-
-static AVDictionary *read_params(char *buf, int *index)
-{
-  int num_params;
-  AVDictionary *dict = NULL;
-
-  I_DECODE_LIST_HEADER(buf, index, &num_params);
-
-  for (int i = 0; i < num_params; i++)
-    {
-      char *name;
-      char *value;
-      int arity;
-
-      I_DECODE_TUPLE_HEADER(buf, index, &arity);
-
-      I_DECODE_STRING(buf, index, &name);
-      I_DECODE_STRING(buf, index, &value);
-
-      av_dict_set(&dict, name, value, AV_DICT_DONT_STRDUP_KEY | AV_DICT_DONT_STRDUP_VAL);
-    }
-  
-  I_SKIP_NULL(buf, index);
-
-  return dict;
-}
-
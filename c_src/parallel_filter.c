@@ -13,6 +13,9 @@ typedef struct _thread_struct_t
   pthread_mutex_t trigger_mutex;
   pthread_cond_t complete;
   pthread_mutex_t complete_mutex;
+  int triggered;
+  int completed;
+  int exit_thread;
   struct _codec_t *codec_t;
   ID3ASFilterContext *context;
   ID3ASFilterContext *downstream_filter;
@@ -43,12 +46,16 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
 
     for (int i = 0; i < context->num_downstream_filters; i++) {
       pthread_mutex_lock(&this->threads[i].trigger_mutex);
+      this->threads[i].triggered = 1;
       pthread_cond_signal(&this->threads[i].trigger);
       pthread_mutex_unlock(&this->threads[i].trigger_mutex);
     }
 
     for (int i = 0; i < context->num_downstream_filters; i++) {
-      pthread_cond_wait(&this->threads[i].complete, &this->threads[i].complete_mutex);
+      while (!this->threads[i].completed) {
+	pthread_cond_wait(&this->threads[i].complete, &this->threads[i].complete_mutex);
+      }
+      this->threads[i].completed = 0;
     }
   }
 }
@@ -65,48 +72,125 @@ static void *thread_proc(void *data)
   pthread_mutex_lock(&this->trigger_mutex);
 
   do {
-    pthread_cond_wait(&this->trigger, &this->trigger_mutex);
+    while (!this->triggered && !this->exit_thread) {
+      pthread_cond_wait(&this->trigger, &this->trigger_mutex);
+    }
+
+    if (this->exit_thread) {
+      break;
+    }
+
+    this->triggered = 0;
 
-    this->downstream_filter->filter->execute(this->downstream_filter, this->codec_t->inbound_frame, this->codec_t->inbound_timebase);
+    send_to_filter(this->downstream_filter, this->codec_t->inbound_frame, this->codec_t->inbound_timebase);
 
     pthread_mutex_lock(&this->complete_mutex);
+    this->completed = 1;
     pthread_cond_signal(&this->complete);
     pthread_mutex_unlock(&this->complete_mutex);
 
   } while(1);
 
+  pthread_mutex_unlock(&this->trigger_mutex);
+
   return 0;
 }
 
-static void init(ID3ASFilterContext *context, AVDictionary *codec_options) 
+// One thread per branch, or none at all if there is only one branch.  The
+// complete mutexes are held by the thread calling process except while it
+// waits, so they must be taken on that thread.
+static void start_threads(ID3ASFilterContext *context) 
 {
   codec_t *this = context->priv_data;
 
   if (context->num_downstream_filters < 2) {
     this->pass_through = 1;
+    this->threads = NULL;
+    return;
   }
-  else {
-    this->pass_through = 0;
-    this->threads = (thread_struct *) malloc(sizeof(thread_struct) * context->num_downstream_filters);
 
+  this->pass_through = 0;
+  this->threads = (thread_struct *) calloc(context->num_downstream_filters, sizeof(thread_struct));
 
-    for (int i = 0; i < context->num_downstream_filters; i++)
-      {
-	this->threads[i].thread_id = thread_id++;
-	this->threads[i].context = context;
-	this->threads[i].downstream_filter = context->downstream_filters[i];
-	this->threads[i].codec_t = this;
-	pthread_cond_init(&this->threads[i].trigger, NULL);
-	pthread_mutex_init(&this->threads[i].trigger_mutex, NULL);
-	pthread_cond_init(&this->threads[i].complete, NULL);
-	pthread_mutex_init(&this->threads[i].complete_mutex, NULL);
+  for (int i = 0; i < context->num_downstream_filters; i++)
+    {
+      this->threads[i].thread_id = thread_id++;
+      this->threads[i].context = context;
+      this->threads[i].downstream_filter = context->downstream_filters[i];
+      this->threads[i].codec_t = this;
+      pthread_cond_init(&this->threads[i].trigger, NULL);
+      pthread_mutex_init(&this->threads[i].trigger_mutex, NULL);
+      pthread_cond_init(&this->threads[i].complete, NULL);
+      pthread_mutex_init(&this->threads[i].complete_mutex, NULL);
 
-	pthread_mutex_lock(&this->threads[i].complete_mutex);
+      pthread_mutex_lock(&this->threads[i].complete_mutex);
 
-	pthread_create(&this->threads[i].thread, NULL, &thread_proc, &this->threads[i]);
-      }
+      pthread_create(&this->threads[i].thread, NULL, &thread_proc, &this->threads[i]);
+    }
+}
 
+static void stop_threads(ID3ASFilterContext *context) 
+{
+  codec_t *this = context->priv_data;
+
+  if (this->pass_through) {
+    return;
   }
+
+  for (int i = 0; i < context->num_downstream_filters; i++)
+    {
+      pthread_mutex_lock(&this->threads[i].trigger_mutex);
+      this->threads[i].exit_thread = 1;
+      pthread_cond_signal(&this->threads[i].trigger);
+      pthread_mutex_unlock(&this->threads[i].trigger_mutex);
+
+      pthread_join(this->threads[i].thread, NULL);
+
+      pthread_mutex_unlock(&this->threads[i].complete_mutex);
+      pthread_cond_destroy(&this->threads[i].trigger);
+      pthread_mutex_destroy(&this->threads[i].trigger_mutex);
+      pthread_cond_destroy(&this->threads[i].complete);
+      pthread_mutex_destroy(&this->threads[i].complete_mutex);
+    }
+
+  free(this->threads);
+  this->threads = NULL;
+}
+
+// Runs between frames on the thread that calls process, so no branch is
+// mid-frame; the threads are simply rebuilt around the new branch list
+static void reconfigure(ID3ASFilterContext *context, reconfiguration *change) 
+{
+  stop_threads(context);
+
+  switch (change->type) {
+  case RECONFIGURE_ADD_BRANCH:
+    add_downstream_filter(context, change);
+    break;
+
+  case RECONFIGURE_REMOVE_BRANCH:
+    {
+      ID3ASFilterContext *branch = remove_downstream_filter(context, change);
+      branch->filter->flush(branch);
+      close_graph(branch);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  start_threads(context);
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options) 
+{
+  start_threads(context);
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  stop_threads(context);
 }
 
 static const AVOption options[] = {
@@ -125,6 +209,11 @@ ID3ASFilter id3as_parallel_filter = {
   .init = init,
   .execute = process,
   .flush = flush,
+  .reconfigure = reconfigure,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_UNKNOWN,
+  .min_downstream_filters = 1,
+  .dynamic_branches = 1
 };
@@ -0,0 +1,217 @@
+#include <math.h>
+
+#include "id3as_libav.h"
+
+// Rational-ratio resampler for the rates we see most (32k / 44.1k / 48k).
+// The output rate is L/M times the input rate; a Blackman-windowed sinc
+// designed at L times the input rate is split into L phases of `taps`
+// coefficients, so each output sample is a single taps-long dot product
+// (polyphase_filter in kernels.c).
+//
+// Each channel keeps a buffer of input not yet fully used.  It starts with
+// `zeros` = taps / 2 - 1 samples of silence so that the first output lines
+// up with the first input sample rather than being delayed by half the
+// filter, and a drain appends taps / 2 more so the last input is reached.
+
+#define CUTOFF_MARGIN 0.97 // keep the transition band clear of the new Nyquist
+
+static const int supported_rates[] = { 32000, 44100, 48000 };
+
+struct _polyphase_resampler
+{
+  int input_sample_rate;
+  int L;
+  int M;
+  int taps;
+  int zeros;
+  float *bank;
+
+  int channels;
+  float **buffers;
+  int length;
+  int capacity;
+
+  int pos;
+  int phase;
+};
+
+static int is_supported_rate(int rate)
+{
+  for (int i = 0; i < sizeof(supported_rates) / sizeof(supported_rates[0]); i++)
+    {
+      if (supported_rates[i] == rate) {
+	return 1;
+      }
+    }
+
+  return 0;
+}
+
+static double blackman(double x)
+{
+  return fabs(x) >= 1 ? 0 : 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+}
+
+static void build_bank(polyphase_resampler *this)
+{
+  double cutoff = FFMIN(1.0, (double) this->L / this->M) * CUTOFF_MARGIN;
+
+  this->bank = av_malloc(sizeof(float) * this->L * this->taps);
+
+  for (int p = 0; p < this->L; p++)
+    {
+      float *row = this->bank + p * this->taps;
+      double sum = 0;
+
+      for (int j = 0; j < this->taps; j++)
+	{
+	  double x = j - this->zeros - (double) p / this->L;
+	  double sinc = x == 0 ? 1 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+
+	  row[j] = cutoff * sinc * blackman(x / (this->taps / 2));
+	  sum += row[j];
+	}
+
+      // Unity gain at DC for every phase
+      for (int j = 0; j < this->taps; j++)
+	{
+	  row[j] /= sum;
+	}
+    }
+}
+
+static void reset(polyphase_resampler *this)
+{
+  for (int c = 0; c < this->channels; c++)
+    {
+      memset(this->buffers[c], 0, sizeof(float) * this->zeros);
+    }
+
+  this->length = this->zeros;
+  this->pos = 0;
+  this->phase = 0;
+}
+
+static void reserve(polyphase_resampler *this, int length)
+{
+  if (length <= this->capacity) {
+    return;
+  }
+
+  this->capacity = length * 2;
+
+  for (int c = 0; c < this->channels; c++)
+    {
+      this->buffers[c] = av_realloc(this->buffers[c], sizeof(float) * this->capacity);
+    }
+}
+
+// NULL unless both rates are ones we have a fast path for
+polyphase_resampler *allocate_polyphase_resampler(int input_sample_rate, int output_sample_rate, int channels, int taps)
+{
+  if (input_sample_rate == output_sample_rate || !is_supported_rate(input_sample_rate) || !is_supported_rate(output_sample_rate)) {
+    return NULL;
+  }
+
+  polyphase_resampler *this = av_mallocz(sizeof(polyphase_resampler));
+  int gcd = av_gcd(input_sample_rate, output_sample_rate);
+
+  this->input_sample_rate = input_sample_rate;
+  this->L = output_sample_rate / gcd;
+  this->M = input_sample_rate / gcd;
+  this->taps = taps;
+  this->zeros = taps / 2 - 1;
+  this->channels = channels;
+  this->buffers = av_mallocz(sizeof(float *) * channels);
+
+  build_bank(this);
+  reserve(this, taps * 4);
+  reset(this);
+
+  return this;
+}
+
+void free_polyphase_resampler(polyphase_resampler **resampler)
+{
+  polyphase_resampler *this = *resampler;
+
+  if (!this) {
+    return;
+  }
+
+  for (int c = 0; c < this->channels; c++)
+    {
+      av_free(this->buffers[c]);
+    }
+
+  av_free(this->buffers);
+  av_free(this->bank);
+  av_freep(resampler);
+}
+
+// An upper bound on the output from nb_samples more input (0 for a drain)
+int polyphase_max_output(polyphase_resampler *this, int nb_samples)
+{
+  int length = this->length + (nb_samples ? nb_samples : this->taps / 2);
+  int64_t steps = (int64_t) (length - this->taps - this->pos + 1) * this->L - this->phase;
+
+  return steps > 0 ? steps / this->M + 1 : 0;
+}
+
+// Where the next output sample falls relative to the next input sample -
+// zero or negative, in units of *time_base
+int64_t polyphase_next_output(polyphase_resampler *this, AVRational *time_base)
+{
+  *time_base = (AVRational){1, this->input_sample_rate * this->L};
+
+  return (int64_t) (this->pos + this->zeros - this->length) * this->L + this->phase;
+}
+
+// in of NULL drains what is buffered and leaves the resampler ready to start
+// again from silence
+int polyphase_resample(polyphase_resampler *this, const float **in, int nb_samples, float **out, int max_out)
+{
+  int append = in ? nb_samples : this->taps / 2;
+  int produced = 0;
+  int pos = this->pos;
+  int phase = this->phase;
+
+  reserve(this, this->length + append);
+
+  for (int c = 0; c < this->channels; c++)
+    {
+      if (in) {
+	memcpy(this->buffers[c] + this->length, in[c], sizeof(float) * append);
+      }
+      else {
+	memset(this->buffers[c] + this->length, 0, sizeof(float) * append);
+      }
+    }
+
+  this->length += append;
+
+  // Every channel steps through the same positions
+  for (int c = 0; c < this->channels; c++)
+    {
+      pos = this->pos;
+      phase = this->phase;
+      produced = polyphase_filter(this->buffers[c], this->length, out[c], this->bank, this->taps,
+				  this->L, this->M, &pos, &phase, max_out);
+    }
+
+  if (!in) {
+    reset(this);
+    return produced;
+  }
+
+  for (int c = 0; c < this->channels; c++)
+    {
+      memmove(this->buffers[c], this->buffers[c] + pos, sizeof(float) * (this->length - pos));
+    }
+
+  this->length -= pos;
+  this->pos = 0;
+  this->phase = phase;
+
+  return produced;
+}
@@ -0,0 +1,145 @@
+#include "id3as_libav.h"
+#include <pthread.h>
+#include <libavutil/cpu.h>
+
+// A fixed set of worker threads for splitting one frame's work into
+// slices.  run_slices hands every thread the same function and argument,
+// runs slice 0 on the calling thread and returns once all slices are done.
+
+typedef struct _slice_worker
+{
+  slice_threads *pool;
+  int index;
+  pthread_t thread;
+
+} slice_worker;
+
+struct _slice_threads
+{
+  int nb_threads;
+  slice_worker *workers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+
+  int generation;
+  int pending;
+  int exit_threads;
+
+  slice_fun fun;
+  void *arg;
+};
+
+static void *worker_proc(void *data)
+{
+  slice_worker *worker = data;
+  slice_threads *this = worker->pool;
+  int seen = 0;
+
+  pthread_mutex_lock(&this->mutex);
+
+  while (1)
+    {
+      while (this->generation == seen && !this->exit_threads) {
+	pthread_cond_wait(&this->start, &this->mutex);
+      }
+
+      if (this->exit_threads) {
+	break;
+      }
+
+      seen = this->generation;
+
+      pthread_mutex_unlock(&this->mutex);
+
+      this->fun(this->arg, worker->index, this->nb_threads);
+
+      pthread_mutex_lock(&this->mutex);
+
+      if (--this->pending == 0) {
+	pthread_cond_signal(&this->done);
+      }
+    }
+
+  pthread_mutex_unlock(&this->mutex);
+
+  return NULL;
+}
+
+// nb_threads of 0 means one per CPU
+slice_threads *allocate_slice_threads(int nb_threads)
+{
+  slice_threads *this = av_mallocz(sizeof(slice_threads));
+
+  this->nb_threads = nb_threads > 0 ? nb_threads : av_cpu_count();
+  this->workers = av_mallocz(sizeof(slice_worker) * this->nb_threads);
+
+  pthread_mutex_init(&this->mutex, NULL);
+  pthread_cond_init(&this->start, NULL);
+  pthread_cond_init(&this->done, NULL);
+
+  for (int i = 1; i < this->nb_threads; i++)
+    {
+      this->workers[i].pool = this;
+      this->workers[i].index = i;
+      pthread_create(&this->workers[i].thread, NULL, worker_proc, &this->workers[i]);
+    }
+
+  return this;
+}
+
+void free_slice_threads(slice_threads **threads)
+{
+  slice_threads *this = *threads;
+
+  if (!this) {
+    return;
+  }
+
+  pthread_mutex_lock(&this->mutex);
+  this->exit_threads = 1;
+  pthread_cond_broadcast(&this->start);
+  pthread_mutex_unlock(&this->mutex);
+
+  for (int i = 1; i < this->nb_threads; i++)
+    {
+      pthread_join(this->workers[i].thread, NULL);
+    }
+
+  pthread_mutex_destroy(&this->mutex);
+  pthread_cond_destroy(&this->start);
+  pthread_cond_destroy(&this->done);
+
+  av_free(this->workers);
+  av_freep(threads);
+}
+
+int slice_thread_count(slice_threads *this)
+{
+  return this->nb_threads;
+}
+
+void run_slices(slice_threads *this, slice_fun fun, void *arg)
+{
+  if (this->nb_threads == 1) {
+    fun(arg, 0, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&this->mutex);
+  this->fun = fun;
+  this->arg = arg;
+  this->pending = this->nb_threads - 1;
+  this->generation++;
+  pthread_cond_broadcast(&this->start);
+  pthread_mutex_unlock(&this->mutex);
+
+  fun(arg, 0, this->nb_threads);
+
+  pthread_mutex_lock(&this->mutex);
+  while (this->pending > 0) {
+    pthread_cond_wait(&this->done, &this->mutex);
+  }
+  pthread_mutex_unlock(&this->mutex);
+}
@@ -1,7 +1,5 @@
 #include "id3as_libav.h"
 
-#define MAX_AUDIO_SAMPLES 192000 // 1 second of 192khz
-
 enum SplitMode {
   LEFT_ONLY,
   RIGHT_ONLY,
@@ -27,10 +25,10 @@ typedef struct _codec_t
 
 } codec_t;
 
-static void split_fltp_stereo(AVFrame *src, AVFrame *left, AVFrame *right);
-static void split_fltp_mono(AVFrame *src, AVFrame *left, AVFrame *right);
+static void split_planar_stereo(AVFrame *src, AVFrame *left, AVFrame *right);
+static void split_planar_mono(AVFrame *src, AVFrame *left, AVFrame *right);
 
-static void process(ID3ASFilterContext *context, AVFrame *frame)
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
 {
   codec_t *this = context->priv_data;
 
@@ -43,23 +41,26 @@ static void process(ID3ASFilterContext *context, AVFrame *frame)
     {
     case LEFT_ONLY:
       for (int i = 0; i < context->num_downstream_filters; i++) {
-	context->downstream_filters[i]->filter->execute(context->downstream_filters[i], this->left_frame);
+	send_to_filter(context->downstream_filters[i], this->left_frame, timebase);
       }
       break;
     case RIGHT_ONLY:
       for (int i = 0; i < context->num_downstream_filters; i++) {
-	context->downstream_filters[i]->filter->execute(context->downstream_filters[i], this->right_frame);
+	send_to_filter(context->downstream_filters[i], this->right_frame, timebase);
       }
       break;
     case LEFT_RIGHT:
       for (int i = 0; i < context->num_downstream_filters / 2; i++) {
-	context->downstream_filters[i]->filter->execute(context->downstream_filters[i], this->left_frame);
+	send_to_filter(context->downstream_filters[i], this->left_frame, timebase);
       }
       for (int i = context->num_downstream_filters / 2; i < context->num_downstream_filters; i++) {
-	context->downstream_filters[i]->filter->execute(context->downstream_filters[i], this->right_frame);
+	send_to_filter(context->downstream_filters[i], this->right_frame, timebase);
       }
       break;
     }
+
+  av_frame_unref(this->left_frame);
+  av_frame_unref(this->right_frame);
 }
 
 static void flush(ID3ASFilterContext *context) 
@@ -67,101 +68,84 @@ static void flush(ID3ASFilterContext *context)
   flush_graph(context);
 }
 
-static void init(ID3ASFilterContext *context, AVDictionary *codec_options) 
+static int parse_split_mode(char *split_mode)
 {
-  codec_t *this = (codec_t *) context->priv_data;
+  if (strcmp(split_mode, "left_only") == 0) {
+    return LEFT_ONLY;
+  } 
+  else if (strcmp(split_mode, "right_only") == 0) {
+    return RIGHT_ONLY;
+  }
+  else if (strcmp(split_mode, "left_right") == 0) {
+    return LEFT_RIGHT;
+  } 
+
+  return -1;
+}
+
+// Everything init relies on, checked while the graph is built
+static int validate(void *priv_data, int num_downstream_filters, graph_error *error)
+{
+  codec_t *this = priv_data;
+  int split_mode = parse_split_mode(this->split_mode);
 
   if ((this->channel_layout != AV_CH_LAYOUT_STEREO) && (this->channel_layout != AV_CH_LAYOUT_MONO)) {
-    ERRORFMT("Invalid channel layout %d - can only do mono or stereo\n", this->channel_layout);
-    exit(1);
+    return validation_error(error, "invalid channel layout %d - can only do mono or stereo", this->channel_layout);
   }
 
+  if (split_mode < 0) {
+    return validation_error(error, "invalid split mode %s", this->split_mode);
+  }
+
+  if (!av_sample_fmt_is_planar(this->sample_format)) {
+    return validation_error(error, "unsupported format %d - use the channel splitter for packed audio", this->sample_format);
+  }
+
+  return 0;
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options) 
+{
+  codec_t *this = (codec_t *) context->priv_data;
+
   this->num_channels = av_get_channel_layout_nb_channels(this->channel_layout);
   this->bytes_per_sample = this->num_channels * av_get_bytes_per_sample(this->sample_format);
 
+  // No buffers of our own - the outputs reference the input's planes
   this->left_frame = av_frame_alloc();
-  this->left_frame->format = this->sample_format;
-  this->left_frame->channel_layout = AV_CH_LAYOUT_MONO;
-  this->left_frame->nb_samples = MAX_AUDIO_SAMPLES;
-  av_frame_get_buffer(this->left_frame, 32);
-
   this->right_frame = av_frame_alloc();
-  this->right_frame->format = this->sample_format;
-  this->right_frame->channel_layout = AV_CH_LAYOUT_MONO;
-  this->left_frame->nb_samples = MAX_AUDIO_SAMPLES;
-  av_frame_get_buffer(this->right_frame, 32);
 
-  if (strcmp(this->split_mode, "left_only") == 0) {
-    this->split_mode_enum = LEFT_ONLY;
-  } 
-  else if (strcmp(this->split_mode, "right_only") == 0) {
-    this->split_mode_enum = RIGHT_ONLY;
-  }
-  else if (strcmp(this->split_mode, "left_right") == 0) {
-    this->split_mode_enum = LEFT_RIGHT;
-  } 
-  else {
-    ERRORFMT("Invalid split mode %s\n", this->split_mode);
-    exit(1);
-  }
+  this->split_mode_enum = parse_split_mode(this->split_mode);
 
-  switch (this->sample_format) 
+  switch (this->channel_layout)
     {
-    case AV_SAMPLE_FMT_FLTP:
-      switch (this->channel_layout)
-        {
-        case AV_CH_LAYOUT_MONO:
-          this->convert_fun = split_fltp_mono;
-          break;
-        case AV_CH_LAYOUT_STEREO:
-          this->convert_fun = split_fltp_stereo;
-          break;
-        }
+    case AV_CH_LAYOUT_MONO:
+      this->convert_fun = split_planar_mono;
       break;
-
-    default:
-      ERRORFMT("Unsupported format for stereo split: %d\n", this->sample_format);
-      exit(1);
+    case AV_CH_LAYOUT_STEREO:
+      this->convert_fun = split_planar_stereo;
       break;
     }
 }
 
-static void split_fltp_mono(AVFrame *src, AVFrame *left, AVFrame *right) {
-
-  left->data[0] = src->data[0];
-  left->linesize[0] = src->linesize[0];
-  left->nb_samples = src->nb_samples;
-  left->sample_rate = src->sample_rate;
-  left->pts = src->pts;
-  left->pkt_pts = src->pkt_pts;
-  left->pkt_dts = src->pkt_dts;
-
-  right->data[0] = src->data[0];
-  right->linesize[0] = src->linesize[0];
-  right->nb_samples = src->nb_samples;
-  right->sample_rate = src->sample_rate;
-  right->pts = src->pts;
-  right->pkt_pts = src->pkt_pts;
-  right->pkt_dts = src->pkt_dts;
+static void split_planar_mono(AVFrame *src, AVFrame *left, AVFrame *right) {
+
+  select_planar_channel(src, left, 0);
+  select_planar_channel(src, right, 0);
+}
+
+static void split_planar_stereo(AVFrame *src, AVFrame *left, AVFrame *right) {
+
+  select_planar_channel(src, left, 0);
+  select_planar_channel(src, right, 1);
 }
 
-static void split_fltp_stereo(AVFrame *src, AVFrame *left, AVFrame *right) {
-
-  left->data[0] = src->data[0];
-  left->linesize[0] = src->linesize[0];
-  left->nb_samples = src->nb_samples;
-  left->sample_rate = src->sample_rate;
-  left->pts = src->pts;
-  left->pkt_pts = src->pkt_pts;
-  left->pkt_dts = src->pkt_dts;
-
-  right->data[0] = src->data[1];
-  right->linesize[0] = src->linesize[1];
-  right->nb_samples = src->nb_samples;
-  right->sample_rate = src->sample_rate;
-  right->pts = src->pts;
-  right->pkt_pts = src->pkt_pts;
-  right->pkt_dts = src->pkt_dts;
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  av_frame_free(&this->left_frame);
+  av_frame_free(&this->right_frame);
 }
 
 static const AVOption options[] = {
@@ -179,11 +163,17 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "sample_format", "channel_layout", "split_mode", NULL };
+
 ID3ASFilter id3as_stereo_splitter_filter = {
   .name = "stereo splitter",
   .init = init,
   .execute = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_AUDIO,
+  .required_options = required_options,
+  .validate = validate
 };
@@ -29,19 +29,14 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
 
   do_init(this, frame);
 
-  uint8_t *p = frame->data[0];
-  int i, j;
+  luma_stats *stats = get_luma_stats(frame);
   int pblack = 0;
   int nblack = 0;
   int is_black;
 
-  for (i = 0; i < frame->height; i++)
+  for (int i = 0; i < FFMIN(this->threshold, 256); i++)
     {
-      for (j = 0; j < frame->width; j++)
-	{
-	  nblack += p[j] < this->threshold;
-	}
-      p += frame->linesize[0];
+      nblack += stats->histogram[i];
     }
 
   pblack = nblack * 100 / (frame->width * frame->height);
@@ -122,11 +117,15 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "frame_rate", NULL };
+
 ID3ASFilter id3as_black_detect_filter = {
   .name = "black detect",
   .init = init,
   .execute = process,
   .flush = flush,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .required_options = required_options
 };
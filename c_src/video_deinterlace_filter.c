@@ -0,0 +1,267 @@
+#include "id3as_libav.h"
+
+// Deinterlaces 8-bit planar YUV.  weave just marks the frame progressive,
+// bob interpolates the missing field from the lines either side, and
+// adaptive keeps the missing field's lines where they haven't moved since
+// the previous frame and interpolates them where they have.
+//
+// At field rate each frame becomes two, the second half way to the next
+// frame's pts, so frames are held back by one to learn that pts.  Output
+// frames come from a pool, except that bob at frame rate works in place
+// when nothing else holds the frame.
+
+enum DeinterlaceMode {
+  DEINTERLACE_WEAVE,
+  DEINTERLACE_BOB,
+  DEINTERLACE_ADAPTIVE
+};
+
+enum FieldParity {
+  PARITY_AUTO = -1,
+  PARITY_TFF,
+  PARITY_BFF
+};
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  enum DeinterlaceMode mode;
+  int field_rate;
+  enum FieldParity parity;
+  int threshold;
+  int threads;
+
+  int chroma_w;
+  int chroma_h;
+
+  slice_threads *slice_threads;
+  AVBufferPool *pool;
+  int pool_size;
+
+  AVFrame *prev;
+  AVFrame *cur;
+  int64_t last_duration;
+  AVRational timebase;
+
+} codec_t;
+
+typedef struct _slice_job
+{
+  codec_t *this;
+  AVFrame *out;
+  AVFrame *cur;
+  AVFrame *prev;
+  int keep_top;
+
+} slice_job;
+
+static void deinterlace_plane(codec_t *this, slice_job *job, int plane, int slice, int nb_slices)
+{
+  int shift_w = plane ? this->chroma_w : 0;
+  int shift_h = plane ? this->chroma_h : 0;
+  int width = (job->cur->width + (1 << shift_w) - 1) >> shift_w;
+  int height = (job->cur->height + (1 << shift_h) - 1) >> shift_h;
+  int start = height * slice / nb_slices;
+  int end = height * (slice + 1) / nb_slices;
+  int cur_linesize = job->cur->linesize[plane];
+  int out_linesize = job->out->linesize[plane];
+  uint8_t *cur = job->cur->data[plane];
+  uint8_t *out = job->out->data[plane];
+
+  for (int y = start; y < end; y++)
+    {
+      uint8_t *dst = out + y * out_linesize;
+      uint8_t *src = cur + y * cur_linesize;
+
+      if ((y & 1) == !job->keep_top)
+	{
+	  if (dst != src) {
+	    memcpy(dst, src, width);
+	  }
+	  continue;
+	}
+
+      // The kept field's lines either side, reflected at the edges
+      int above = y > 0 ? y - 1 : y + 1;
+      int below = y < height - 1 ? y + 1 : y - 1;
+
+      if (job->prev && this->mode == DEINTERLACE_ADAPTIVE) {
+	motion_adaptive_line(dst, cur + above * cur_linesize, cur + below * cur_linesize, src,
+			     job->prev->data[plane] + y * job->prev->linesize[plane], width, this->threshold);
+      }
+      else {
+	interpolate_line(dst, cur + above * cur_linesize, cur + below * cur_linesize, width);
+      }
+    }
+}
+
+static void deinterlace_slice(void *arg, int slice, int nb_slices)
+{
+  slice_job *job = arg;
+
+  for (int plane = 0; plane < 4 && job->cur->data[plane]; plane++)
+    {
+      deinterlace_plane(job->this, job, plane, slice, nb_slices);
+    }
+}
+
+static void send_field(ID3ASFilterContext *context, AVFrame *cur, int keep_top, int64_t pts)
+{
+  codec_t *this = context->priv_data;
+  slice_job job = { .this = this, .cur = cur, .prev = this->prev, .keep_top = keep_top };
+  int in_place = !this->field_rate && this->mode == DEINTERLACE_BOB && av_frame_is_writable(cur);
+
+  if (in_place) {
+    job.out = cur;
+  }
+  else {
+    job.out = av_frame_alloc();
+    job.out->format = cur->format;
+    job.out->width = cur->width;
+    job.out->height = cur->height;
+
+    get_pooled_video_buffer(job.out, &this->pool, &this->pool_size);
+    av_frame_copy_props(job.out, cur);
+  }
+
+  run_slices(this->slice_threads, deinterlace_slice, &job);
+
+  job.out->pts = pts;
+  job.out->interlaced_frame = 0;
+  drop_luma_stats(job.out);
+
+  send_to_graph(context, job.out, this->timebase);
+
+  if (!in_place) {
+    av_frame_free(&job.out);
+  }
+}
+
+static void send_frame(ID3ASFilterContext *context, int64_t duration)
+{
+  codec_t *this = context->priv_data;
+  AVFrame *cur = this->cur;
+  int tff = this->parity == PARITY_AUTO ? cur->top_field_first : this->parity == PARITY_TFF;
+
+  if (!cur->interlaced_frame && this->parity == PARITY_AUTO) {
+    send_to_graph(context, cur, this->timebase);
+    return;
+  }
+
+  send_field(context, cur, tff, cur->pts);
+
+  if (this->field_rate) {
+    send_field(context, cur, !tff, cur->pts + duration / 2);
+  }
+}
+
+static void check_format(codec_t *this, AVFrame *frame)
+{
+  switch (frame->format) {
+  case PIX_FMT_YUV420P:
+  case PIX_FMT_YUV422P:
+  case PIX_FMT_YUV444P:
+  case PIX_FMT_YUVJ420P:
+  case PIX_FMT_YUVJ422P:
+  case PIX_FMT_YUVJ444P:
+  case PIX_FMT_GRAY8:
+    av_pix_fmt_get_chroma_sub_sample(frame->format, &this->chroma_w, &this->chroma_h);
+    break;
+
+  default:
+    ERRORFMT("Unsupported pixel format for deinterlacing: %d\n", frame->format);
+    exit(1);
+  }
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+
+  if (this->mode == DEINTERLACE_WEAVE) {
+    frame->interlaced_frame = 0;
+    send_to_graph(context, frame, timebase);
+    return;
+  }
+
+  this->timebase = timebase;
+
+  check_format(this, frame);
+
+  if (this->cur)
+    {
+      this->last_duration = frame->pts - this->cur->pts;
+
+      send_frame(context, this->last_duration);
+
+      av_frame_free(&this->prev);
+      this->prev = this->cur;
+    }
+
+  this->cur = av_frame_clone(frame);
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  if (this->cur) {
+    send_frame(context, this->last_duration);
+  }
+
+  av_frame_free(&this->prev);
+  av_frame_free(&this->cur);
+
+  flush_graph(context);
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->slice_threads = allocate_slice_threads(this->threads);
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free_slice_threads(&this->slice_threads);
+  av_frame_free(&this->prev);
+  av_frame_free(&this->cur);
+  av_buffer_pool_uninit(&this->pool);
+}
+
+static const AVOption options[] = {
+  { "mode", "how to deinterlace", offsetof(codec_t, mode), AV_OPT_TYPE_INT, { .i64 = DEINTERLACE_ADAPTIVE }, DEINTERLACE_WEAVE, DEINTERLACE_ADAPTIVE, 0, "mode" },
+  { "weave", "leave the fields together", 0, AV_OPT_TYPE_CONST, { .i64 = DEINTERLACE_WEAVE }, 0, 0, 0, "mode" },
+  { "bob", "interpolate the missing field", 0, AV_OPT_TYPE_CONST, { .i64 = DEINTERLACE_BOB }, 0, 0, 0, "mode" },
+  { "adaptive", "interpolate only where there is motion", 0, AV_OPT_TYPE_CONST, { .i64 = DEINTERLACE_ADAPTIVE }, 0, 0, 0, "mode" },
+  { "field_rate", "output a frame per field", offsetof(codec_t, field_rate), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 1 },
+  { "parity", "field order", offsetof(codec_t, parity), AV_OPT_TYPE_INT, { .i64 = PARITY_AUTO }, PARITY_AUTO, PARITY_BFF, 0, "parity" },
+  { "auto", "from the frame, and only frames marked interlaced", 0, AV_OPT_TYPE_CONST, { .i64 = PARITY_AUTO }, 0, 0, 0, "parity" },
+  { "tff", "top field first", 0, AV_OPT_TYPE_CONST, { .i64 = PARITY_TFF }, 0, 0, 0, "parity" },
+  { "bff", "bottom field first", 0, AV_OPT_TYPE_CONST, { .i64 = PARITY_BFF }, 0, 0, 0, "parity" },
+  { "threshold", "motion threshold for adaptive mode", offsetof(codec_t, threshold), AV_OPT_TYPE_INT, { .i64 = 10 }, 0, 255 },
+  { "threads", "slice threads, 0 for one per CPU", offsetof(codec_t, threads), AV_OPT_TYPE_INT, { .i64 = 1 }, 0, 64 },
+  { NULL }
+};
+
+static const AVClass class = {
+  .class_name = "video deinterlacer options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+ID3ASFilter id3as_deinterlace_video_filter = {
+  .name = "video deinterlacer",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO
+};
@@ -1,14 +1,28 @@
 #include "id3as_libav.h"
 
+enum DecodeMode {
+  DECODE_ALL,
+  DECODE_REFERENCE,
+  DECODE_KEYFRAMES
+};
+
 typedef struct _codec_t
 {
   AVClass *av_class;
 
   AVCodec *codec;
   AVCodecContext *context;
+  AVCodecParserContext *parser;
   AVFrame *frame;
   frame_info_queue *frame_info_queue;
 
+  enum DecodeMode decode_mode;
+
+  int attach_packets;
+  unsigned char *packets;
+  int packets_size;
+  int packets_capacity;
+
   int width;
   int height;
   char *codec_name;
@@ -36,6 +50,12 @@ static int decode(ID3ASFilterContext *context, AVPacket *pkt)
 
       add_frame_info_to_frame(this->frame_info_queue, this->frame);
 
+      if (this->packets_size > 0) {
+	AVFrameSideData *side_data = av_frame_new_side_data(this->frame, PACKETS_SIDE_DATA_TYPE, this->packets_size);
+	memcpy(side_data->data, this->packets, this->packets_size);
+	this->packets_size = 0;
+      }
+
       this->frame->pts = this->frame->pkt_pts;
 
       send_to_graph(context, this->frame, NINETY_KHZ);
@@ -46,6 +66,114 @@ static int decode(ID3ASFilterContext *context, AVPacket *pkt)
   return got_frame;
 }
 
+// Keeps a copy of every packet until the next decoded frame, which then
+// carries them to any passthrough output.  Frames come out in presentation
+// order, so a frame can carry packets other than its own.  With
+// decode_mode=keyframes that means a passthrough output runs up to a GOP
+// behind the input; whatever is left at flush goes out on a frame with no
+// picture (see send_packets_frame).
+static void attach_packet(codec_t *this, AVPacket *pkt, unsigned char *frame_info, unsigned int frame_info_size)
+{
+  int record_size = PACKET_RECORD_SIZE(frame_info_size, pkt->size);
+
+  if (this->packets_size + record_size > this->packets_capacity) {
+    this->packets_capacity = (this->packets_size + record_size) * 2;
+    this->packets = realloc(this->packets, this->packets_capacity);
+  }
+
+  packet_record *record = (packet_record *) (this->packets + this->packets_size);
+
+  record->pts = pkt->pts;
+  record->dts = pkt->dts;
+  record->frame_info_size = frame_info_size;
+  record->data_size = pkt->size;
+  memcpy(record->buffer, frame_info, frame_info_size);
+  memcpy(record->buffer + frame_info_size, pkt->data, pkt->size);
+
+  this->packets_size += record_size;
+}
+
+// Codecs whose B pictures are never used as references
+static int has_disposable_b_frames(enum AVCodecID codec_id)
+{
+  switch (codec_id) {
+  case AV_CODEC_ID_MPEG1VIDEO:
+  case AV_CODEC_ID_MPEG2VIDEO:
+  case AV_CODEC_ID_MPEG4:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// nal_ref_idc of the first slice in an Annex B H.264 packet - zero means
+// no other picture refers to this one.  -1 when there's no start code to
+// find (e.g. length prefixed avcC packets).
+static int h264_nal_ref_idc(AVPacket *pkt)
+{
+  uint8_t *p = pkt->data;
+  uint8_t *end = pkt->data + pkt->size;
+
+  while (end - p > 3)
+    {
+      if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+	int nal_unit_type = p[3] & 0x1f;
+
+	if (nal_unit_type == 1 || nal_unit_type == 5) {
+	  return (p[3] >> 5) & 3;
+	}
+
+	p += 3;
+      }
+      else {
+	p++;
+      }
+    }
+
+  return -1;
+}
+
+// Packets that can be thrown away without even reaching the decoder:
+//
+//  - keyframes: anything the parser doesn't report as an I picture.  This
+//    keeps the non-IDR I frames that start an open GOP, which key_frame
+//    would lose.  Parsers that don't know the type report I.
+//  - reference: H.264 slices with a nal_ref_idc of zero, and B pictures
+//    for codecs where those are never references.  H.264 B pictures can
+//    be references (B pyramids), so the slice header is the only safe test.
+//
+// Anything that can't be decided on here is decoded, and skip_frame deals
+// with it there.
+static int is_skippable(codec_t *this, AVPacket *pkt)
+{
+  uint8_t *out;
+  int out_size;
+
+  if (this->decode_mode == DECODE_REFERENCE && this->codec->id == AV_CODEC_ID_H264) {
+    return h264_nal_ref_idc(pkt) == 0;
+  }
+
+  if (!this->parser) {
+    return 0;
+  }
+
+  av_parser_parse2(this->parser, this->context, &out, &out_size,
+		   pkt->data, pkt->size, pkt->pts, pkt->dts, 0);
+
+  if (this->decode_mode == DECODE_KEYFRAMES) {
+    return this->parser->pict_type != AV_PICTURE_TYPE_I;
+  }
+
+  return this->parser->pict_type == AV_PICTURE_TYPE_B;
+}
+
+static void open_parser(codec_t *this)
+{
+  if ((this->parser = av_parser_init(this->codec->id))) {
+    this->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+  }
+}
+
 static void process(ID3ASFilterContext *context,
 		    unsigned char *metadata, unsigned int metadata_size, 
 		    unsigned char *frame_info, unsigned int frame_info_size, 
@@ -59,12 +187,40 @@ static void process(ID3ASFilterContext *context,
   pkt.size = data_size;
 
   set_packet_metadata(&pkt, metadata);
+
+  if (this->attach_packets) {
+    attach_packet(this, &pkt, frame_info, frame_info_size);
+  }
+
+  // No frame will come out for this packet, so don't queue its frame_info
+  if (is_skippable(this, &pkt)) {
+    return;
+  }
   
   queue_frame_info(this->frame_info_queue, frame_info, frame_info_size, pkt.pts);
 
   decode(context, &pkt);
 }
 
+// Carries the packets no decoded frame will now pick up.  send_to_filter
+// takes it past everything but passthrough outputs (and the async parallel
+// filter, so it stays in order with the frames before it).
+static void send_packets_frame(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+  AVFrame *frame = av_frame_alloc();
+
+  frame->pts = AV_NOPTS_VALUE;
+
+  AVFrameSideData *side_data = av_frame_new_side_data(frame, PACKETS_SIDE_DATA_TYPE, this->packets_size);
+  memcpy(side_data->data, this->packets, this->packets_size);
+  this->packets_size = 0;
+
+  send_to_graph(context, frame, NINETY_KHZ);
+
+  av_frame_free(&frame);
+}
+
 static void flush(ID3ASFilterContext *context) 
 {
   codec_t *this = context->priv_data;
@@ -84,6 +240,10 @@ static void flush(ID3ASFilterContext *context)
 	  }
 	}
     }
+
+  if (this->packets_size > 0) {
+    send_packets_frame(context);
+  }
   
   flush_graph(context);
 }
@@ -104,16 +264,57 @@ static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
 
   this->context = allocate_video_context(this->codec, this->width, this->height, this->pixfmt, extradata, extradata_size, codec_options);
 
+  // Frames skipped inside the decoder leave their frame_info behind; it is
+  // dropped by get_frame_info when the next frame comes out
+  switch (this->decode_mode) {
+  case DECODE_REFERENCE:
+    this->context->skip_frame = AVDISCARD_NONREF;
+    this->context->skip_loop_filter = AVDISCARD_NONREF;
+
+    if (has_disposable_b_frames(this->codec->id)) {
+      open_parser(this);
+    }
+    break;
+
+  case DECODE_KEYFRAMES:
+    this->context->skip_frame = AVDISCARD_NONKEY;
+    this->context->skip_loop_filter = AVDISCARD_ALL;
+    open_parser(this);
+    break;
+
+  default:
+    break;
+  }
+
   this->frame = av_frame_alloc();
   init_frame_info_queue(&this->frame_info_queue);
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  if (this->parser) {
+    av_parser_close(this->parser);
+  }
+
+  free_codec_context(&this->context);
+  free_frame_info_queue(&this->frame_info_queue);
+  av_frame_free(&this->frame);
+  free(this->packets);
+}
+
 static const AVOption options[] = {
   { "width", "the width", offsetof(codec_t, width), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "height", "the height", offsetof(codec_t, height), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "pixel_format", "the pixel format", offsetof(codec_t, pixfmt), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "codec", "the codec name", offsetof(codec_t, codec_name), AV_OPT_TYPE_STRING },
   { "extradata", "codec extradata", offsetof(codec_t, extradata), AV_OPT_TYPE_STRING, {.str = NULL} },
+  { "attach_packets", "carry the compressed packets for passthrough outputs", offsetof(codec_t, attach_packets), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 1 },
+  { "decode_mode", "which frames to decode", offsetof(codec_t, decode_mode), AV_OPT_TYPE_INT, { .i64 = DECODE_ALL }, DECODE_ALL, DECODE_KEYFRAMES, 0, "decode_mode" },
+  { "all", "every frame", 0, AV_OPT_TYPE_CONST, { .i64 = DECODE_ALL }, 0, 0, 0, "decode_mode" },
+  { "reference", "reference frames only", 0, AV_OPT_TYPE_CONST, { .i64 = DECODE_REFERENCE }, 0, 0, 0, "decode_mode" },
+  { "keyframes", "keyframes only", 0, AV_OPT_TYPE_CONST, { .i64 = DECODE_KEYFRAMES }, 0, 0, 0, "decode_mode" },
   { NULL }
 };
 
@@ -124,11 +325,17 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "codec", "width", "height", "pixel_format", NULL };
+
 ID3ASFilter id3as_encoded_video_input = {
   .name = "encoded video input",
   .init = init,
-  .execute = process,
+  .execute_input = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .required_options = required_options,
+  .codec_option = CODEC_OPTION_DECODER
 };
@@ -20,9 +20,17 @@ typedef struct _codec_t
   char *pin_name;
   char *codec_name;
   enum PixelFormat input_pixfmt;
+  enum ExtradataMode extradata_mode;
+  output_header *header;
+  int scene_keyframes;
 
   int have_encoded_frames;
 
+  // Codec options from reconfigure that need the encoder reopened, held
+  // until the frame that would start the next GOP anyway
+  AVDictionary *pending_codec_options;
+  int frames_since_keyframe;
+
 } codec_t;
 
 static i_mutex_t mutex = INITIALISE_STATIC_MUTEX();
@@ -53,7 +61,7 @@ static int encode(ID3ASFilterContext *context, AVFrame *frame, AVPacket *pkt)
       pkt->dts = av_rescale_q(pkt->dts, this->context->time_base, NINETY_KHZ);
       pkt->duration = av_rescale_q(pkt->duration, this->context->time_base, NINETY_KHZ);
 
-      write_output_from_packet(this->pin_name, this->stream_id, this->context, pkt, frame_info);
+      write_output_from_packet(context->graph_id, this->header, this->pin_name, this->stream_id, this->context, pkt, frame_info);
 
       free(frame_info);
     }
@@ -61,12 +69,34 @@ static int encode(ID3ASFilterContext *context, AVFrame *frame, AVPacket *pkt)
   return got_packet_ptr;
 }
 
+static void reopen_encoder(ID3ASFilterContext *context);
+
+static int is_scene_cut(codec_t *this, AVFrame *frame)
+{
+  AVFrameSideData *side_data = av_frame_get_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE);
+
+  return this->scene_keyframes && side_data && (((frame_info *)side_data->data)->flags & SCENE_CHANGE);
+}
+
+// Whether the encoder would start a GOP with this frame; without a fixed
+// GOP length we can't tell, so any frame will do
+static int at_keyframe(codec_t *this, AVFrame *frame)
+{
+  return is_scene_cut(this, frame) ||
+    this->context->gop_size <= 0 ||
+    this->frames_since_keyframe >= this->context->gop_size;
+}
+
 static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
 {
   AVPacket pkt;
   codec_t *this = context->priv_data;
   AVFrame local_frame = *frame;
 
+  if (this->pending_codec_options && this->initialised && at_keyframe(this, frame)) {
+    reopen_encoder(context);
+  }
+
   do_init(this, frame);
 
   av_init_packet(&pkt);
@@ -77,9 +107,17 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
   local_frame.pts = av_rescale_q(local_frame.pts, timebase, this->context->time_base);
   local_frame.pict_type = 0;
 
+  // Cuts flagged by scene detect start a new GOP
+  if (is_scene_cut(this, frame)) {
+    local_frame.pict_type = AV_PICTURE_TYPE_I;
+    this->frames_since_keyframe = 0;
+  }
+
   queue_frame_info_from_frame(this->frame_info_queue, &local_frame);
 
   encode(context, &local_frame, &pkt);
+
+  this->frames_since_keyframe++;
 }
 
 static void flush(ID3ASFilterContext *context) 
@@ -113,7 +151,12 @@ static void do_init(codec_t *this, AVFrame *frame)
 
   this->codec = get_encoder(this->codec_name);
 
-  AVDictionaryEntry *flagsEntry = av_dict_get(this->codec_options, "flags", NULL, 0);
+  // allocate_video_context consumes its options, and we need ours again if
+  // the encoder is reconfigured
+  AVDictionary *codec_options = NULL;
+  av_dict_copy(&codec_options, this->codec_options, 0);
+
+  AVDictionaryEntry *flagsEntry = av_dict_get(codec_options, "flags", NULL, 0);
   char flags[255];
   strcpy(flags, flagsEntry ? flagsEntry-> value : "");
 
@@ -123,27 +166,105 @@ static void do_init(codec_t *this, AVFrame *frame)
   else {
     strcat(flags, "-ildct");
   }
-  av_dict_set(&this->codec_options, "flags", flags, 0);
+  av_dict_set(&codec_options, "flags", flags, 0);
 
+  free(this->pkt_buffer);
   this->pkt_size = frame->width * frame->height * 10;  // Should be sufficient space! TODO - bit ugly though :(
   this->pkt_buffer = malloc(this->pkt_size);
 
-  this->context = allocate_video_context(this->codec, frame->width, frame->height, this->input_pixfmt, NULL, 0, this->codec_options);
+  this->context = allocate_video_context(this->codec, frame->width, frame->height, this->input_pixfmt, NULL, 0, codec_options);
 
   this->have_encoded_frames = 0;
+  this->frames_since_keyframe = 0;
 
-  init_frame_info_queue(&this->frame_info_queue);
+  if (!this->frame_info_queue) {
+    init_frame_info_queue(&this->frame_info_queue);
+  }
 
   this->initialised = 1;
 
   i_mutex_unlock(&mutex);
 }
 
+// Drains and closes the current encoder; the next frame opens it again
+// with the options reconfigure has already merged in, starting with a
+// keyframe
+static void reopen_encoder(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  flush(context);
+
+  i_mutex_lock(&mutex);
+  free_codec_context(&this->context);
+  this->initialised = 0;
+  i_mutex_unlock(&mutex);
+
+  av_dict_free(&this->pending_codec_options);
+}
+
+// Rate control options an open encoder picks up between frames (libx264
+// checks them on every frame and reconfigures itself)
+static const char *runtime_options[] = { "b", "maxrate", "bufsize", "crf", NULL };
+
+static int is_runtime_option(const char *key)
+{
+  for (const char **p = runtime_options; *p; p++)
+    {
+      if (strcmp(*p, key) == 0) {
+	return 1;
+      }
+    }
+
+  return 0;
+}
+
+// Filter options apply from the next frame.  Rate control options are
+// set on the running encoder; anything else waits for the next keyframe,
+// when the encoder is reopened with it.  Every codec option is also kept
+// for any later reopen.
+static void reconfigure(ID3ASFilterContext *context, reconfiguration *change) 
+{
+  codec_t *this = context->priv_data;
+  AVDictionaryEntry *t = NULL;
+
+  av_opt_set_dict(this, &change->options);
+  av_dict_copy(&this->codec_options, change->codec_options, 0);
+
+  if (!this->initialised) {
+    return;
+  }
+
+  while ((t = av_dict_get(change->codec_options, "", t, AV_DICT_IGNORE_SUFFIX)))
+    {
+      if (!is_runtime_option(t->key) ||
+	  av_opt_set(this->context, t->key, t->value, AV_OPT_SEARCH_CHILDREN) < 0) {
+	av_dict_set(&this->pending_codec_options, t->key, t->value, 0);
+      }
+    }
+}
+
 static void init(ID3ASFilterContext *context, AVDictionary *codec_options) 
 {
   codec_t *this = context->priv_data;
   this->codec_options = codec_options;
   this->initialised = 0;
+  this->header = allocate_output_header(this->extradata_mode);
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  i_mutex_lock(&mutex);
+  free_codec_context(&this->context);
+  i_mutex_unlock(&mutex);
+
+  free_frame_info_queue(&this->frame_info_queue);
+  free_output_header(&this->header);
+  av_dict_free(&this->codec_options);
+  av_dict_free(&this->pending_codec_options);
+  free(this->pkt_buffer);
 }
 
 static const AVOption options[] = {
@@ -153,6 +274,11 @@ static const AVOption options[] = {
   { "width", "The width of the frame", offsetof(codec_t, width), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "height", "The height of the frame", offsetof(codec_t, height), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "pixel_format", "The pixel format", offsetof(codec_t, input_pixfmt), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "scene_keyframes", "force a keyframe on frames flagged as scene changes", offsetof(codec_t, scene_keyframes), AV_OPT_TYPE_INT, { .i64 = 1 }, 0, 1 },
+  { "extradata_mode", "when to send the codec extradata", offsetof(codec_t, extradata_mode), AV_OPT_TYPE_INT, { .i64 = EXTRADATA_ALWAYS }, EXTRADATA_ALWAYS, EXTRADATA_ON_KEYFRAME, 0, "extradata_mode" },
+  { "always", "with every frame", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ALWAYS }, 0, 0, 0, "extradata_mode" },
+  { "on_change", "with the first frame and when it changes", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ON_CHANGE }, 0, 0, 0, "extradata_mode" },
+  { "keyframes", "on change and with every keyframe", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ON_KEYFRAME }, 0, 0, 0, "extradata_mode" },
   { NULL },
 };
 
@@ -163,11 +289,19 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "codec", "pin_name", "pixel_format", NULL };
+
 ID3ASFilter id3as_output_encoded_video_filter = {
   .name = "encoded video output",
   .init = init,
   .execute = process,
   .flush = flush,
+  .reconfigure = reconfigure,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .sink = 1,
+  .required_options = required_options,
+  .codec_option = CODEC_OPTION_ENCODER
 };
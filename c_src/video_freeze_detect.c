@@ -0,0 +1,151 @@
+#include "id3as_libav.h"
+
+// Flags frozen video.  Each frame's luma block means (from its luma_stats)
+// are compared with the last frame's; the frame is static if no block has
+// moved by more than threshold.  The largest difference is used rather
+// than the mean so that a small moving region - a presenter's face, a
+// clock - is enough to show the feed is live.
+//
+// Like black detect, the FROZEN flag only goes on after frozen_duration of
+// static frames, and only comes off after non_frozen_duration of moving
+// ones.  All that is kept between frames is the block means.
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  int initialised;
+
+  int threshold;
+  AVRational frame_rate;
+
+  double frozen_duration;
+  double non_frozen_duration;
+
+  int frozen_frame_counter;
+  int non_frozen_frame_counter;
+  int frozen_frame_count_threshold;
+  int non_frozen_frame_count_threshold;
+  int frozen;
+
+  uint8_t *prev_blocks;
+  int prev_blocks_size;
+
+} codec_t;
+
+static void do_init(codec_t *this, AVFrame *frame);
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+
+  do_init(this, frame);
+
+  luma_stats *stats = get_luma_stats(frame);
+  int nb_blocks = stats->blocks_width * stats->blocks_height;
+
+  if (this->prev_blocks && nb_blocks == this->prev_blocks_size)
+    {
+      int is_static = max_abs_diff(stats->blocks, this->prev_blocks, nb_blocks) <= this->threshold;
+
+      if (is_static)
+	{
+	  this->frozen_frame_counter++;
+
+	  if (this->frozen_frame_counter > this->frozen_frame_count_threshold)
+	    {
+	      this->frozen_frame_counter = 0;
+	      this->non_frozen_frame_counter = 0;
+	      this->frozen = 1;
+	    }
+	}
+      else
+	{
+	  this->non_frozen_frame_counter++;
+
+	  if (this->non_frozen_frame_counter > this->non_frozen_frame_count_threshold)
+	    {
+	      this->frozen_frame_counter = 0;
+	      this->non_frozen_frame_counter = 0;
+	      this->frozen = 0;
+	    }
+	}
+    }
+  else
+    {
+      this->prev_blocks = av_realloc(this->prev_blocks, nb_blocks);
+      this->prev_blocks_size = nb_blocks;
+    }
+
+  memcpy(this->prev_blocks, stats->blocks, nb_blocks);
+
+  AVFrameSideData *side_data = av_frame_get_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE);
+
+  ((frame_info *)side_data->data)->flags |= (this->frozen ? FROZEN : 0);
+
+  send_to_graph(context, frame, timebase);
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  flush_graph(context);
+}
+
+static void do_init(codec_t *this, AVFrame *frame)
+{
+  if (!this->initialised)
+    {
+      this->frozen_frame_count_threshold = (this->frozen_duration * this->frame_rate.num) / this->frame_rate.den;
+      this->non_frozen_frame_count_threshold = (this->non_frozen_duration * this->frame_rate.num) / this->frame_rate.den;
+
+      this->initialised = 1;
+    }
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->frozen_frame_counter = 0;
+  this->non_frozen_frame_counter = 0;
+  this->frozen = 0;
+  this->initialised = 0;
+}
+
+#define OFFSET(x) offsetof(codec_t, x)
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  av_freep(&this->prev_blocks);
+}
+
+static const AVOption options[] = {
+  { "threshold", "largest change in an 8x8 block's mean luma still counted as static", OFFSET(threshold), AV_OPT_TYPE_INT, { .i64 = 2 }, 0, 255 },
+  { "frozen_duration", "set frozen duration", OFFSET(frozen_duration), AV_OPT_TYPE_DOUBLE, {.dbl = 2.0}, 0, 24*60*60 },
+  { "non_frozen_duration", "set non-frozen duration", OFFSET(non_frozen_duration), AV_OPT_TYPE_DOUBLE, {.dbl = 0.1}, 0, 24*60*60 },
+  {"frame_rate", "frame rate", OFFSET(frame_rate), AV_OPT_TYPE_RATIONAL, {.dbl = 0}, INT_MIN, INT_MAX},
+
+  { NULL },
+};
+
+static const AVClass class = {
+  .class_name = "freeze detect options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const char *required_options[] = { "frame_rate", NULL };
+
+ID3ASFilter id3as_freeze_detect_filter = {
+  .name = "freeze detect",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .required_options = required_options
+};
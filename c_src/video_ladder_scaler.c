@@ -0,0 +1,276 @@
+#include "id3as_libav.h"
+
+// Produces every rung of an encoding ladder from one source frame.  The
+// pixel format conversion (e.g. 10-bit 4:2:2 to yuv420p) is done once at
+// the source size and shared; each rung is then only a same-format scale,
+// written into a pooled frame that goes straight to that rung's downstream
+// filter - normally its encoder.  A rung the size of the source gets the
+// converted frame itself.  Rungs are scaled in parallel when threads > 1.
+//
+// renditions is one WxH per downstream filter, e.g. "1280x720|640x360".
+
+typedef struct _rung
+{
+  int width;
+  int height;
+
+  struct SwsContext *scale_context;
+  AVBufferPool *pool;
+  int pool_size;
+  AVFrame *frame;
+
+} rung;
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  char *renditions;
+  enum PixelFormat output_pixfmt;
+  int threads;
+
+  int num_rungs;
+  rung *rungs;
+
+  int source_width;
+  int source_height;
+  int source_pixfmt;
+
+  struct SwsContext *convert_context;
+  AVBufferPool *pool;
+  int pool_size;
+  AVFrame *converted;
+  AVFrame *source;
+
+  slice_threads *slice_threads;
+
+} codec_t;
+
+static void free_contexts(codec_t *this)
+{
+  sws_freeContext(this->convert_context);
+  this->convert_context = NULL;
+
+  for (int i = 0; i < this->num_rungs; i++)
+    {
+      sws_freeContext(this->rungs[i].scale_context);
+      this->rungs[i].scale_context = NULL;
+    }
+}
+
+// Contexts are (re)built whenever the source size or format changes
+static void do_init(codec_t *this, AVFrame *frame)
+{
+  if (frame->width == this->source_width && frame->height == this->source_height && frame->format == this->source_pixfmt) {
+    return;
+  }
+
+  free_contexts(this);
+
+  this->source_width = frame->width;
+  this->source_height = frame->height;
+  this->source_pixfmt = frame->format;
+
+  if (frame->format != this->output_pixfmt) {
+    this->convert_context = sws_getContext(frame->width, frame->height, frame->format,
+					   frame->width, frame->height, this->output_pixfmt,
+					   SWS_BICUBIC, NULL, NULL, NULL);
+  }
+
+  for (int i = 0; i < this->num_rungs; i++)
+    {
+      rung *rung = &this->rungs[i];
+
+      if (rung->width != frame->width || rung->height != frame->height) {
+	rung->scale_context = sws_getContext(frame->width, frame->height, this->output_pixfmt,
+					     rung->width, rung->height, this->output_pixfmt,
+					     SWS_BICUBIC, NULL, NULL, NULL);
+      }
+    }
+}
+
+static void scale_rungs(void *arg, int slice, int nb_slices)
+{
+  codec_t *this = arg;
+
+  for (int i = slice; i < this->num_rungs; i += nb_slices)
+    {
+      rung *rung = &this->rungs[i];
+
+      if (!rung->scale_context) {
+	continue;
+      }
+
+      rung->frame->format = this->output_pixfmt;
+      rung->frame->width = rung->width;
+      rung->frame->height = rung->height;
+
+      get_pooled_video_buffer(rung->frame, &rung->pool, &rung->pool_size);
+
+      sws_scale(rung->scale_context,
+		(const uint8_t * const *) this->source->data, this->source->linesize, 0, this->source->height,
+		rung->frame->data, rung->frame->linesize);
+
+      av_frame_copy_props(rung->frame, this->source);
+      drop_luma_stats(rung->frame);
+    }
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+  AVFrame *converted = frame;
+
+  do_init(this, frame);
+
+  if (this->convert_context)
+    {
+      converted = this->converted;
+      converted->format = this->output_pixfmt;
+      converted->width = frame->width;
+      converted->height = frame->height;
+
+      get_pooled_video_buffer(converted, &this->pool, &this->pool_size);
+
+      sws_scale(this->convert_context,
+		(const uint8_t * const *) frame->data, frame->linesize, 0, frame->height,
+		converted->data, converted->linesize);
+
+      av_frame_copy_props(converted, frame);
+      drop_luma_stats(converted);
+    }
+
+  // What every rung scales from
+  this->source = converted;
+
+  run_slices(this->slice_threads, scale_rungs, this);
+
+  for (int i = 0; i < this->num_rungs; i++)
+    {
+      rung *rung = &this->rungs[i];
+
+      send_to_filter(context->downstream_filters[i], rung->scale_context ? rung->frame : converted, timebase);
+
+      av_frame_unref(rung->frame);
+    }
+
+  if (converted != frame) {
+    av_frame_unref(converted);
+  }
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  flush_graph(context);
+}
+
+static int parse_renditions(codec_t *this)
+{
+  char *p = this->renditions;
+
+  while (*p)
+    {
+      int width, height, consumed;
+
+      if (sscanf(p, "%dx%d%n", &width, &height, &consumed) != 2 || width <= 0 || height <= 0) {
+	return -1;
+      }
+
+      this->rungs = realloc(this->rungs, sizeof(rung) * (this->num_rungs + 1));
+      memset(&this->rungs[this->num_rungs], 0, sizeof(rung));
+      this->rungs[this->num_rungs].width = width;
+      this->rungs[this->num_rungs].height = height;
+      this->num_rungs++;
+
+      p += consumed;
+      if (*p == '|') p++;
+    }
+
+  return 0;
+}
+
+// Everything init relies on, checked while the graph is built
+static int validate(void *priv_data, int num_downstream_filters, graph_error *error)
+{
+  codec_t *this = priv_data;
+  int ret = 0;
+
+  if (!av_pix_fmt_desc_get(this->output_pixfmt)) {
+    return validation_error(error, "invalid output pixel format %d", this->output_pixfmt);
+  }
+
+  if (parse_renditions(this) != 0) {
+    ret = validation_error(error, "invalid renditions %s - expected WxH|WxH...", this->renditions);
+  }
+  else if (this->num_rungs != num_downstream_filters) {
+    ret = validation_error(error, "%d renditions but %d downstream filters", this->num_rungs, num_downstream_filters);
+  }
+
+  free(this->rungs);
+
+  return ret;
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  parse_renditions(this);
+
+  for (int i = 0; i < this->num_rungs; i++)
+    {
+      this->rungs[i].frame = av_frame_alloc();
+    }
+
+  // Stop the first frame looking like the current source
+  this->source_pixfmt = -1;
+  this->converted = av_frame_alloc();
+  this->slice_threads = allocate_slice_threads(FFMIN(this->threads, this->num_rungs));
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  free_contexts(this);
+  free_slice_threads(&this->slice_threads);
+
+  for (int i = 0; i < this->num_rungs; i++)
+    {
+      av_frame_free(&this->rungs[i].frame);
+    }
+
+  free(this->rungs);
+  av_frame_free(&this->converted);
+  av_buffer_pool_uninit(&this->pool);
+}
+
+static const AVOption options[] = {
+  { "renditions", "WxH for each downstream filter, separated by |", offsetof(codec_t, renditions), AV_OPT_TYPE_STRING },
+  { "output_pixel_format", "the pixel format of every rendition", offsetof(codec_t, output_pixfmt), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "threads", "renditions scaled at once", offsetof(codec_t, threads), AV_OPT_TYPE_INT, { .i64 = 1 }, 1, 64 },
+  { NULL }
+};
+
+static const AVClass class = {
+  .class_name = "video ladder scaler options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const char *required_options[] = { "renditions", "output_pixel_format", NULL };
+
+ID3ASFilter id3as_ladder_scale_video_filter = {
+  .name = "video ladder scaler",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .min_downstream_filters = 1,
+  .required_options = required_options,
+  .validate = validate
+};
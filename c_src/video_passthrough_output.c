@@ -0,0 +1,248 @@
+#include "id3as_libav.h"
+
+// Forwards the compressed packets an encoded video input attached to its
+// frames (attach_packets=1) instead of encoding the frames again.  Packets
+// are written in the order they were received; each waits until its own
+// frame has been seen so that flags set by detectors upstream of us can be
+// merged into its frame_info, or until a later frame shows the decoder is
+// never going to produce it.
+
+typedef struct _pending_packet
+{
+  AVPacket pkt;
+  frame_info *frame_info;
+  int done;
+  struct _pending_packet *next;
+
+} pending_packet;
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  char *pin_name;
+  int stream_id;
+  char *codec_name;
+  int width;
+  int height;
+  enum PixelFormat pixfmt;
+  AVRational frame_rate;
+  char *extradata;
+  int profile;
+  int level;
+  enum ExtradataMode extradata_mode;
+  output_header *header;
+
+  AVCodecContext *context;
+
+  pending_packet *head;
+  pending_packet *tail;
+
+} codec_t;
+
+static void queue_packets(codec_t *this, AVFrameSideData *side_data)
+{
+  unsigned char *p = side_data->data;
+  unsigned char *end = side_data->data + side_data->size;
+
+  while (p < end)
+    {
+      packet_record *record = (packet_record *) p;
+      pending_packet *pending = malloc(sizeof(pending_packet));
+
+      av_init_packet(&pending->pkt);
+      pending->pkt.pts = record->pts;
+      pending->pkt.dts = record->dts;
+      pending->pkt.duration = av_rescale_q(1, this->context->time_base, NINETY_KHZ);
+      pending->pkt.size = record->data_size;
+      pending->pkt.data = malloc(record->data_size);
+      memcpy(pending->pkt.data, record->buffer + record->frame_info_size, record->data_size);
+
+      pending->frame_info = malloc(sizeof(frame_info) + record->frame_info_size);
+      pending->frame_info->flags = 0;
+      pending->frame_info->buffer_size = record->frame_info_size;
+      memcpy(pending->frame_info->buffer, record->buffer, record->frame_info_size);
+
+      pending->done = 0;
+      pending->next = NULL;
+
+      if (this->tail) {
+	this->tail->next = pending;
+      }
+      else {
+	this->head = pending;
+      }
+      this->tail = pending;
+
+      p += PACKET_RECORD_SIZE(record->frame_info_size, record->data_size);
+    }
+}
+
+static void write_done_packets(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  while (this->head && this->head->done)
+    {
+      pending_packet *pending = this->head;
+
+      write_output_from_packet(context->graph_id, this->header, this->pin_name, this->stream_id, this->context, &pending->pkt, pending->frame_info);
+
+      this->head = pending->next;
+      if (!this->head) {
+	this->tail = NULL;
+      }
+
+      free(pending->pkt.data);
+      free(pending->frame_info);
+      free(pending);
+    }
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+  AVFrameSideData *packets = av_frame_get_side_data(frame, PACKETS_SIDE_DATA_TYPE);
+  AVFrameSideData *info = av_frame_get_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE);
+  int64_t pts = av_rescale_q(frame->pts, timebase, NINETY_KHZ);
+
+  if (packets) {
+    queue_packets(this, packets);
+  }
+
+  // The input's last packets, with no picture; flush writes them
+  if (!frame->data[0]) {
+    return;
+  }
+
+  // Frames come out of the decoder in pts order, so anything earlier that
+  // hasn't turned up by now never will
+  for (pending_packet *pending = this->head; pending; pending = pending->next)
+    {
+      if (pending->pkt.pts == pts) {
+	if (frame->key_frame) {
+	  pending->pkt.flags |= AV_PKT_FLAG_KEY;
+	}
+	if (info) {
+	  pending->frame_info->flags |= ((frame_info *) info->data)->flags;
+	}
+	pending->done = 1;
+      }
+      else if (pending->pkt.pts < pts) {
+	pending->done = 1;
+      }
+    }
+
+  write_done_packets(context);
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  for (pending_packet *pending = this->head; pending; pending = pending->next)
+    {
+      pending->done = 1;
+    }
+
+  write_done_packets(context);
+}
+
+static int validate(void *priv_data, int num_downstream_filters, graph_error *error)
+{
+  codec_t *this = priv_data;
+
+  if (this->frame_rate.num <= 0 || this->frame_rate.den <= 0) {
+    return validation_error(error, "invalid frame rate %d/%d", this->frame_rate.num, this->frame_rate.den);
+  }
+
+  return 0;
+}
+
+// The context is never opened - it just describes the stream to
+// write_output_from_packet, which reports its time_base as the frame rate
+// and takes each packet's duration from it
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->header = allocate_output_header(this->extradata_mode);
+
+  this->context = avcodec_alloc_context3(get_decoder(this->codec_name));
+  this->context->width = this->width;
+  this->context->height = this->height;
+  this->context->pix_fmt = this->pixfmt;
+  this->context->time_base = av_inv_q(this->frame_rate);
+  this->context->profile = this->profile;
+  this->context->level = this->level;
+
+  if (this->extradata)
+    {
+      int size = strlen(this->extradata);
+
+      this->context->extradata = av_mallocz(size + FF_INPUT_BUFFER_PADDING_SIZE);
+      this->context->extradata_size = av_base64_decode(this->context->extradata, this->extradata, size);
+    }
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  while (this->head)
+    {
+      pending_packet *pending = this->head;
+
+      this->head = pending->next;
+
+      free(pending->pkt.data);
+      free(pending->frame_info);
+      free(pending);
+    }
+
+  free_codec_context(&this->context);
+  free_output_header(&this->header);
+}
+
+static const AVOption options[] = {
+  { "stream_id", "The stream id for the output stream", offsetof(codec_t, stream_id), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "pin_name", "The pin name for the output stream", offsetof(codec_t, pin_name), AV_OPT_TYPE_STRING },
+  { "codec", "The codec of the packets", offsetof(codec_t, codec_name), AV_OPT_TYPE_STRING },
+  { "width", "The width of the frame", offsetof(codec_t, width), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "height", "The height of the frame", offsetof(codec_t, height), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "pixel_format", "The pixel format", offsetof(codec_t, pixfmt), AV_OPT_TYPE_INT, { .i64 = PIX_FMT_YUV420P }, INT_MIN, INT_MAX },
+  { "frame_rate", "The frame rate of the source", offsetof(codec_t, frame_rate), AV_OPT_TYPE_RATIONAL, { .dbl = 0 }, INT_MIN, INT_MAX },
+  { "extradata", "codec extradata", offsetof(codec_t, extradata), AV_OPT_TYPE_STRING, {.str = NULL} },
+  { "profile", "The codec profile", offsetof(codec_t, profile), AV_OPT_TYPE_INT, { .i64 = FF_PROFILE_UNKNOWN }, INT_MIN, INT_MAX },
+  { "level", "The codec level", offsetof(codec_t, level), AV_OPT_TYPE_INT, { .i64 = FF_LEVEL_UNKNOWN }, INT_MIN, INT_MAX },
+  { "extradata_mode", "when to send the codec extradata", offsetof(codec_t, extradata_mode), AV_OPT_TYPE_INT, { .i64 = EXTRADATA_ALWAYS }, EXTRADATA_ALWAYS, EXTRADATA_ON_KEYFRAME, 0, "extradata_mode" },
+  { "always", "with every frame", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ALWAYS }, 0, 0, 0, "extradata_mode" },
+  { "on_change", "with the first frame and when it changes", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ON_CHANGE }, 0, 0, 0, "extradata_mode" },
+  { "keyframes", "on change and with every keyframe", 0, AV_OPT_TYPE_CONST, { .i64 = EXTRADATA_ON_KEYFRAME }, 0, 0, 0, "extradata_mode" },
+  { NULL },
+};
+
+static const AVClass class = {
+  .class_name = "video passthrough options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const char *required_options[] = { "pin_name", "codec", "width", "height", "frame_rate", NULL };
+
+ID3ASFilter id3as_output_passthrough_video_filter = {
+  .name = "passthrough video output",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .sink = 1,
+  .required_options = required_options,
+  .codec_option = CODEC_OPTION_DECODER,
+  .takes_packet_frames = 1,
+  .validate = validate
+};
@@ -79,6 +79,15 @@ static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
   this->device_fd = open(this->device_name, O_RDONLY);
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  close(this->device_fd);
+  av_frame_free(&this->frame);
+  free(this->data);
+}
+
 static const AVOption options[] = {
   { "device", "The codec for encoding", offsetof(codec_t, device_name), AV_OPT_TYPE_STRING },
   { "width", "the width", offsetof(codec_t, width), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
@@ -96,11 +105,16 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "device", "width", "height", "pixel_format", NULL };
+
 ID3ASFilter id3as_raw_video_generator_input = {
   .name = "raw video generator",
   .init = init,
-  .execute = process,
+  .execute_input = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .required_options = required_options
 };
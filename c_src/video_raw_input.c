@@ -20,13 +20,22 @@ static void process(ID3ASFilterContext *context,
 {
   codec_t *this = context->priv_data;
 
+  this->frame->format = this->input_pixfmt;
+  this->frame->width = this->width;
+  this->frame->height = this->height;
+
   avpicture_fill((AVPicture *) this->frame, data, this->input_pixfmt, this->width, this->height);
 
   this->frame->interlaced_frame = this->interlaced;
 
   set_frame_metadata(this->frame, metadata);
 
+  add_frame_info_side_data(this->frame, opaque, opaque_size);
+
   send_to_graph(context, this->frame, NINETY_KHZ);
+
+  // Drops the side data - the picture itself belongs to the port buffer
+  av_frame_unref(this->frame);
 }
 
 static void flush(ID3ASFilterContext *context) 
@@ -39,9 +48,13 @@ static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
   codec_t *this = context->priv_data;
 
   this->frame = av_frame_alloc();
-  this->frame->format = this->input_pixfmt;
-  this->frame->width = this->width;
-  this->frame->height = this->height;
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  av_frame_free(&this->frame);
 }
 
 static const AVOption options[] = {
@@ -59,11 +72,16 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "width", "height", "pixel_format", NULL };
+
 ID3ASFilter id3as_raw_video_input = {
   .name = "raw video input",
   .init = init,
-  .execute = process,
+  .execute_input = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .required_options = required_options
 };
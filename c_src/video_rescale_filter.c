@@ -6,6 +6,8 @@ typedef struct _codec_t
   int initialised;
 
   struct SwsContext *convert_context;
+  AVBufferPool *pool;
+  int pool_size;
 
   enum PixelFormat output_pixfmt;
   int output_width;
@@ -29,13 +31,14 @@ static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational time
     output_frame->width = this->output_width;
     output_frame->height = this->output_height;
 
-    av_frame_get_buffer(output_frame, 32);
+    get_pooled_video_buffer(output_frame, &this->pool, &this->pool_size);
 
     sws_scale(this->convert_context,
 	      (const uint8_t * const *) frame->data, frame->linesize, 0, frame->height, 
 	      output_frame->data, output_frame->linesize);  
 
     av_frame_copy_props(output_frame, frame);
+    drop_luma_stats(output_frame);
 
     output_frame->format = this->output_pixfmt;
     output_frame->width = this->output_width;
@@ -86,6 +89,14 @@ static void do_init(codec_t *this, AVFrame *frame)
   this->initialised = 1;
 }
 
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  sws_freeContext(this->convert_context);
+  av_buffer_pool_uninit(&this->pool);
+}
+
 static const AVOption options[] = {
   { "output_width", "the output width", offsetof(codec_t, output_width), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
   { "output_height", "the output height", offsetof(codec_t, output_height), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
@@ -100,11 +111,16 @@ static const AVClass class = {
   .version    = LIBAVUTIL_VERSION_INT,
 };
 
+static const char *required_options[] = { "output_width", "output_height", "output_pixel_format", NULL };
+
 ID3ASFilter id3as_rescale_video_filter = {
   .name = "video rescaler",
   .init = init,
   .execute = process,
   .flush = flush,
+  .close = close_filter,
   .priv_data_size = sizeof(codec_t),
-  .priv_class = &class
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .required_options = required_options
 };
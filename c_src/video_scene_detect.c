@@ -0,0 +1,142 @@
+#include <math.h>
+
+#include "id3as_libav.h"
+
+// Scores every frame for a change of scene, and measures how busy it is,
+// from the block means and histogram in its luma_stats (so the luma plane
+// is only read once however many analysis filters there are).
+//
+// The scene score follows the usual mean-absolute-frame-difference test:
+// a cut is a frame whose MAFD from the last frame is high and also unlike
+// the last frame's own MAFD, which steadies the score through pans and
+// fades.  A cut must also move the histogram by histogram_threshold, and
+// be min_scene_duration after the last cut, before the frame is flagged
+// SCENE_CHANGE (which encoded video outputs turn into a keyframe).
+//
+// Every frame gets SCENE_STATS_SIDE_DATA_TYPE side data with the scores.
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  double threshold;
+  double histogram_threshold;
+  double min_scene_duration;
+
+  uint8_t *prev_blocks;
+  int prev_blocks_size;
+  uint32_t prev_histogram[256];
+  double prev_mafd;
+  int have_prev;
+
+  int64_t last_cut_pts;
+
+} codec_t;
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+  luma_stats *stats = get_luma_stats(frame);
+  int nb_blocks = stats->blocks_width * stats->blocks_height;
+  scene_stats scene = { 0 };
+
+  if (nb_blocks > 0)
+    {
+      uint64_t spatial = sum_abs_diff(stats->blocks, stats->blocks + 1, nb_blocks - 1) +
+	sum_abs_diff(stats->blocks, stats->blocks + stats->blocks_width, nb_blocks - stats->blocks_width);
+
+      scene.spatial_complexity = (double) spatial / (2 * nb_blocks);
+    }
+
+  if (this->have_prev && nb_blocks == this->prev_blocks_size)
+    {
+      double mafd = (double) sum_abs_diff(stats->blocks, this->prev_blocks, nb_blocks) / nb_blocks;
+      uint64_t moved = 0;
+
+      for (int i = 0; i < 256; i++)
+	{
+	  moved += abs((int) stats->histogram[i] - (int) this->prev_histogram[i]);
+	}
+
+      scene.temporal_complexity = mafd;
+      scene.scene_score = av_clipf(FFMIN(mafd, fabs(mafd - this->prev_mafd)) / 100.0, 0, 1);
+      scene.histogram_difference = (double) moved / (2.0 * stats->width * stats->height);
+
+      this->prev_mafd = mafd;
+
+      if (scene.scene_score >= this->threshold &&
+	  scene.histogram_difference >= this->histogram_threshold &&
+	  (this->last_cut_pts == AV_NOPTS_VALUE ||
+	   av_rescale_q(frame->pts - this->last_cut_pts, timebase, AV_TIME_BASE_Q) >= this->min_scene_duration * AV_TIME_BASE))
+	{
+	  AVFrameSideData *side_data = av_frame_get_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE);
+
+	  ((frame_info *)side_data->data)->flags |= SCENE_CHANGE;
+
+	  this->last_cut_pts = frame->pts;
+	}
+    }
+  else
+    {
+      this->prev_blocks = av_realloc(this->prev_blocks, nb_blocks);
+      this->prev_blocks_size = nb_blocks;
+      this->prev_mafd = 0;
+      this->have_prev = 1;
+    }
+
+  memcpy(this->prev_blocks, stats->blocks, nb_blocks);
+  memcpy(this->prev_histogram, stats->histogram, sizeof(this->prev_histogram));
+
+  add_analysis_side_data(frame, SCENE_STATS_SIDE_DATA_TYPE, &scene, sizeof(scene_stats));
+
+  send_to_graph(context, frame, timebase);
+}
+
+static void flush(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  this->have_prev = 0;
+  this->last_cut_pts = AV_NOPTS_VALUE;
+
+  flush_graph(context);
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->last_cut_pts = AV_NOPTS_VALUE;
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  av_freep(&this->prev_blocks);
+}
+
+static const AVOption options[] = {
+  { "threshold", "scene score (0 - 1) at which a frame is a cut", offsetof(codec_t, threshold), AV_OPT_TYPE_DOUBLE, { .dbl = 0.3 }, 0, 1 },
+  { "histogram_threshold", "share of pixels (0 - 1) whose level must move for a cut", offsetof(codec_t, histogram_threshold), AV_OPT_TYPE_DOUBLE, { .dbl = 0.2 }, 0, 1 },
+  { "min_scene_duration", "seconds after a cut before another is flagged", offsetof(codec_t, min_scene_duration), AV_OPT_TYPE_DOUBLE, { .dbl = 0.5 }, 0, 24*60*60 },
+  { NULL }
+};
+
+static const AVClass class = {
+  .class_name = "scene detect options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+ID3ASFilter id3as_scene_detect_filter = {
+  .name = "scene detect",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO
+};
@@ -0,0 +1,286 @@
+#include "id3as_libav.h"
+#include "i_utils.h"
+
+// Thumbnails and scrub sprite sheets.  Frames are picked every interval
+// seconds (or the first keyframe after each interval, in keyframe mode)
+// before anything else is done with them; each picked frame is scaled
+// straight into the next tile of a columns x rows canvas, and the canvas
+// is encoded (mjpeg or png) once it is full, or at flush.  Unpicked frames
+// cost nothing but a pts comparison.
+//
+// The canvas uses the encoder's first supported pixel format, and each
+// sheet goes out with the pts and frame_info of its first tile and a
+// duration reaching to its last.
+
+enum ThumbnailMode {
+  THUMBNAIL_PERIODIC,
+  THUMBNAIL_KEYFRAMES
+};
+
+typedef struct _codec_t
+{
+  AVClass *av_class;
+
+  char *pin_name;
+  int stream_id;
+  char *codec_name;
+  enum ThumbnailMode mode;
+  double interval;
+  int tile_width;
+  int tile_height;
+  int columns;
+  int rows;
+
+  AVDictionary *codec_options;
+  AVCodec *codec;
+  AVCodecContext *context;
+  output_header *header;
+
+  struct SwsContext *scale_context;
+  int source_width;
+  int source_height;
+  int source_pixfmt;
+
+  AVFrame *canvas;
+  int tiles;
+  int64_t next_pts;
+  int64_t first_pts;
+  int64_t last_pts;
+  frame_info *first_frame_info;
+
+} codec_t;
+
+static i_mutex_t mutex = INITIALISE_STATIC_MUTEX();
+
+// Black in both full and limited range YUV is close enough at thumbnail
+// sizes; chroma planes are recognised by being subsampled
+static void clear_canvas(codec_t *this)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(this->canvas->format);
+  int yuv = desc->log2_chroma_w || desc->log2_chroma_h;
+
+  for (int p = 0; p < av_pix_fmt_count_planes(this->canvas->format); p++)
+    {
+      int rows = (yuv && p > 0) ? -((-this->canvas->height) >> desc->log2_chroma_h) : this->canvas->height;
+
+      memset(this->canvas->data[p], (yuv && p > 0) ? 128 : 0, this->canvas->linesize[p] * rows);
+    }
+}
+
+static void open_encoder(codec_t *this)
+{
+  this->codec = get_encoder(this->codec_name);
+
+  if (!this->codec->pix_fmts) {
+    ERRORFMT("%s can't be used for thumbnails\n", this->codec_name);
+    exit(1);
+  }
+
+  AVDictionary *codec_options = NULL;
+  av_dict_copy(&codec_options, this->codec_options, 0);
+  av_dict_set(&codec_options, "time_base", "1/90000", AV_DICT_DONT_OVERWRITE);
+
+  i_mutex_lock(&mutex);
+  this->context = allocate_video_context(this->codec, this->tile_width * this->columns, this->tile_height * this->rows,
+					 this->codec->pix_fmts[0], NULL, 0, codec_options);
+  i_mutex_unlock(&mutex);
+
+  this->canvas = av_frame_alloc();
+  this->canvas->format = this->context->pix_fmt;
+  this->canvas->width = this->context->width;
+  this->canvas->height = this->context->height;
+
+  av_frame_get_buffer(this->canvas, 32);
+  clear_canvas(this);
+}
+
+static void write_sheet(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+  AVPacket pkt;
+  int got_packet = 0;
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  this->canvas->pts = av_rescale_q(this->first_pts, NINETY_KHZ, this->context->time_base);
+
+  if (avcodec_encode_video2(this->context, &pkt, this->canvas, &got_packet) != 0) {
+    ERRORFMT("Failed to encode thumbnail with %s\n", this->codec_name);
+  }
+
+  if (got_packet)
+    {
+      pkt.pts = pkt.dts = this->first_pts;
+      pkt.duration = this->last_pts - this->first_pts;
+
+      write_output_from_packet(context->graph_id, this->header, this->pin_name, this->stream_id, this->context, &pkt, this->first_frame_info);
+
+      av_free_packet(&pkt);
+    }
+
+  this->tiles = 0;
+  clear_canvas(this);
+}
+
+// Keeps the picked frame's frame_info if it is the first on the sheet
+static void keep_frame_info(codec_t *this, AVFrame *frame)
+{
+  AVFrameSideData *side_data = av_frame_get_side_data(frame, FRAME_INFO_SIDE_DATA_TYPE);
+
+  if (side_data) {
+    this->first_frame_info = realloc(this->first_frame_info, side_data->size);
+    memcpy(this->first_frame_info, side_data->data, side_data->size);
+  }
+  else {
+    this->first_frame_info = realloc(this->first_frame_info, sizeof(frame_info));
+    this->first_frame_info->flags = 0;
+    this->first_frame_info->buffer_size = 0;
+  }
+}
+
+static void add_tile(codec_t *this, AVFrame *frame)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(this->canvas->format);
+  int x = (this->tiles % this->columns) * this->tile_width;
+  int y = (this->tiles / this->columns) * this->tile_height;
+  uint8_t *tile[4] = { NULL };
+
+  if (frame->width != this->source_width || frame->height != this->source_height || frame->format != this->source_pixfmt)
+    {
+      sws_freeContext(this->scale_context);
+
+      this->scale_context = sws_getContext(frame->width, frame->height, frame->format,
+					   this->tile_width, this->tile_height, this->canvas->format,
+					   SWS_BICUBIC, NULL, NULL, NULL);
+      this->source_width = frame->width;
+      this->source_height = frame->height;
+      this->source_pixfmt = frame->format;
+    }
+
+  // Scale into the tile in place, so the canvas is the only copy.  Tiles
+  // are filled left to right, so anything swscale writes past the end of a
+  // row only lands in tiles still to be drawn.
+  for (int p = 0; p < av_pix_fmt_count_planes(this->canvas->format); p++)
+    {
+      int chroma = p == 1 || p == 2;
+      int row = chroma ? y >> desc->log2_chroma_h : y;
+
+      tile[p] = this->canvas->data[p] + row * this->canvas->linesize[p] + av_image_get_linesize(this->canvas->format, x, p);
+    }
+
+  sws_scale(this->scale_context,
+	    (const uint8_t * const *) frame->data, frame->linesize, 0, frame->height,
+	    tile, this->canvas->linesize);
+
+  this->tiles++;
+}
+
+static void process(ID3ASFilterContext *context, AVFrame *frame, AVRational timebase)
+{
+  codec_t *this = context->priv_data;
+  int64_t pts = av_rescale_q(frame->pts, timebase, NINETY_KHZ);
+
+  if (this->next_pts != AV_NOPTS_VALUE && pts < this->next_pts) {
+    return;
+  }
+
+  if (this->mode == THUMBNAIL_KEYFRAMES && !frame->key_frame) {
+    return;
+  }
+
+  this->next_pts = pts + (int64_t) (this->interval * 90000);
+
+  if (!this->context) {
+    open_encoder(this);
+  }
+
+  if (this->tiles == 0) {
+    this->first_pts = pts;
+    keep_frame_info(this, frame);
+  }
+
+  this->last_pts = pts;
+
+  add_tile(this, frame);
+
+  if (this->tiles == this->columns * this->rows) {
+    write_sheet(context);
+  }
+}
+
+// A partly filled sheet goes out with its remaining tiles left black
+static void flush(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  if (this->tiles > 0) {
+    write_sheet(context);
+  }
+
+  this->next_pts = AV_NOPTS_VALUE;
+}
+
+static void init(ID3ASFilterContext *context, AVDictionary *codec_options)
+{
+  codec_t *this = context->priv_data;
+
+  this->codec_options = codec_options;
+  this->header = allocate_output_header(EXTRADATA_ALWAYS);
+  this->next_pts = AV_NOPTS_VALUE;
+  this->source_pixfmt = -1;
+}
+
+static void close_filter(ID3ASFilterContext *context)
+{
+  codec_t *this = context->priv_data;
+
+  i_mutex_lock(&mutex);
+  free_codec_context(&this->context);
+  i_mutex_unlock(&mutex);
+
+  free_output_header(&this->header);
+  av_dict_free(&this->codec_options);
+  sws_freeContext(this->scale_context);
+  av_frame_free(&this->canvas);
+  free(this->first_frame_info);
+}
+
+static const AVOption options[] = {
+  { "stream_id", "The stream id for the output stream", offsetof(codec_t, stream_id), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX },
+  { "pin_name", "The pin name for the output stream", offsetof(codec_t, pin_name), AV_OPT_TYPE_STRING },
+  { "codec", "The image codec", offsetof(codec_t, codec_name), AV_OPT_TYPE_STRING, { .str = "mjpeg" } },
+  { "mode", "how frames are picked", offsetof(codec_t, mode), AV_OPT_TYPE_INT, { .i64 = THUMBNAIL_PERIODIC }, THUMBNAIL_PERIODIC, THUMBNAIL_KEYFRAMES, 0, "mode" },
+  { "periodic", "every interval seconds", 0, AV_OPT_TYPE_CONST, { .i64 = THUMBNAIL_PERIODIC }, 0, 0, 0, "mode" },
+  { "keyframes", "the first keyframe at least interval seconds after the last pick", 0, AV_OPT_TYPE_CONST, { .i64 = THUMBNAIL_KEYFRAMES }, 0, 0, 0, "mode" },
+  { "interval", "seconds between thumbnails", offsetof(codec_t, interval), AV_OPT_TYPE_DOUBLE, { .dbl = 10 }, 0, 24*60*60 },
+  { "tile_width", "the width of each thumbnail", offsetof(codec_t, tile_width), AV_OPT_TYPE_INT, { .i64 = -1 }, 1, 4096 },
+  { "tile_height", "the height of each thumbnail", offsetof(codec_t, tile_height), AV_OPT_TYPE_INT, { .i64 = -1 }, 1, 4096 },
+  { "columns", "thumbnails across a sheet", offsetof(codec_t, columns), AV_OPT_TYPE_INT, { .i64 = 1 }, 1, 64 },
+  { "rows", "thumbnails down a sheet", offsetof(codec_t, rows), AV_OPT_TYPE_INT, { .i64 = 1 }, 1, 64 },
+  { NULL }
+};
+
+static const AVClass class = {
+  .class_name = "thumbnail output options",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const char *required_options[] = { "pin_name", "tile_width", "tile_height", NULL };
+
+ID3ASFilter id3as_output_thumbnail_video_filter = {
+  .name = "thumbnail output",
+  .init = init,
+  .execute = process,
+  .flush = flush,
+  .close = close_filter,
+  .priv_data_size = sizeof(codec_t),
+  .priv_class = &class,
+  .media_type = AVMEDIA_TYPE_VIDEO,
+  .sink = 1,
+  .required_options = required_options,
+  .codec_option = CODEC_OPTION_ENCODER
+};